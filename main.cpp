@@ -19,25 +19,23 @@ int main(int argc, char *argv[])
     QString XTestPath = "data/x_test.csv";
     QString YTrainPath = "data/y_train.csv";
     QString YTestPath = "data/y_test.csv";
+    QString YPredPath = "data/y_pred.csv";
 
     qInfo() << "Reading and preparing data." << Qt::endl;
 
     //get the data form the csv
+    //the test features are streamed when predicting and the test labels when evaluating
     auto XTrainRawVar = readCSV(XTrainPath);
-    auto XTestRawVar = readCSV(XTestPath);
     auto YTrainRawVar = readCSV(YTrainPath, "Y");
-    auto YTestRawVar = readCSV(YTestPath, "Y");
 
     //get the data in libsvm format
     auto XTrain = std::get<std::vector<svm_node*>>(getData(XTrainRawVar));
-    auto XTest =  std::get<std::vector<svm_node*>>(getData(XTestRawVar));
     auto YTrain = std::get<std::vector<double>>(getData(YTrainRawVar));
-    auto YTest = std::get<std::vector<double>>(getData(YTrainRawVar));
 
     qInfo() << "Setting up model problem and parameters." << Qt::endl;
 
-    //set up the SVM problem
-    svm_problem prob;
+    //set up the SVM problem, zeroed so the samples are unweighted
+    svm_problem prob = {};
 
     //number of training samples
     prob.l = XTrain.size();
@@ -48,8 +46,8 @@ int main(int argc, char *argv[])
     //set the data
     prob.x = XTrain.data();
 
-    //set up the SVM parameters
-    svm_parameter params;
+    //set up the SVM parameters, zeroed so unused options are off
+    svm_parameter params = {};
 
     params.svm_type = C_SVC;
     params.kernel_type = RBF;
@@ -58,6 +56,7 @@ int main(int argc, char *argv[])
     params.eps = 1e-3; //stopping criteria
     params.shrinking = 1;
     params.cache_size = 200;
+    params.sparse_csr = 1; //faster kernel columns, same model
     params.probability = 0;
     params.nr_weight = 2;
 
@@ -131,13 +130,23 @@ int main(int argc, char *argv[])
 
     qInfo() << "Making Prediction." << Qt::endl;
 
-    //make predictions on the set
-    std::vector<double> pred = predict(model, XTest);
+    //score the test set chunk by chunk into the predictions file
+    if (predictCSV(model, XTestPath, YPredPath) < 0) {
+        std::cerr << "Error: Failed to score the test set." << std::endl;
+        return 1;
+    }
 
     qInfo() << "Computing performance metrics." << Qt::endl;
 
+    //compare the predictions with the test labels chunk by chunk
+    ConfusionMatrix matrix;
+    if (evaluateCSV(YTestPath, YPredPath, matrix) < 0) {
+        std::cerr << "Error: Failed to evaluate the predictions." << std::endl;
+        return 1;
+    }
+
     //print the classification report
-    classificationReport(YTest, pred, ostream);
+    matrix.report(ostream);
 
     return a.exec();
 }
@@ -0,0 +1,144 @@
+#ifndef MODELREGISTRY_H
+#define MODELREGISTRY_H
+
+#include "svm2.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * Live model that can be replaced while it is scoring
+ *
+ * Readers never take a lock: each scoring thread owns a Reader whose
+ * hazard slot announces the model it is using. A replacement is published
+ * with one atomic exchange and the old model is freed only once no slot
+ * holds it any more, so predictions in flight finish on the old model.
+ */
+class ModelRegistry {
+    struct Slot {
+        std::atomic<svm_model*> hazard{nullptr};
+        std::atomic<bool> inUse{true};
+        Slot* next = nullptr;
+    };
+
+public:
+    typedef svm_model* (*Loader)(const char* fileName);
+
+    //hazard slot of one scoring thread
+    class Reader {
+    public:
+        explicit Reader(ModelRegistry& registry) : registry(registry), slot(registry.claimSlot()) {}
+        ~Reader() {
+            slot->hazard.store(nullptr);
+            slot->inUse.store(false);
+        }
+
+        //the current model, valid until release
+        svm_model* acquire() {
+            svm_model* model = registry.current.load();
+            while (true) {
+                slot->hazard.store(model);
+                svm_model* again = registry.current.load();
+                if (again == model) {
+                    return model;
+                }
+                model = again;
+            }
+        }
+
+        void release() {
+            slot->hazard.store(nullptr);
+        }
+
+    private:
+        ModelRegistry& registry;
+        Slot* slot;
+    };
+
+    explicit ModelRegistry(svm_model* model = nullptr, Loader loader = svm_load_model)
+        : current(model), loader(loader) {}
+
+    ~ModelRegistry() {
+        while (loading.load() > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        svm_model* model = current.exchange(nullptr);
+        svm_free_and_destroy_model(&model);
+
+        for (Slot* slot = slots.load(); slot != nullptr;) {
+            Slot* next = slot->next;
+            delete slot;
+            slot = next;
+        }
+    }
+
+    //make model the current one, free the old one once no reader uses it
+    void publish(svm_model* model) {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        svm_model* old = current.exchange(model);
+        generation++;
+        while (old != nullptr && isHazard(old)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        svm_free_and_destroy_model(&old);
+    }
+
+    //load a model file on a background thread and publish it, keep the current model on failure
+    void loadAsync(const std::string& fileName) {
+        loading++;
+        std::thread([this, fileName] {
+            svm_model* model = loader(fileName.c_str());
+            if (model == nullptr) {
+                fprintf(stderr, "ERROR: can't load model %s, keeping the current one\n", fileName.c_str());
+            } else {
+                publish(model);
+            }
+            loading--;
+        }).detach();
+    }
+
+    //number of models published so far
+    long long version() const {
+        return generation.load();
+    }
+
+private:
+    //reuse a free slot or push a new one, slots are never unlinked
+    Slot* claimSlot() {
+        for (Slot* slot = slots.load(); slot != nullptr; slot = slot->next) {
+            bool expected = false;
+            if (slot->inUse.compare_exchange_strong(expected, true)) {
+                return slot;
+            }
+        }
+        Slot* slot = new Slot;
+        slot->next = slots.load();
+        while (!slots.compare_exchange_weak(slot->next, slot)) {
+        }
+        return slot;
+    }
+
+    bool isHazard(svm_model* model) {
+        for (Slot* slot = slots.load(); slot != nullptr; slot = slot->next) {
+            if (slot->hazard.load() == model) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::atomic<svm_model*> current;
+    std::atomic<Slot*> slots{nullptr};
+    Loader loader;
+
+    //serializes publishers, never taken by readers
+    std::mutex writerMutex;
+    std::atomic<long long> generation{0};
+    std::atomic<int> loading{0};
+};
+
+#endif // MODELREGISTRY_H
@@ -0,0 +1,408 @@
+/*
+ * Prediction server
+ *
+ * Keeps one or more models in memory and answers on a Unix domain socket
+ * or a localhost TCP port. Requests from all connections are queued per
+ * model and scored together with svm_predict_batch, a batch is sent once it
+ * is full or its first request has waited max_delay microseconds.
+ *
+ * usage: svmserve [-s socket_path | -p port] [-b max_batch] [-d max_delay_us] name=model_file ...
+ *
+ * The protocol is one line per request and one line per reply:
+ *   predict <name> <index>:<value> ...   ->  <prediction>
+ *   load <name> <model_file>             ->  ok, the model is replaced once the file is loaded
+ *   stats                                ->  requests, batches, latency percentiles and throughput
+ * Errors are answered with a line starting with "error". A connection whose
+ * line exceeds 16 MB gets "error line too long" and is closed.
+ */
+
+#include "svm2.h"
+#include "modelregistry.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+//latencies of the most recent requests, in microseconds
+#define LATENCY_WINDOW 100000
+
+//longest request line, a connection sending a longer one is dropped
+#define MAX_LINE_LENGTH (16 << 20)
+
+//a parsed request waiting for its batch
+struct Request {
+    std::vector<svm_node> x;
+    Clock::time_point arrival;
+    std::promise<double> result;
+};
+
+//counters shared by all models
+struct Stats {
+    std::mutex mutex;
+    long long requests = 0;
+    long long batches = 0;
+    std::vector<double> latency;    //ring buffer of LATENCY_WINDOW entries
+    size_t next = 0;
+    Clock::time_point start = Clock::now();
+
+    void record(double micros) {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests++;
+        if (latency.size() < LATENCY_WINDOW) {
+            latency.push_back(micros);
+        } else {
+            latency[next] = micros;
+            next = (next + 1) % LATENCY_WINDOW;
+        }
+    }
+
+    std::string report() {
+        std::vector<double> sorted;
+        long long nrRequests, nrBatches;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sorted = latency;
+            nrRequests = requests;
+            nrBatches = batches;
+        }
+        double p50 = 0, p99 = 0;
+        if (!sorted.empty()) {
+            std::sort(sorted.begin(), sorted.end());
+            p50 = sorted[(sorted.size() - 1) / 2];
+            p99 = sorted[(sorted.size() - 1) * 99 / 100];
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "requests %lld batches %lld mean_batch %.2f p50_us %.1f p99_us %.1f throughput_rps %.1f",
+                 nrRequests, nrBatches, nrBatches ? (double)nrRequests / nrBatches : 0.0,
+                 p50, p99, elapsed > 0 ? nrRequests / elapsed : 0.0);
+        return line;
+    }
+};
+
+/*
+ * Model with its queue of requests
+ * a scoring thread takes up to maxBatch requests, waiting at most
+ * maxDelay after the oldest one arrived, and scores them at once
+ * with whichever model the registry holds at that moment
+ */
+class ModelServer {
+public:
+    ModelServer(svm_model* model, int maxBatch, int maxDelay, Stats& stats)
+        : registry(model), maxBatch(maxBatch), maxDelay(maxDelay), stats(stats) {
+        worker = std::thread(&ModelServer::run, this);
+    }
+
+    ~ModelServer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        arrived.notify_one();
+        worker.join();
+    }
+
+    //replace the model without stopping the scoring
+    void reload(const std::string& fileName) {
+        registry.loadAsync(fileName);
+    }
+
+    std::future<double> submit(Request* request) {
+        std::future<double> result = request->result.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(request);
+        }
+        arrived.notify_one();
+        return result;
+    }
+
+private:
+    void run() {
+        std::vector<Request*> batch;
+        std::vector<const svm_node*> x;
+        std::vector<double> pred;
+        ModelRegistry::Reader reader(registry);
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                arrived.wait(lock, [this] { return !queue.empty() || stopping; });
+                if (queue.empty()) {
+                    return;
+                }
+
+                //wait for more requests until the batch is full or the oldest is due
+                Clock::time_point due = queue.front()->arrival + std::chrono::microseconds(maxDelay);
+                arrived.wait_until(lock, due, [this] { return (int)queue.size() >= maxBatch || stopping; });
+
+                int size = std::min((int)queue.size(), maxBatch);
+                batch.assign(queue.begin(), queue.begin() + size);
+                queue.erase(queue.begin(), queue.begin() + size);
+            }
+
+            x.resize(batch.size());
+            pred.resize(batch.size());
+            for (size_t i = 0; i < batch.size(); i++) {
+                x[i] = batch[i]->x.data();
+            }
+            svm_predict_batch(reader.acquire(), x.data(), (int)batch.size(), pred.data());
+            reader.release();
+
+            {
+                std::lock_guard<std::mutex> lock(stats.mutex);
+                stats.batches++;
+            }
+            for (size_t i = 0; i < batch.size(); i++) {
+                batch[i]->result.set_value(pred[i]);
+            }
+        }
+    }
+
+    ModelRegistry registry;
+    int maxBatch;
+    int maxDelay;
+    Stats& stats;
+
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::deque<Request*> queue;
+    bool stopping = false;
+    std::thread worker;
+};
+
+static std::map<std::string, ModelServer*> models;
+static Stats stats;
+
+//parse "<index>:<value> ..." into x, ending it with index -1
+static bool parseRow(const char* p, std::vector<svm_node>& x) {
+    x.clear();
+    while (true) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        char* end;
+        long index = strtol(p, &end, 10);
+        if (end == p || *end != ':') {
+            return false;
+        }
+        p = end + 1;
+        double value = strtod(p, &end);
+        if (end == p) {
+            return false;
+        }
+        p = end;
+        x.push_back({(int)index, value});
+    }
+    x.push_back({-1, 0});
+    return true;
+}
+
+//the reply to one request line
+static std::string handle(const std::string& line) {
+    Clock::time_point arrival = Clock::now();
+
+    if (line == "stats") {
+        return stats.report();
+    }
+
+    if (line.compare(0, 5, "load ") == 0) {
+        size_t nameEnd = line.find(' ', 5);
+        if (nameEnd == std::string::npos) {
+            return "error expected load <name> <model_file>";
+        }
+        auto it = models.find(line.substr(5, nameEnd - 5));
+        if (it == models.end()) {
+            return "error unknown model " + line.substr(5, nameEnd - 5);
+        }
+        it->second->reload(line.substr(nameEnd + 1));
+        return "ok";
+    }
+
+    if (line.compare(0, 8, "predict ") != 0) {
+        return "error unknown command";
+    }
+
+    size_t nameEnd = line.find(' ', 8);
+    std::string name = line.substr(8, nameEnd == std::string::npos ? std::string::npos : nameEnd - 8);
+    auto it = models.find(name);
+    if (it == models.end()) {
+        return "error unknown model " + name;
+    }
+
+    Request request;
+    request.arrival = arrival;
+    if (!parseRow(nameEnd == std::string::npos ? "" : line.c_str() + nameEnd, request.x)) {
+        return "error malformed row";
+    }
+
+    double pred = it->second->submit(&request).get();
+    stats.record(std::chrono::duration<double, std::micro>(Clock::now() - arrival).count());
+
+    char reply[64];
+    snprintf(reply, sizeof(reply), "%.17g", pred);
+    return reply;
+}
+
+//answer the requests of one connection in order
+static void serveConnection(int fd) {
+    std::string buffer;
+    char chunk[65536];
+
+    while (true) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            break;
+        }
+        buffer.append(chunk, n);
+
+        size_t begin = 0, end;
+        std::string replies;
+        while ((end = buffer.find('\n', begin)) != std::string::npos) {
+            std::string line = buffer.substr(begin, end - begin);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            replies += handle(line);
+            replies += '\n';
+            begin = end + 1;
+        }
+        buffer.erase(0, begin);
+
+        //an unterminated line must not grow the buffer without bound
+        bool tooLong = buffer.size() > MAX_LINE_LENGTH;
+        if (tooLong) {
+            replies += "error line too long\n";
+        }
+
+        for (size_t sent = 0; sent < replies.size();) {
+            ssize_t m = send(fd, replies.data() + sent, replies.size() - sent, MSG_NOSIGNAL);
+            if (m <= 0) {
+                close(fd);
+                return;
+            }
+            sent += m;
+        }
+
+        if (tooLong) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+
+    const char* socketPath = "svmserve.sock";
+    int port = 0;
+    int maxBatch = 64;
+    int maxDelay = 500;
+
+    //read the options
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Error: missing value for %s\n", argv[i]);
+            return 1;
+        }
+        switch (argv[i][1]) {
+        case 's': socketPath = argv[++i]; break;
+        case 'p': port = atoi(argv[++i]); break;
+        case 'b': maxBatch = std::max(1, atoi(argv[++i])); break;
+        case 'd': maxDelay = std::max(0, atoi(argv[++i])); break;
+        default:
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (i >= argc) {
+        fprintf(stderr, "usage: svmserve [-s socket_path | -p port] [-b max_batch] [-d max_delay_us] name=model_file ...\n");
+        return 1;
+    }
+
+    //load the models
+    for (; i < argc; i++) {
+        const char* eq = strchr(argv[i], '=');
+        if (eq == nullptr) {
+            fprintf(stderr, "Error: expected name=model_file, got %s\n", argv[i]);
+            return 1;
+        }
+        std::string name(argv[i], eq - argv[i]);
+        svm_model* model = svm_load_model(eq + 1);
+        if (model == nullptr) {
+            fprintf(stderr, "Error: can't load model %s\n", eq + 1);
+            return 1;
+        }
+        models[name] = new ModelServer(model, maxBatch, maxDelay, stats);
+    }
+
+    //listen on the socket
+    int listener;
+    if (port > 0) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0) {
+            perror("bind");
+            return 1;
+        }
+    } else {
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+        unlink(socketPath);
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0) {
+            perror("bind");
+            return 1;
+        }
+    }
+    if (listen(listener, 128) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Serving %d model(s) on %s\n", (int)models.size(), port > 0 ? "localhost" : socketPath);
+
+    //one thread per connection
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        if (port > 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        std::thread(serveConnection, fd).detach();
+    }
+}
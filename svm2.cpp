@@ -5,14 +5,34 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <locale.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <new>
+#include <stdint.h>
 #include <QDebug>
 #include "svm2.h"
 #ifdef _OPENMP
 #include <omp.h>
 #endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 int libsvm_version = LIBSVM_VERSION;
 typedef float Qfloat;
+typedef unsigned short Qhalf;
 typedef signed char schar;
 #ifndef min
 template <class T> static inline T min(T x,T y) { return (x<y)?x:y; }
@@ -39,8 +59,15 @@ static inline double powi(double base, int times)
 }
 #define INF HUGE_VAL
 #define TAU 1e-12
+#define GRADIENT_BLOCK 1024	// rows of G updated together by the block solver
+#define TWO_PI 6.283185307179586
 #define Malloc(type,n) (type *)malloc((n)*sizeof(type))
 
+static double wall_time()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 static void print_string_stdout(const char *s)
 {
 	fputs(s,stdout);
@@ -61,53 +88,698 @@ static void info(const char *fmt,...)
 static void info(const char *fmt,...) {}
 #endif
 
+//
+// Read-only memory-mapped file
+//
+struct mapped_file
+{
+	const char *addr;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+static bool map_file(const char *name, mapped_file *m)
+{
+	m->addr = NULL;
+	m->size = 0;
+#ifdef _WIN32
+	m->file = CreateFileA(name,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if(m->file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	m->mapping = NULL;
+	if(GetFileSizeEx(m->file,&size) && size.QuadPart > 0)
+		m->mapping = CreateFileMappingA(m->file,NULL,PAGE_READONLY,0,0,NULL);
+	if(m->mapping == NULL)
+	{
+		CloseHandle(m->file);
+		return false;
+	}
+	m->addr = (const char *)MapViewOfFile(m->mapping,FILE_MAP_READ,0,0,0);
+	if(m->addr == NULL)
+	{
+		CloseHandle(m->mapping);
+		CloseHandle(m->file);
+		return false;
+	}
+	m->size = (size_t)size.QuadPart;
+#else
+	int fd = open(name,O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd,&st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+	void *addr = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);	// the mapping stays valid
+	if(addr == MAP_FAILED)
+		return false;
+	m->addr = (const char *)addr;
+	m->size = (size_t)st.st_size;
+#endif
+	return true;
+}
+
+static void unmap_file(mapped_file *m)
+{
+	if(m->addr == NULL)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(m->addr);
+	CloseHandle(m->mapping);
+	CloseHandle(m->file);
+#else
+	munmap((void *)m->addr,m->size);
+#endif
+	m->addr = NULL;
+}
+
+//
+// Precomputed kernel matrix file
+//
+// layout, in native byte order:
+//	"SVMKMAT1" l kernel_type degree (4 bytes padding) gamma coef0,
+//	padded to KMAT_HEADER bytes, then K as l*l floats, row by row
+//
+// rows are addressed by the serial number in x[i][0].value, as for PRECOMPUTED
+//
+#define KMAT_HEADER 64
+
+// map a kernel matrix file, return its l or -1 if it is not valid
+static int map_kernel_matrix(const char *name, mapped_file *m)
+{
+	if(!map_file(name,m))
+		return -1;
+	int l;
+	if(m->size < KMAT_HEADER || memcmp(m->addr,"SVMKMAT1",8) != 0)
+	{
+		unmap_file(m);
+		return -1;
+	}
+	memcpy(&l,m->addr+8,sizeof(int));
+	if(l <= 0 || m->size < KMAT_HEADER + (size_t)l*l*sizeof(float))
+	{
+		unmap_file(m);
+		return -1;
+	}
+	return l;
+}
+
+// kernel matrix files mapped by svm_train, which holds a reference until it
+// returns; its Kernels take theirs by name, so they never map the file again
+// and a file that changed or went away since is reported by svm_train
+struct mapped_kernel_matrix
+{
+	char *name;
+	mapped_file file;
+	int l;
+	int refs;
+	mapped_kernel_matrix *next;
+};
+
+static mapped_kernel_matrix *mapped_kernel_matrices = NULL;
+static std::mutex mapped_kernel_matrices_lock;
+
+// the mapping of a kernel matrix file, NULL if the file is not valid
+static mapped_kernel_matrix *acquire_kernel_matrix(const char *name)
+{
+	std::lock_guard<std::mutex> lock(mapped_kernel_matrices_lock);
+	mapped_kernel_matrix *m;
+	for(m=mapped_kernel_matrices;m!=NULL;m=m->next)
+		if(strcmp(m->name,name) == 0)
+		{
+			++m->refs;
+			return m;
+		}
+
+	m = Malloc(mapped_kernel_matrix,1);
+	m->l = map_kernel_matrix(name,&m->file);
+	if(m->l < 0)
+	{
+		free(m);
+		return NULL;
+	}
+	m->name = strdup(name);
+	m->refs = 1;
+	m->next = mapped_kernel_matrices;
+	mapped_kernel_matrices = m;
+	return m;
+}
+
+static void release_kernel_matrix(mapped_kernel_matrix *m)
+{
+	if(m == NULL)
+		return;
+	std::lock_guard<std::mutex> lock(mapped_kernel_matrices_lock);
+	if(--m->refs > 0)
+		return;
+	mapped_kernel_matrix **p = &mapped_kernel_matrices;
+	while(*p != m)
+		p = &(*p)->next;
+	*p = m->next;
+	unmap_file(&m->file);
+	free(m->name);
+	free(m);
+}
+
+// K(x,y) of two rows given by their serial numbers in a mapped file
+static inline double kernel_matrix_value(const mapped_kernel_matrix *m, const svm_node *x, const svm_node *y)
+{
+	const float *data = (const float *)(m->file.addr + KMAT_HEADER);
+	return data[((size_t)x[0].value-1)*m->l + (size_t)y[0].value-1];
+}
+
+//
+// Dataset files, for training on data larger than memory
+//
+// layout, in native byte order:
+//	"SVMDATA1" l nr_node sizeof(svm_node) y_offset row_offset as int64,
+//	padded to DATA_HEADER bytes, then the nodes of all rows with their
+//	-1 terminators, y[l] as doubles at y_offset and the first node of
+//	each row as int64 at row_offset
+//
+// svm_map_dataset maps the file and points svm_problem.x into it, so rows
+// are paged in on use and only O(l) arrays are resident. Such rows are
+// registered, and Kernel reads them ahead in blocks while filling columns.
+//
+#define DATA_HEADER 64
+#define FILL_BLOCK 4096		// rows per prefetch while filling a kernel column
+#define SCATTER_MIN_LEN (1<<20)	// a scattered row may span this many indices whatever the nnz
+
+struct mapped_dataset
+{
+	svm_problem prob;	// first, svm_unmap_dataset gets a pointer to it
+	mapped_file file;
+	mapped_dataset *next;
+};
+
+static mapped_dataset *mapped_datasets = NULL;
+static std::mutex mapped_datasets_lock;
+
+// size of the dataset file x lies in, 0 if x is not from svm_map_dataset
+static size_t mapped_row_file(const svm_node *x)
+{
+	std::lock_guard<std::mutex> lock(mapped_datasets_lock);
+	for(mapped_dataset *d=mapped_datasets;d!=NULL;d=d->next)
+		if((const char *)x >= d->file.addr && (const char *)x < d->file.addr+d->file.size)
+			return d->file.size;
+	return 0;
+}
+
+// a file this large is not expected to stay in the page cache
+static bool exceeds_memory(size_t size)
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if(!GlobalMemoryStatusEx(&status))
+		return false;
+	return size > status.ullAvailPhys/2;
+#else
+	long pages = sysconf(_SC_AVPHYS_PAGES);
+	if(pages <= 0)
+		return false;
+	return size > (size_t)pages*(size_t)sysconf(_SC_PAGESIZE)/2;
+#endif
+}
+
+static int compare_address(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// ask the OS to read the pages of rows x[begin,end) ahead. Only the
+// first page of each row is named, longer rows fault in the rest. The
+// rows are scattered once shrinking has permuted them, so their pages
+// are sorted and nearby ones merged into one request.
+static void prefetch_rows(const svm_node * const *x, int begin, int end)
+{
+#ifndef _WIN32
+	static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	int n = end-begin;
+	if(n <= 0)
+		return;
+	uintptr_t *a = Malloc(uintptr_t,n);
+	for(int j=0;j<n;j++)
+		a[j] = (uintptr_t)x[begin+j] & ~(page-1);
+	qsort(a,n,sizeof(uintptr_t),compare_address);
+	uintptr_t lo = a[0], hi = a[0]+page;
+	for(int j=1;j<n;j++)
+	{
+		if(a[j] <= hi + 16*page)
+		{
+			hi = max(hi,a[j]+page);
+			continue;
+		}
+		madvise((void *)lo,hi-lo,MADV_WILLNEED);
+		lo = a[j];
+		hi = a[j]+page;
+	}
+	madvise((void *)lo,hi-lo,MADV_WILLNEED);
+	free(a);
+#else
+	// the mapping is still used on Windows, just without read-ahead hints
+	(void)x; (void)begin; (void)end;
+#endif
+}
+
+//
+// Memory placement for the kernel cache and the kernel's copy of the rows
+//
+// With PLACE_INTERLEAVE large blocks are mapped directly and their pages
+// spread round-robin over all memory nodes, so the column fills running
+// on every socket share all memory controllers instead of queueing on the
+// node of the thread that touched the data first.
+//
+// With PLACE_HUGE blocks of 2 MB or more are backed by huge pages, so a
+// multi-GB cache needs few TLB entries: explicit ones if enough are
+// reserved (vm.nr_hugepages), else transparent ones on a 2 MB aligned
+// range, else, if the kernel has neither, normal pages.
+//
+// Small blocks, and all blocks on other systems, come from malloc.
+//
+#define PLACED_MIN_SIZE (64<<10)	// smaller blocks are not worth a mapping
+#define HUGE_PAGE_SIZE ((size_t)2<<20)
+#define SLAB_SIZES 64		// column lengths whose freed blocks a cache slab reuses
+
+enum { PLACE_INTERLEAVE = 1, PLACE_HUGE = 2 };	// placement flags
+
+static int placement_of(const svm_parameter& param)
+{
+	return (param.numa_policy == NUMA_INTERLEAVE ? PLACE_INTERLEAVE : 0) |
+		(param.huge_pages ? PLACE_HUGE : 0);
+}
+
+#ifdef __linux__
+// 1 + the highest online memory node
+static int read_node_count()
+{
+	FILE *fp = fopen("/sys/devices/system/node/online","r");
+	if(fp == NULL)
+		return 1;
+	int node, count = 1;
+	char sep;
+	while(fscanf(fp,"%d",&node) == 1)
+	{
+		count = max(count,node+1);
+		if(fscanf(fp,"%c",&sep) != 1)
+			break;
+	}
+	fclose(fp);
+	return count;
+}
+#endif
+
+static bool placed_mapping(size_t size, int placement)
+{
+#ifdef __linux__
+	return placement != 0 && size >= PLACED_MIN_SIZE;
+#else
+	(void)size; (void)placement;
+	return false;
+#endif
+}
+
+static bool placed_huge(size_t size, int placement)
+{
+	return (placement & PLACE_HUGE) && size >= HUGE_PAGE_SIZE;
+}
+
+// bytes actually mapped for a block of size bytes
+static size_t placed_size(size_t size, int placement)
+{
+	return placed_huge(size,placement) ? (size+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1) : size;
+}
+
+// pages is set to the kind of pages requested for the block, if not NULL
+static void *placed_alloc(size_t size, int placement, const char **pages = NULL)
+{
+	if(pages != NULL)
+		*pages = "normal";
+	if(!placed_mapping(size,placement))
+		return malloc(size);
+#ifdef __linux__
+	void *p = MAP_FAILED;
+	size = placed_size(size,placement);
+	if(placed_huge(size,placement))
+	{
+#ifdef MAP_HUGETLB
+		p = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+		if(p != MAP_FAILED && pages != NULL)
+			*pages = "explicit huge";
+#endif
+		if(p == MAP_FAILED)
+		{
+			// over-map and trim to a 2 MB aligned range
+			char *q = (char *)mmap(NULL,size+HUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+			if(q == MAP_FAILED)
+				return NULL;
+			char *a = (char *)(((uintptr_t)q+HUGE_PAGE_SIZE-1) & ~(uintptr_t)(HUGE_PAGE_SIZE-1));
+			if(a > q)
+				munmap(q,a-q);
+			munmap(a+size,q+HUGE_PAGE_SIZE-a);
+			p = a;
+#ifdef MADV_HUGEPAGE
+			if(madvise(p,size,MADV_HUGEPAGE) == 0 && pages != NULL)
+				*pages = "transparent huge";
+#endif
+		}
+	}
+	else
+		p = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if(p == MAP_FAILED)
+		return NULL;
+
+	static const int nodes = min(read_node_count(),1024);
+	if((placement & PLACE_INTERLEAVE) && nodes > 1)
+	{
+		// pages not touched yet; if the policy is refused they stay first-touch
+		unsigned long mask[1024/(8*sizeof(unsigned long))] = {0};
+		for(int n=0;n<nodes;n++)
+			mask[n/(8*sizeof(unsigned long))] |= 1UL << (n%(8*sizeof(unsigned long)));
+		syscall(SYS_mbind,p,size,MPOL_INTERLEAVE,mask,(unsigned long)nodes+1,0);
+	}
+	return p;
+#endif
+}
+
+static void placed_free(void *p, size_t size, int placement)
+{
+	if(p == NULL)
+		return;
+	if(!placed_mapping(size,placement))
+		free(p);
+#ifdef __linux__
+	else
+		munmap(p,placed_size(size,placement));
+#endif
+}
+
+// like realloc, p is left alone and NULL returned if the new block cannot be had
+static void *placed_realloc(void *p, size_t old_size, size_t size, int placement)
+{
+	if(p == NULL)
+		return placed_alloc(size,placement);
+	if(!placed_mapping(old_size,placement) && !placed_mapping(size,placement))
+		return realloc(p,size);
+	void *q = placed_alloc(size,placement);
+	if(q == NULL)
+		return NULL;
+	memcpy(q,p,min(old_size,size));
+	placed_free(p,old_size,placement);
+	return q;
+}
+
+//
+// 16-bit storage formats for cached kernel values
+//
+// fp16 saturates at +-65504 instead of overflowing to infinity
+//
+static inline Qhalf float_to_bf16(Qfloat f)
+{
+	unsigned int x;
+	memcpy(&x,&f,sizeof(x));
+	x += 0x7fff + ((x >> 16) & 1);	// round to nearest even
+	return (Qhalf)(x >> 16);
+}
+
+static inline Qfloat bf16_to_float(Qhalf h)
+{
+	unsigned int x = (unsigned int)h << 16;
+	Qfloat f;
+	memcpy(&f,&x,sizeof(f));
+	return f;
+}
+
+static inline Qhalf float_to_fp16(Qfloat f)
+{
+	unsigned int x;
+	memcpy(&x,&f,sizeof(x));
+	unsigned int sign = (x >> 16) & 0x8000;
+	int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+	unsigned int mant = x & 0x7fffff;
+	unsigned int h, rest, half;
+
+	if(exp >= 31)
+		return (Qhalf)(sign | 0x7bff);
+	if(exp <= 0)
+	{
+		// subnormal
+		if(exp < -10)
+			return (Qhalf)sign;
+		mant |= 0x800000;
+		int shift = 14 - exp;
+		h = mant >> shift;
+		rest = mant & ((1u << shift) - 1);
+		half = 1u << (shift - 1);
+	}
+	else
+	{
+		h = ((unsigned int)exp << 10) | (mant >> 13);
+		rest = mant & 0x1fff;
+		half = 0x1000;
+	}
+	if(rest > half || (rest == half && (h & 1)))
+		++h;
+	if(h >= 0x7c00)
+		h = 0x7bff;
+	return (Qhalf)(sign | h);
+}
+
+static inline Qfloat fp16_to_float(Qhalf h)
+{
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exp = (h >> 10) & 0x1f;
+	unsigned int mant = h & 0x3ff;
+	unsigned int x;
+
+	if(exp == 0)
+	{
+		if(mant == 0)
+			x = sign;
+		else
+		{
+			// subnormal, normalize it
+			exp = 127 - 15 + 1;
+			while(!(mant & 0x400))
+			{
+				mant <<= 1;
+				--exp;
+			}
+			x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+		}
+	}
+	else if(exp == 31)
+		x = sign | 0x7f800000 | (mant << 13);
+	else
+		x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+
+	Qfloat f;
+	memcpy(&f,&x,sizeof(f));
+	return f;
+}
+
+// branch-free decoding of finite values, so loops over it vectorize: the
+// exponent is rebased by scaling with 2^112, which also handles subnormals
+static inline Qfloat fp16_to_float_finite(Qhalf h)
+{
+	unsigned int x = (unsigned int)(h & 0x7fff) << 13;
+	Qfloat f;
+	memcpy(&f,&x,sizeof(f));
+	f *= 5.192296858534828e+33f;
+	memcpy(&x,&f,sizeof(x));
+	x |= (unsigned int)(h & 0x8000) << 16;
+	memcpy(&f,&x,sizeof(f));
+	return f;
+}
+
+// decoding every fp16 value once is much faster than converting on each read
+static const Qfloat *fp16_table()
+{
+	struct table_t
+	{
+		Qfloat value[65536];
+		table_t()
+		{
+			for(int h=0;h<65536;h++)
+				value[h] = fp16_to_float((Qhalf)h);
+		}
+	};
+	static const table_t table;	// initialized once, thread-safe
+	return table.value;
+}
+
 //
 // Kernel Cache
 //
 // l is the number of total data items
 // size is the cache size limit in bytes
+// type is the storage of cached values (CACHE_FLOAT, CACHE_FP16 or CACHE_BF16)
+// placement is a set of PLACE_* flags for the columns, see placed_alloc;
+// with any, the columns are carved from one slab of the cache size
+//
+// With 16-bit storage, get_data returns one of two alternating float
+// columns holding the converted values, and the caller must pass the
+// filled column to store(). store() also rounds the caller's values, so a
+// column reads the same whether or not it was cached.
 //
 class Cache
 {
 public:
-	Cache(int l,size_t size);
+	Cache(int l,size_t size,int type = CACHE_FLOAT,int placement = 0);
 	~Cache();
 
 	// request data [0,len)
 	// return some position p where [p,len) need to be filled
 	// (p >= len if nothing needs to be filled)
 	int get_data(const int index, Qfloat **data, int len);
-	void swap_index(int i, int j);
+	// write back data [start,len) after filling it
+	void store(const int index, Qfloat *data, int start, int len);
+	// whether data [0,len) is cached, without touching the LRU order
+	bool has_data(const int index, int len) const { return head[index].len >= len; }
 private:
 	int l;
 	size_t size;
+	int type;
+	int placement;
+	size_t elem_size;
 	struct head_t
 	{
 		head_t *prev, *next;	// a circular list
-		Qfloat *data;
+		void *data;
 		int len;		// data[0,len) is cached in this entry
 	};
 
 	head_t *head;
 	head_t lru_head;
+	Qfloat *column[2];	// for 16-bit storage
+	int column_len[2];
+	int next_column;
+	long hits, misses;
 	void lru_delete(head_t *h);
 	void lru_insert(head_t *h);
+
+	// the slab is filled from the start; freed blocks are kept in one
+	// list per size, linked through their first bytes
+	char *slab;
+	size_t slab_size, slab_used;
+	struct free_list
+	{
+		size_t size;
+		void *first;
+	};
+	free_list free_lists[SLAB_SIZES];
+	int nr_free_lists;
+	void *alloc_column(size_t bytes);
+	void free_column(void *p, size_t bytes);
+	void *realloc_column(void *p, size_t old_bytes, size_t bytes);
 };
 
-Cache::Cache(int l_,size_t size_):l(l_),size(size_)
+Cache::Cache(int l_,size_t size_,int type_,int placement_):l(l_),size(size_),type(type_),placement(placement_)
 {
+	elem_size = type == CACHE_FLOAT ? sizeof(Qfloat) : sizeof(Qhalf);
 	head = (head_t *)calloc(l,sizeof(head_t));	// initialized to 0
-	size /= sizeof(Qfloat);
-	size_t header_size = l * sizeof(head_t) / sizeof(Qfloat);
+	size /= elem_size;
+	size_t header_size = l * sizeof(head_t) / elem_size;
 	size = max(size, 2 * (size_t) l + header_size) - header_size;  // cache must be large enough for two columns
 	lru_head.next = lru_head.prev = &lru_head;
+	column[0] = column[1] = NULL;
+	column_len[0] = column_len[1] = 0;
+	next_column = 0;
+	hits = misses = 0;
+
+	slab = NULL;
+	slab_size = slab_used = 0;
+	nr_free_lists = 0;
+	if(placement)
+	{
+		const char *pages;
+		slab_size = size*elem_size;
+		slab = (char *)placed_alloc(slab_size,placement,&pages);
+		if(slab != NULL)
+			info("kernel cache slab of %.0f MB on %s pages\n",slab_size/1048576.0,pages);
+	}
 }
 
 Cache::~Cache()
 {
+	if(hits + misses > 0)
+		info("cache hits = %ld, misses = %ld (%.1f%%)\n",hits,misses,100.0*hits/(hits+misses));
 	for(head_t *h = lru_head.next; h != &lru_head; h=h->next)
-		free(h->data);
+		free_column(h->data,elem_size*h->len);
+	placed_free(slab,slab_size,placement);
 	free(head);
+	free(column[0]);
+	free(column[1]);
+}
+
+void *Cache::alloc_column(size_t bytes)
+{
+	if(slab != NULL)
+	{
+		size_t block = (bytes+63) & ~(size_t)63;
+		for(int k=0;k<nr_free_lists;k++)
+			if(free_lists[k].size == block && free_lists[k].first != NULL)
+			{
+				void *p = free_lists[k].first;
+				free_lists[k].first = *(void **)p;
+				return p;
+			}
+		if(slab_used + block <= slab_size)
+		{
+			void *p = slab + slab_used;
+			slab_used += block;
+			return p;
+		}
+	}
+	// the slab is used up by columns of other lengths
+	return placed_alloc(bytes,placement);
+}
+
+void Cache::free_column(void *p, size_t bytes)
+{
+	if(p == NULL || p < (void *)slab || p >= (void *)(slab + slab_size))
+	{
+		placed_free(p,bytes,placement);
+		return;
+	}
+	size_t block = (bytes+63) & ~(size_t)63;
+	int k;
+	for(k=0;k<nr_free_lists;k++)
+		if(free_lists[k].size == block)
+			break;
+	if(k == nr_free_lists)
+	{
+		if(k == SLAB_SIZES)
+			return;	// too many lengths, the block stays unused
+		free_lists[k].size = block;
+		free_lists[k].first = NULL;
+		nr_free_lists++;
+	}
+	*(void **)p = free_lists[k].first;
+	free_lists[k].first = p;
+}
+
+void *Cache::realloc_column(void *p, size_t old_bytes, size_t bytes)
+{
+	if(slab == NULL)
+		return placed_realloc(p,old_bytes,bytes,placement);
+	void *q = alloc_column(bytes);
+	if(q == NULL)
+		return NULL;
+	if(p != NULL)
+	{
+		memcpy(q,p,min(old_bytes,bytes));
+		free_column(p,old_bytes);
+	}
+	return q;
 }
 
 void Cache::lru_delete(head_t *h)
@@ -134,57 +806,88 @@ int Cache::get_data(const int index, Qfloat **data, int len)
 
 	if(more > 0)
 	{
-		// free old space
+		// free old space; a new column takes over an evicted one of its
+		// length, which saves the allocator and the page faults
+		void *spare = NULL;
 		while(size < (size_t)more)
 		{
 			head_t *old = lru_head.next;
 			lru_delete(old);
-			free(old->data);
+			if(spare == NULL && h->len == 0 && old->len == len)
+				spare = old->data;
+			else
+				free_column(old->data,elem_size*old->len);
 			size += old->len;
 			old->data = 0;
 			old->len = 0;
 		}
 
 		// allocate new space
-		h->data = (Qfloat *)realloc(h->data,sizeof(Qfloat)*len);
+		if(spare != NULL)
+			h->data = spare;
+		else
+		{
+			void *data = realloc_column(h->data,elem_size*h->len,elem_size*len);
+			if(data == NULL)
+				throw std::bad_alloc();	// as new[] fails everywhere else
+			h->data = data;
+		}
 		size -= more;  // previous while loop guarantees size >= more and subtraction of size_t variable will not underflow
 		swap(h->len,len);
+		++misses;
 	}
+	else
+		++hits;
 
 	lru_insert(h);
-	*data = h->data;
+	if(type == CACHE_FLOAT)
+	{
+		*data = (Qfloat *)h->data;
+		return len;
+	}
+
+	// convert the cached part, len is now the end of it
+	// (only this column may move; the caller can still hold the other one)
+	int c = next_column;
+	next_column = 1 - next_column;
+	if(h->len > column_len[c])
+	{
+		column_len[c] = h->len;
+		column[c] = (Qfloat *)realloc(column[c],sizeof(Qfloat)*column_len[c]);
+	}
+	Qfloat *col = column[c];
+	const Qhalf *src = (const Qhalf *)h->data;
+	if(type == CACHE_BF16)
+		for(int j=0;j<len;j++)
+			col[j] = bf16_to_float(src[j]);
+	else
+	{
+		const Qfloat *table = fp16_table();
+		for(int j=0;j<len;j++)
+			col[j] = table[src[j]];
+	}
+	*data = col;
 	return len;
 }
 
-void Cache::swap_index(int i, int j)
+void Cache::store(const int index, Qfloat *data, int start, int len)
 {
-	if(i==j) return;
+	if(type == CACHE_FLOAT)
+		return;	// data is the cache entry itself
 
-	if(head[i].len) lru_delete(&head[i]);
-	if(head[j].len) lru_delete(&head[j]);
-	swap(head[i].data,head[j].data);
-	swap(head[i].len,head[j].len);
-	if(head[i].len) lru_insert(&head[i]);
-	if(head[j].len) lru_insert(&head[j]);
-
-	if(i>j) swap(i,j);
-	for(head_t *h = lru_head.next; h!=&lru_head; h=h->next)
-	{
-		if(h->len > i)
+	Qhalf *dst = (Qhalf *)head[index].data;
+	if(type == CACHE_BF16)
+		for(int j=start;j<len;j++)
 		{
-			if(h->len > j)
-				swap(h->data[i],h->data[j]);
-			else
-			{
-				// give up
-				lru_delete(h);
-				free(h->data);
-				size += h->len;
-				h->data = 0;
-				h->len = 0;
-			}
+			dst[j] = float_to_bf16(data[j]);
+			data[j] = bf16_to_float(dst[j]);
+		}
+	else
+		for(int j=start;j<len;j++)
+		{
+			dst[j] = float_to_fp16(data[j]);
+			data[j] = fp16_to_float(dst[j]);
 		}
-	}
 }
 
 //
@@ -199,31 +902,132 @@ public:
 	virtual Qfloat *get_Q(int column, int len) const = 0;
 	virtual double *get_QD() const = 0;
 	virtual void swap_index(int i, int j) const = 0;
+	// hint that column i will likely be asked for soon
+	virtual void prefetch(int i) const {}
+	// #columns worth hinting at each iteration, 0 if hints are ignored
+	virtual int prefetch_depth() const { return 0; }
 	virtual ~QMatrix() {}
 };
 
-class Kernel: public QMatrix {
+//
+// Kernel columns computed ahead of the solver
+//
+// The solver names columns it will likely need soon; helper threads
+// compute them into buffers of their own, never into the cache, and take()
+// hands a finished column to get_Q on its cache miss. A column still being
+// computed is waited for, one not started yet is dropped and computed by
+// the caller. Columns are named by their cache key, so a prefetched one
+// stays valid however the solver permutes its variables.
+//
+class Kernel;
+class Prefetcher
+{
 public:
-	Kernel(int l, svm_node * const * x, const svm_parameter& param);
-	virtual ~Kernel();
+	Prefetcher(const Kernel *kernel, int nr_threads, int max_len);
+	~Prefetcher();
+
+	int depth() const { return nr_slots; }
+	// queue column key of length len unless it is queued already;
+	// when all slots are taken the least recently requested one is reused
+	void request(int key, int len);
+	// copy [start,len) of column key into data if it was prefetched
+	bool take(int key, Qfloat *data, int start, int len);
+private:
+	enum { FREE, QUEUED, RUNNING, READY };
+	struct slot_t
+	{
+		int key, len;
+		int state;
+		long stamp;	// when it was last requested
+		Qfloat *data;
+	};
+
+	const Kernel *kernel;
+	int nr_slots;
+	slot_t *slots;
+	long clock;
+	bool stopping;
+	std::mutex lock;
+	std::condition_variable queued, done;
+	std::thread *threads;
+	int nr_threads;
+	long lookups, used, waited, computed, unused;
+
+	slot_t *find(int key);
+	void run();
+};
+
+class Kernel: public QMatrix {
+public:
+	Kernel(int l, svm_node * const * x, const svm_parameter& param);
+	virtual ~Kernel();
 
 	static double k_function(const svm_node *x, const svm_node *y,
 				 const svm_parameter& param);
 	virtual Qfloat *get_Q(int column, int len) const = 0;
 	virtual double *get_QD() const = 0;
-	virtual void swap_index(int i, int j) const	// no so const...
-	{
-		swap(x[i],x[j]);
-		if(x_square) swap(x_square[i],x_square[j]);
-	}
+	friend class Prefetcher;
+	virtual void swap_index(int i, int j) const = 0;
 protected:
 
 	double (Kernel::*kernel_function)(int i, int j) const;
 
+	// K(i,j) for the rows j of a column fill, between begin_column(i) and
+	// end_column(i); with CSR rows, row i is scattered into a dense vector
+	// once and every row j is gathered against it
+	double (Kernel::*column_function)(int i, int j) const;
+	void begin_column(int i) const
+	{
+		if(!csr_start) return;
+		for(int k=0;k<csr_len[i];k++)
+			dense[csr_index[csr_start[i]+k]] = csr_value[csr_start[i]+k];
+	}
+	void end_column(int i) const
+	{
+		if(!csr_start) return;
+		for(int k=0;k<csr_len[i];k++)
+			dense[csr_index[csr_start[i]+k]] = 0;
+	}
+
+	// column key of length len for a Prefetcher thread: it runs beside the
+	// solver, so it calls kernel_function and leaves the scattered row alone
+	virtual void compute_column(int key, Qfloat *data, int len) const {}
+
+	// end of the block of a column fill that starts at row j. Mapped rows
+	// are filled in blocks, the next one is read ahead while this one is
+	// computed; rows in memory are filled in one go.
+	int fill_block(int j, int begin, int end) const
+	{
+		if(!rows_mapped)
+			return end;
+		int e = min(j+FILL_BLOCK,end);
+		if(j == begin)
+			prefetch_rows(x,j,e);
+		prefetch_rows(x,e,min(e+FILL_BLOCK,end));
+		return e;
+	}
+
 private:
 	const svm_node **x;
 	double *x_square;
 
+	bool rows_mapped;	// x points into a file from svm_map_dataset, too large to stay in memory
+
+	// CSR copy of the rows if param.sparse_csr, numa_policy or huge_pages is set:
+	// row i is csr_index/csr_value[csr_start[i]], ... of length csr_len[i]
+	int *csr_index;
+	double *csr_value;
+	size_t csr_nnz;		// allocated length of csr_index and csr_value
+	int placement;		// of the CSR copy, see placed_alloc
+	size_t *csr_start;
+	int *csr_len;
+	double *dense;		// the scattered row, zero elsewhere (malloc'ed)
+
+	// precomputed kernel matrix file, if param.kernel_file is set
+	mapped_kernel_matrix *kmat;
+	const float *kmat_data;
+	size_t kmat_l;
+
 	// svm_parameter
 	const int kernel_type;
 	const int degree;
@@ -251,6 +1055,39 @@ private:
 	{
 		return x[i][(int)(x[j][0].value)].value;
 	}
+	double kernel_precomputed_file(int i, int j) const
+	{
+		return kmat_data[((size_t)x[i][0].value-1)*kmat_l + (size_t)x[j][0].value-1];
+	}
+
+	// dot with the scattered row: the products and their order are those
+	// of dot(), unmatched indices add zeros, so results are bit-identical
+	double dot_scattered(int j) const
+	{
+		const int *index = &csr_index[csr_start[j]];
+		const double *value = &csr_value[csr_start[j]];
+		int n = csr_len[j];
+		double sum = 0;
+		for(int k=0;k<n;k++)
+			sum += value[k] * dense[index[k]];
+		return sum;
+	}
+	double kernel_linear_csr(int i, int j) const
+	{
+		return dot_scattered(j);
+	}
+	double kernel_poly_csr(int i, int j) const
+	{
+		return powi(gamma*dot_scattered(j)+coef0,degree);
+	}
+	double kernel_rbf_csr(int i, int j) const
+	{
+		return exp(-gamma*(x_square[i]+x_square[j]-2*dot_scattered(j)));
+	}
+	double kernel_sigmoid_csr(int i, int j) const
+	{
+		return tanh(gamma*dot_scattered(j)+coef0);
+	}
 };
 
 Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
@@ -276,7 +1113,99 @@ Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
 			break;
 	}
 
+	kmat_data = NULL;
+	kmat = NULL;
+	if(kernel_type == PRECOMPUTED && param.kernel_file != NULL)
+	{
+		// mapped by svm_train, which keeps it until it returns
+		kmat = acquire_kernel_matrix(param.kernel_file);
+		kmat_l = kmat->l;
+		kmat_data = (const float *)(kmat->file.addr + KMAT_HEADER);
+		kernel_function = &Kernel::kernel_precomputed_file;
+	}
+
 	clone(x,x_,l);
+	// once read, rows that fit in memory stay in the page cache
+	rows_mapped = l > 0 && exceeds_memory(mapped_row_file(x_[0]));
+
+	column_function = kernel_function;
+	csr_index = NULL;
+	csr_value = NULL;
+	csr_start = NULL;
+	csr_len = NULL;
+	dense = NULL;
+	// the rows are only placed on NUMA nodes or huge pages as this copy
+	placement = placement_of(param);
+	csr_nnz = 0;
+	if((param.sparse_csr || placement) && kernel_type != PRECOMPUTED && !rows_mapped)
+	{
+		// a mapped dataset is not copied, it would no longer be out of core
+		size_t nnz = 0;
+		int max_index = 0;
+		bool valid = true;
+		for(int i=0;i<l;i++)
+			for(const svm_node *p=x[i];p->index != -1;p++)
+			{
+				valid = valid && p->index >= 0;
+				max_index = max(max_index,p->index);
+				++nnz;
+			}
+		// the scattered row spans every index up to max_index, which hashed
+		// features put near INT_MAX; past the size of the copy itself the
+		// rows are left as svm_node and dot() is used
+		size_t dense_len = (size_t)max_index+1;
+		valid = valid && dense_len <= max(nnz,(size_t)SCATTER_MIN_LEN);
+		if(valid)
+		{
+			csr_nnz = max(nnz,(size_t)1);
+			csr_index = (int *)placed_alloc(sizeof(int)*csr_nnz,placement);
+			csr_value = (double *)placed_alloc(sizeof(double)*csr_nnz,placement);
+			dense = (double *)calloc(dense_len,sizeof(double));
+			if(csr_index == NULL || csr_value == NULL || dense == NULL)
+			{
+				placed_free(csr_index,sizeof(int)*csr_nnz,placement);
+				placed_free(csr_value,sizeof(double)*csr_nnz,placement);
+				free(dense);
+				csr_index = NULL;
+				csr_value = NULL;
+				dense = NULL;
+				csr_nnz = 0;
+				valid = false;
+			}
+		}
+		if(valid)
+		{
+			csr_start = new size_t[l];
+			csr_len = new int[l];
+			size_t k = 0;
+			for(int i=0;i<l;i++)
+			{
+				csr_start[i] = k;
+				for(const svm_node *p=x[i];p->index != -1;p++,k++)
+				{
+					csr_index[k] = p->index;
+					csr_value[k] = p->value;
+				}
+				csr_len[i] = (int)(k - csr_start[i]);
+			}
+
+			switch(kernel_type)
+			{
+				case LINEAR:
+					column_function = &Kernel::kernel_linear_csr;
+					break;
+				case POLY:
+					column_function = &Kernel::kernel_poly_csr;
+					break;
+				case RBF:
+					column_function = &Kernel::kernel_rbf_csr;
+					break;
+				case SIGMOID:
+					column_function = &Kernel::kernel_sigmoid_csr;
+					break;
+			}
+		}
+	}
 
 	if(kernel_type == RBF)
 	{
@@ -292,6 +1221,138 @@ Kernel::~Kernel()
 {
 	delete[] x;
 	delete[] x_square;
+	placed_free(csr_index,sizeof(int)*csr_nnz,placement);
+	placed_free(csr_value,sizeof(double)*csr_nnz,placement);
+	delete[] csr_start;
+	delete[] csr_len;
+	free(dense);
+	release_kernel_matrix(kmat);
+}
+
+Prefetcher::Prefetcher(const Kernel *kernel_, int nr_threads_, int max_len)
+:kernel(kernel_), nr_threads(nr_threads_)
+{
+	nr_slots = 4*nr_threads;
+	slots = new slot_t[nr_slots];
+	for(int s=0;s<nr_slots;s++)
+	{
+		slots[s].state = FREE;
+		slots[s].data = new Qfloat[max_len];
+	}
+	clock = 0;
+	stopping = false;
+	lookups = used = waited = computed = unused = 0;
+	threads = new std::thread[nr_threads];
+	for(int t=0;t<nr_threads;t++)
+		threads[t] = std::thread(&Prefetcher::run,this);
+}
+
+Prefetcher::~Prefetcher()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	queued.notify_all();
+	for(int t=0;t<nr_threads;t++)
+		threads[t].join();
+	for(int s=0;s<nr_slots;s++)
+	{
+		if(slots[s].state == READY)
+			++unused;
+		delete[] slots[s].data;
+	}
+	if(lookups > 0)
+		info("prefetch hits = %ld of %ld cache misses (%.1f%%), %ld waited for, %ld of %ld computed columns unused\n",
+		     used,lookups,100.0*used/lookups,waited,unused,computed);
+	delete[] threads;
+	delete[] slots;
+}
+
+Prefetcher::slot_t *Prefetcher::find(int key)
+{
+	for(int s=0;s<nr_slots;s++)
+		if(slots[s].state != FREE && slots[s].key == key)
+			return &slots[s];
+	return NULL;
+}
+
+void Prefetcher::request(int key, int len)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	slot_t *slot = find(key);
+	if(slot != NULL)
+	{
+		slot->stamp = ++clock;
+		return;
+	}
+
+	// a free slot, else the stalest one not being computed
+	for(int s=0;s<nr_slots;s++)
+		if(slots[s].state != RUNNING &&
+		   (slot == NULL || slots[s].state == FREE ||
+		    (slot->state != FREE && slots[s].stamp < slot->stamp)))
+			slot = &slots[s];
+	if(slot == NULL)
+		return;
+	if(slot->state == READY)
+		++unused;
+	slot->key = key;
+	slot->len = len;
+	slot->state = QUEUED;
+	slot->stamp = ++clock;
+	queued.notify_one();
+}
+
+bool Prefetcher::take(int key, Qfloat *data, int start, int len)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	++lookups;
+	slot_t *slot = find(key);
+	if(slot == NULL || slot->len < len)
+		return false;
+	if(slot->state == QUEUED)
+	{
+		slot->state = FREE;
+		return false;
+	}
+	if(slot->state == RUNNING)
+	{
+		++waited;
+		done.wait(guard,[slot]{ return slot->state == READY; });
+	}
+	memcpy(data+start,slot->data+start,sizeof(Qfloat)*(len-start));
+	slot->state = FREE;
+	++used;
+	return true;
+}
+
+void Prefetcher::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		// the column requested first
+		if(stopping)
+			return;
+		slot_t *slot = NULL;
+		for(int s=0;s<nr_slots;s++)
+			if(slots[s].state == QUEUED && (slot == NULL || slots[s].stamp < slot->stamp))
+				slot = &slots[s];
+		if(slot == NULL)
+		{
+			queued.wait(guard);
+			continue;
+		}
+
+		slot->state = RUNNING;
+		guard.unlock();
+		kernel->compute_column(slot->key,slot->data,slot->len);
+		guard.lock();
+		slot->state = READY;
+		++computed;
+		done.notify_all();
+	}
 }
 
 double Kernel::dot(const svm_node *px, const svm_node *py)
@@ -375,6 +1436,116 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 	}
 }
 
+class Shared_Kernel;
+
+//
+// decision_function
+//
+struct decision_function
+{
+	double *alpha;
+	double rho;
+	int l;		// #alpha
+};
+
+//
+// Solver state read back from a checkpoint file by svm_train_resume
+//
+struct checkpoint_state
+{
+	int svm_type;
+	int l;			// #data of the whole problem
+	unsigned long long fingerprint;	// see checkpoint_fingerprint
+	int nr_pairs;		// #sub-problems, k*(k-1)/2 for classification
+	int nr_done;		// sub-problems finished before the checkpoint
+	bool converged;
+	decision_function *f;	// f[0,nr_done)
+	double *probA;		// probA[0,pair], NULL if not used
+	double *probB;
+
+	// interrupted sub-problem, pair == -1 if none
+	int pair;
+	int sl;
+	int iter;
+	int counter;
+	int active_size;
+	bool unshrink;
+	int *active_set;
+	double *alpha;
+	double *G;
+	double *G_bar;
+	char *alpha_status;
+	schar *y;
+	double *p;
+};
+
+//
+// State shared by all sub-problems solved in one svm_train call
+//
+struct train_context
+{
+	const svm_parameter *param;
+	double start_time;	// wall_time() when svm_train was called
+	bool stopped;		// cancelled or out of time; remaining solves return at once
+	bool converged;		// false once any sub-problem stops early
+
+	// for checkpointing
+	int l;			// #data of the whole problem
+	unsigned long long fingerprint;	// of the problem and parameters, 0 without checkpoint_file
+	int pair;		// sub-problem being solved
+	int nr_pairs;
+	decision_function *f;	// finished sub-problems f[0,pair)
+	double *probA;		// NULL if not used
+	double *probB;
+	double last_checkpoint;
+	checkpoint_state *resume;	// NULL unless called from svm_train_resume
+
+	// kernel rows shared by the one-vs-one sub-problems, NULL if not used
+	const Shared_Kernel *rows;
+	int class_i;		// classes of the sub-problem being solved
+	int class_j;
+};
+
+static void write_checkpoint_head(FILE *fp, const train_context *ctx, int nr_done, int has_state);
+static void finish_checkpoint(FILE *fp, char *tmp_file, train_context *ctx);
+static FILE *open_checkpoint(const train_context *ctx, char **tmp_file);
+
+// a variable of the block solver and how much it violates the optimality conditions
+struct block_entry
+{
+	double v;
+	int t;
+};
+
+// reorder a[0,n) so that a[0,k) are the k largest violations (quickselect)
+static void select_largest(block_entry *a, int n, int k)
+{
+	int lo = 0, hi = n-1;
+	while(lo < hi && k > lo && k <= hi)
+	{
+		double pivot = a[lo+(hi-lo)/2].v;
+		int i = lo, j = hi;
+		while(i <= j)
+		{
+			while(a[i].v > pivot) i++;
+			while(a[j].v < pivot) j--;
+			if(i <= j)
+			{
+				swap(a[i],a[j]);
+				i++;
+				j--;
+			}
+		}
+		// a[lo,j] >= pivot >= a[i,hi], anything between equals pivot
+		if(k <= j)
+			hi = j;
+		else if(k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
 // An SMO algorithm in Fan et al., JMLR 6(2005), p. 1889--1918
 // Solves:
 //
@@ -382,12 +1553,12 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 //
 //		y^T \alpha = \delta
 //		y_i = +1 or -1
-//		0 <= alpha_i <= Cp for y_i = 1
-//		0 <= alpha_i <= Cn for y_i = -1
+//		0 <= alpha_i <= Cp W_i for y_i = 1
+//		0 <= alpha_i <= Cn W_i for y_i = -1
 //
 // Given:
 //
-//	Q, p, y, Cp, Cn, and an initial feasible point \alpha
+//	Q, p, y, Cp, Cn, W (NULL if all W_i = 1), and an initial feasible point \alpha
 //	l is the size of vectors and matrices
 //	eps is the stopping tolerance
 //
@@ -404,52 +1575,189 @@ public:
 		double upper_bound_p;
 		double upper_bound_n;
 		double r;	// for Solver_NU
+		int iter;
+		bool converged;
 	};
 
 	void Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
-		   double *alpha_, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking);
+		   double *alpha_, double Cp, double Cn, const double *W, double eps,
+		   SolutionInfo* si, int shrinking, train_context *ctx);
 protected:
 	int active_size;
 	schar *y;
 	double *G;		// gradient of objective function
-	enum { LOWER_BOUND, UPPER_BOUND, FREE };
-	char *alpha_status;	// LOWER_BOUND, UPPER_BOUND, FREE
+	enum { LOWER_BOUND, UPPER_BOUND, FREE, FIXED };
+	char *alpha_status;	// LOWER_BOUND, UPPER_BOUND, FREE, FIXED (C_i = 0, at both bounds)
 	double *alpha;
 	const QMatrix *Q;
 	const double *QD;
 	double eps;
 	double Cp,Cn;
+	double *C;		// upper bound of each alpha_i
 	double *p;
 	int *active_set;
 	double *G_bar;		// gradient, if we treat free variables as 0
 	int l;
 	bool unshrink;	// XXX
+	double violation;	// Gmax+Gmax2 of the last working set selection
+	train_context *ctx;
+
+	// columns to prefetch: the variables of the last working set selection
+	// that violate the optimality conditions most, largest first
+	int max_candidates;
+	int nr_candidates;
+	int *candidate;
+	double *candidate_value;
+	double candidate_min;	// a variable must exceed it to be a candidate
+
+	// block working sets, if param.working_set_size > 2: block_size
+	// variables per pass, their columns copied to block_Q
+	int block_size;
+	int *block;
+	Qfloat *block_Q;	// block_size*l
+	double *block_QBB;	// Q restricted to the block, block_size*block_size
+	double *block_alpha, *block_G, *block_delta;
+	int *block_changed;	// members whose alpha changed
+	block_entry *block_up, *block_low;
+	char *in_block;
 
 	double get_C(int i)
 	{
-		return (y[i] > 0)? Cp : Cn;
+		return C[i];
 	}
 	void update_alpha_status(int i)
 	{
-		if(alpha[i] >= get_C(i))
+		if(get_C(i) == 0)
+			alpha_status[i] = FIXED;
+		else if(alpha[i] >= get_C(i))
 			alpha_status[i] = UPPER_BOUND;
 		else if(alpha[i] <= 0)
 			alpha_status[i] = LOWER_BOUND;
 		else alpha_status[i] = FREE;
 	}
-	bool is_upper_bound(int i) { return alpha_status[i] == UPPER_BOUND; }
-	bool is_lower_bound(int i) { return alpha_status[i] == LOWER_BOUND; }
+	// a variable of instance weight 0 is at both bounds, so it is in
+	// neither I_up nor I_low and is never selected
+	bool is_upper_bound(int i) { return alpha_status[i] == UPPER_BOUND || alpha_status[i] == FIXED; }
+	bool is_lower_bound(int i) { return alpha_status[i] == LOWER_BOUND || alpha_status[i] == FIXED; }
 	bool is_free(int i) { return alpha_status[i] == FREE; }
+	bool is_fixed(int i) { return alpha_status[i] == FIXED; }
 	void swap_index(int i, int j);
 	void reconstruct_gradient();
+	void reset_candidates()
+	{
+		nr_candidates = 0;
+		candidate_min = max_candidates > 0 ? -INF : INF;
+	}
+	void add_candidate(int t, double v);
+	void prefetch_candidates(int i, int j);
+	int select_block();
+	int solve_block();
+	// Solver_NU keeps two equality constraints the block step does not
+	virtual bool pairs_only() const { return false; }
 	virtual int select_working_set(int &i, int &j);
 	virtual double calculate_rho();
 	virtual void do_shrinking();
+	bool report_progress(int iter);
+	void save_checkpoint(int iter, int counter);
+	bool restore_checkpoint(const checkpoint_state *ckpt, int &iter, int &counter);
 private:
 	bool be_shrunk(int i, double Gmax1, double Gmax2);
 };
 
+// one SMO step on the pair (i,j): the new alpha_i and alpha_j minimize the
+// objective along y_i*alpha_i + y_j*alpha_j = const within their bounds
+static void solve_pair(schar y_i, schar y_j, double G_i, double G_j,
+		       double QD_i, double QD_j, double Q_ij, double C_i, double C_j,
+		       double &alpha_i, double &alpha_j)
+{
+	if(y_i!=y_j)
+	{
+		double quad_coef = QD_i+QD_j+2*Q_ij;
+		if (quad_coef <= 0)
+			quad_coef = TAU;
+		double delta = (-G_i-G_j)/quad_coef;
+		double diff = alpha_i - alpha_j;
+		alpha_i += delta;
+		alpha_j += delta;
+
+		if(diff > 0)
+		{
+			if(alpha_j < 0)
+			{
+				alpha_j = 0;
+				alpha_i = diff;
+			}
+		}
+		else
+		{
+			if(alpha_i < 0)
+			{
+				alpha_i = 0;
+				alpha_j = -diff;
+			}
+		}
+		if(diff > C_i - C_j)
+		{
+			if(alpha_i > C_i)
+			{
+				alpha_i = C_i;
+				alpha_j = C_i - diff;
+			}
+		}
+		else
+		{
+			if(alpha_j > C_j)
+			{
+				alpha_j = C_j;
+				alpha_i = C_j + diff;
+			}
+		}
+	}
+	else
+	{
+		double quad_coef = QD_i+QD_j-2*Q_ij;
+		if (quad_coef <= 0)
+			quad_coef = TAU;
+		double delta = (G_i-G_j)/quad_coef;
+		double sum = alpha_i + alpha_j;
+		alpha_i -= delta;
+		alpha_j += delta;
+
+		if(sum > C_i)
+		{
+			if(alpha_i > C_i)
+			{
+				alpha_i = C_i;
+				alpha_j = sum - C_i;
+			}
+		}
+		else
+		{
+			if(alpha_j < 0)
+			{
+				alpha_j = 0;
+				alpha_i = sum;
+			}
+		}
+		if(sum > C_j)
+		{
+			if(alpha_j > C_j)
+			{
+				alpha_j = C_j;
+				alpha_i = sum - C_j;
+			}
+		}
+		else
+		{
+			if(alpha_i < 0)
+			{
+				alpha_i = 0;
+				alpha_j = sum;
+			}
+		}
+	}
+}
+
 void Solver::swap_index(int i, int j)
 {
 	Q->swap_index(i,j);
@@ -457,6 +1765,7 @@ void Solver::swap_index(int i, int j)
 	swap(G[i],G[j]);
 	swap(alpha_status[i],alpha_status[j]);
 	swap(alpha[i],alpha[j]);
+	swap(C[i],C[j]);
 	swap(p[i],p[j]);
 	swap(active_set[i],active_set[j]);
 	swap(G_bar[i],G_bar[j]);
@@ -504,12 +1813,132 @@ void Solver::reconstruct_gradient()
 	}
 }
 
+// call progress_func and check the time budget
+// return true if the solve should stop now
+bool Solver::report_progress(int iter)
+{
+	const svm_parameter *param = ctx->param;
+	double elapsed = wall_time() - ctx->start_time;
+	bool stop = param->max_train_time > 0 && elapsed >= param->max_train_time;
+
+	if(param->progress_func != NULL)
+	{
+		svm_progress progress;
+		double v = 0;
+		for(int i=0;i<l;i++)
+			v += alpha[i] * (G[i] + p[i]);
+
+		progress.iter = iter;
+		progress.violation = violation;
+		progress.obj = v/2;
+		progress.active_size = active_size;
+		progress.l = l;
+		progress.elapsed = elapsed;
+		if(param->progress_func(&progress,param->progress_arg) != 0)
+			stop = true;
+	}
+	return stop;
+}
+
+// save the state of the running solve, see write_checkpoint_head for the layout
+void Solver::save_checkpoint(int iter, int counter)
+{
+	char *tmp_file;
+	FILE *fp = open_checkpoint(ctx,&tmp_file);
+	if(fp == NULL)
+		return;
+
+	// the main loop decrements counter before it is used, so store counter+1
+	// to make the first resumed iteration behave like the interrupted one
+	int next_counter = counter+1;
+	char unshrink_ = unshrink;
+	write_checkpoint_head(fp,ctx,ctx->pair,1);
+	fwrite(&ctx->pair,sizeof(int),1,fp);
+	fwrite(&l,sizeof(int),1,fp);
+	fwrite(&iter,sizeof(int),1,fp);
+	fwrite(&next_counter,sizeof(int),1,fp);
+	fwrite(&active_size,sizeof(int),1,fp);
+	fwrite(&unshrink_,sizeof(char),1,fp);
+	fwrite(active_set,sizeof(int),l,fp);
+	fwrite(alpha,sizeof(double),l,fp);
+	fwrite(G,sizeof(double),l,fp);
+	fwrite(G_bar,sizeof(double),l,fp);
+	fwrite(alpha_status,sizeof(char),l,fp);
+	fwrite(y,sizeof(schar),l,fp);
+	fwrite(p,sizeof(double),l,fp);
+	finish_checkpoint(fp,tmp_file,ctx);
+}
+
+// load the state of an interrupted solve and permute Q to match its active set
+// return false if the checkpoint does not belong to this sub-problem
+bool Solver::restore_checkpoint(const checkpoint_state *ckpt, int &iter, int &counter)
+{
+	if(ckpt->sl != l || ckpt->active_size < 0 || ckpt->active_size > l)
+		return false;
+
+	// active_set must be a permutation of 0..l-1, else the bounds and
+	// the replayed swaps would describe another problem
+	bool *seen = new bool[l];
+	for(int i=0;i<l;i++)
+		seen[i] = false;
+	bool valid = true;
+	for(int i=0;i<l && valid;i++)
+	{
+		int k = ckpt->active_set[i];
+		if(k < 0 || k >= l || seen[k] || ckpt->alpha_status[i] < LOWER_BOUND || ckpt->alpha_status[i] > FIXED)
+			valid = false;
+		else
+			seen[k] = true;
+	}
+	delete[] seen;
+	if(!valid)
+		return false;
+
+	memcpy(active_set,ckpt->active_set,sizeof(int)*l);
+	memcpy(alpha,ckpt->alpha,sizeof(double)*l);
+	memcpy(G,ckpt->G,sizeof(double)*l);
+	memcpy(G_bar,ckpt->G_bar,sizeof(double)*l);
+	memcpy(alpha_status,ckpt->alpha_status,sizeof(char)*l);
+	memcpy(y,ckpt->y,sizeof(schar)*l);
+	memcpy(p,ckpt->p,sizeof(double)*l);
+	double *C_orig = new double[l];	// bounds are set in the original order
+	memcpy(C_orig,C,sizeof(double)*l);
+	for(int i=0;i<l;i++)
+		C[i] = C_orig[active_set[i]];
+	delete[] C_orig;
+	active_size = ckpt->active_size;
+	unshrink = ckpt->unshrink;
+	iter = ckpt->iter;
+	counter = ckpt->counter;
+
+	// replay the swaps done by shrinking: position i must hold original index active_set[i]
+	int *pos = new int[l];	// current position of each original index
+	int *orig = new int[l];	// original index at each position
+	for(int i=0;i<l;i++)
+		pos[i] = orig[i] = i;
+	for(int i=0;i<l;i++)
+	{
+		int j = pos[active_set[i]];
+		if(j != i)
+		{
+			Q->swap_index(i,j);
+			swap(orig[i],orig[j]);
+			pos[orig[i]] = i;
+			pos[orig[j]] = j;
+		}
+	}
+	delete[] pos;
+	delete[] orig;
+	return true;
+}
+
 void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
-		   double *alpha_, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking)
+		   double *alpha_, double Cp, double Cn, const double *W, double eps,
+		   SolutionInfo* si, int shrinking, train_context *ctx)
 {
     qInfo() << "Solving using the solver instance." << Qt::endl;
 	this->l = l;
+	this->ctx = ctx;
 	this->Q = &Q;
 	QD=Q.get_QD();
 	clone(p, p_,l);
@@ -517,28 +1946,68 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 	clone(alpha,alpha_,l);
 	this->Cp = Cp;
 	this->Cn = Cn;
+	C = new double[l];
+	for(int i=0;i<l;i++)
+		C[i] = ((y[i] > 0)? Cp : Cn) * (W? W[i] : 1);
 	this->eps = eps;
 	unshrink = false;
+	violation = INF;
+	alpha_status = new char[l];
+	active_set = new int[l];
+	G = new double[l];
+	G_bar = new double[l];
+	max_candidates = Q.prefetch_depth();
+	candidate = new int[max_candidates];
+	candidate_value = new double[max_candidates];
+
+	block_size = pairs_only() ? 0 : min(ctx->param->working_set_size,l);
+	if(block_size > 2)
+	{
+		int q = block_size;
+		block = new int[q];
+		block_Q = new Qfloat[(size_t)q*l];
+		block_QBB = new double[q*q];
+		block_alpha = new double[q];
+		block_G = new double[q];
+		block_delta = new double[q];
+		block_changed = new int[q];
+		block_up = new block_entry[l];
+		block_low = new block_entry[l];
+		in_block = new char[l];
+		memset(in_block,0,l);
+	}
+
+	int iter = 0;
+	int counter = min(l,1000)+1;
+	checkpoint_state *ckpt = ctx->resume;
+	bool resumed = false;
+	if(ckpt != NULL && ckpt->pair == ctx->pair)
+	{
+		resumed = restore_checkpoint(ckpt,iter,counter);
+		if(resumed)
+			info("resuming from iteration %d\n",iter);
+		else
+			fprintf(stderr,"WARNING: checkpoint does not match the problem, starting over\n");
+	}
 
 	// initialize alpha_status
+	if(!resumed)
 	{
-		alpha_status = new char[l];
 		for(int i=0;i<l;i++)
 			update_alpha_status(i);
 	}
 
 	// initialize active set (for shrinking)
+	if(!resumed)
 	{
-		active_set = new int[l];
 		for(int i=0;i<l;i++)
 			active_set[i] = i;
 		active_size = l;
 	}
 
 	// initialize gradient
+	if(!resumed)
 	{
-		G = new double[l];
-		G_bar = new double[l];
 		int i;
 		for(i=0;i<l;i++)
 		{
@@ -561,11 +2030,17 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 
 	// optimization step
 
-	int iter = 0;
-	int max_iter = max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
-	int counter = min(l,1000)+1;
-
-	while(iter < max_iter)
+	// progress_func, the time budget and checkpoints are checked every ctx_interval iterations
+	const svm_parameter *param = ctx->param;
+	int max_iter = param->max_iter > 0 ? param->max_iter :
+		max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
+	int ctx_interval = 0;
+	if(param->progress_func != NULL || param->max_train_time > 0 || param->checkpoint_file != NULL)
+		ctx_interval = param->progress_interval > 0 ? param->progress_interval : min(l,1000);
+	int ctx_counter = ctx_interval;
+	bool stopped = ctx->stopped;
+
+	while(iter < max_iter && !stopped)
 	{
 		// show progress and do shrinking
 
@@ -576,6 +2051,46 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			info(".");
 		}
 
+		if(ctx_interval > 0 && --ctx_counter == 0)
+		{
+			ctx_counter = ctx_interval;
+			if(report_progress(iter))
+			{
+				stopped = ctx->stopped = true;
+				fprintf(stderr,"\nWARNING: training cancelled or out of time, solution is not optimal\n");
+				if(param->checkpoint_file != NULL)
+					save_checkpoint(iter,counter);
+				break;
+			}
+			if(param->checkpoint_file != NULL &&
+			   wall_time() - ctx->last_checkpoint >= param->checkpoint_interval)
+				save_checkpoint(iter,counter);
+		}
+
+		if(block_size > 2)
+		{
+			int nr_iter = solve_block();
+			if(nr_iter == 0)
+			{
+				// reconstruct the whole gradient
+				reconstruct_gradient();
+				// reset active set size and check
+				active_size = l;
+				info("*");
+				if((nr_iter = solve_block()) == 0)
+					break;
+				else
+					counter = 1;	// do shrinking next iteration
+			}
+
+			// a block counts as its SMO steps for shrinking and reporting
+			iter += nr_iter;
+			counter = max(1,counter-nr_iter+1);
+			if(ctx_interval > 0)
+				ctx_counter = max(1,ctx_counter-nr_iter+1);
+			continue;
+		}
+
 		int i,j;
 		if(select_working_set(i,j)!=0)
 		{
@@ -603,102 +2118,17 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		double old_alpha_i = alpha[i];
 		double old_alpha_j = alpha[j];
 
-		if(y[i]!=y[j])
+		solve_pair(y[i],y[j],G[i],G[j],QD[i],QD[j],Q_i[j],C_i,C_j,alpha[i],alpha[j]);
+
+		// update G
+
+		double delta_alpha_i = alpha[i] - old_alpha_i;
+		double delta_alpha_j = alpha[j] - old_alpha_j;
+
+		for(int k=0;k<active_size;k++)
 		{
-			double quad_coef = QD[i]+QD[j]+2*Q_i[j];
-			if (quad_coef <= 0)
-				quad_coef = TAU;
-			double delta = (-G[i]-G[j])/quad_coef;
-			double diff = alpha[i] - alpha[j];
-			alpha[i] += delta;
-			alpha[j] += delta;
-
-			if(diff > 0)
-			{
-				if(alpha[j] < 0)
-				{
-					alpha[j] = 0;
-					alpha[i] = diff;
-				}
-			}
-			else
-			{
-				if(alpha[i] < 0)
-				{
-					alpha[i] = 0;
-					alpha[j] = -diff;
-				}
-			}
-			if(diff > C_i - C_j)
-			{
-				if(alpha[i] > C_i)
-				{
-					alpha[i] = C_i;
-					alpha[j] = C_i - diff;
-				}
-			}
-			else
-			{
-				if(alpha[j] > C_j)
-				{
-					alpha[j] = C_j;
-					alpha[i] = C_j + diff;
-				}
-			}
-		}
-		else
-		{
-			double quad_coef = QD[i]+QD[j]-2*Q_i[j];
-			if (quad_coef <= 0)
-				quad_coef = TAU;
-			double delta = (G[i]-G[j])/quad_coef;
-			double sum = alpha[i] + alpha[j];
-			alpha[i] -= delta;
-			alpha[j] += delta;
-
-			if(sum > C_i)
-			{
-				if(alpha[i] > C_i)
-				{
-					alpha[i] = C_i;
-					alpha[j] = sum - C_i;
-				}
-			}
-			else
-			{
-				if(alpha[j] < 0)
-				{
-					alpha[j] = 0;
-					alpha[i] = sum;
-				}
-			}
-			if(sum > C_j)
-			{
-				if(alpha[j] > C_j)
-				{
-					alpha[j] = C_j;
-					alpha[i] = sum - C_j;
-				}
-			}
-			else
-			{
-				if(alpha[i] < 0)
-				{
-					alpha[i] = 0;
-					alpha[j] = sum;
-				}
-			}
-		}
-
-		// update G
-
-		double delta_alpha_i = alpha[i] - old_alpha_i;
-		double delta_alpha_j = alpha[j] - old_alpha_j;
-
-		for(int k=0;k<active_size;k++)
-		{
-			G[k] += Q_i[k]*delta_alpha_i + Q_j[k]*delta_alpha_j;
-		}
+			G[k] += Q_i[k]*delta_alpha_i + Q_j[k]*delta_alpha_j;
+		}
 
 		// update alpha_status and G_bar
 
@@ -732,7 +2162,7 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		}
 	}
 
-	if(iter >= max_iter)
+	if(iter >= max_iter || stopped)
 	{
 		if(active_size < l)
 		{
@@ -741,8 +2171,11 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			active_size = l;
 			info("*");
 		}
-		fprintf(stderr,"\nWARNING: reaching max number of iterations\n");
+		if(!stopped && param->max_iter <= 0)
+			fprintf(stderr,"\nWARNING: reaching max number of iterations\n");
 	}
+	si->iter = iter;
+	si->converged = iter < max_iter && !stopped;
 
 	// calculate rho
 
@@ -780,10 +2213,243 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 	delete[] p;
 	delete[] y;
 	delete[] alpha;
+	delete[] C;
 	delete[] alpha_status;
 	delete[] active_set;
 	delete[] G;
 	delete[] G_bar;
+	delete[] candidate;
+	delete[] candidate_value;
+	if(block_size > 2)
+	{
+		delete[] block;
+		delete[] block_Q;
+		delete[] block_QBB;
+		delete[] block_alpha;
+		delete[] block_G;
+		delete[] block_delta;
+		delete[] block_changed;
+		delete[] block_up;
+		delete[] block_low;
+		delete[] in_block;
+	}
+}
+
+void Solver::add_candidate(int t, double v)
+{
+	int k = nr_candidates < max_candidates ? nr_candidates++ : max_candidates-1;
+	while(k > 0 && candidate_value[k-1] < v)
+	{
+		candidate[k] = candidate[k-1];
+		candidate_value[k] = candidate_value[k-1];
+		k--;
+	}
+	candidate[k] = t;
+	candidate_value[k] = v;
+	if(nr_candidates == max_candidates)
+		candidate_min = candidate_value[max_candidates-1];
+}
+
+// the next working sets are likely drawn from the candidates,
+// columns i and j are about to be read anyway
+void Solver::prefetch_candidates(int i, int j)
+{
+	for(int k=0;k<nr_candidates;k++)
+		if(candidate[k] != i && candidate[k] != j)
+			Q->prefetch(candidate[k]);
+}
+
+// the block of the variables violating the optimality conditions most:
+// up to block_size/2 by -y_t*grad(f)_t in I_up and the rest by
+// y_t*grad(f)_t in I_low, fewer if a side has fewer variables
+// return its size, 0 if already optimal
+int Solver::select_block()
+{
+	int nr_up = 0, nr_low = 0;
+	double Gmax = -INF;
+	double Gmax2 = -INF;
+
+	for(int t=0;t<active_size;t++)
+	{
+		double v = y[t]==+1 ? -G[t] : G[t];
+		if(y[t]==+1 ? !is_upper_bound(t) : !is_lower_bound(t))
+		{
+			block_up[nr_up].v = v;
+			block_up[nr_up++].t = t;
+			Gmax = max(Gmax,v);
+		}
+		if(y[t]==+1 ? !is_lower_bound(t) : !is_upper_bound(t))
+		{
+			block_low[nr_low].v = -v;
+			block_low[nr_low++].t = t;
+			Gmax2 = max(Gmax2,-v);
+		}
+	}
+
+	violation = Gmax+Gmax2;
+	if(Gmax+Gmax2 < eps)
+		return 0;
+
+	int q_up = min(nr_up,max(block_size/2,block_size-nr_low));
+	int q_low = min(nr_low,block_size-q_up);
+	select_largest(block_up,nr_up,q_up);
+	select_largest(block_low,nr_low,q_low);
+
+	// free variables can be on both sides
+	int n = 0, k;
+	for(k=0;k<q_up;k++)
+	{
+		in_block[block_up[k].t] = 1;
+		block[n++] = block_up[k].t;
+	}
+	for(k=0;k<q_low;k++)
+		if(!in_block[block_low[k].t])
+			block[n++] = block_low[k].t;
+	for(k=0;k<q_up;k++)
+		in_block[block_up[k].t] = 0;
+	return n;
+}
+
+// one pass of the block solver: the sub-problem of the block is solved by
+// SMO on its n*n matrix, then the gradient of the active variables is
+// updated from the n columns by all threads
+// return the number of SMO steps, 0 if already optimal
+int Solver::solve_block()
+{
+	int n = select_block();
+	if(n == 0)
+		return 0;
+
+	int b, c, k;
+	size_t len = active_size;
+	for(b=0;b<n;b++)
+		memcpy(&block_Q[b*len],Q->get_Q(block[b],active_size),sizeof(Qfloat)*len);
+	for(b=0;b<n;b++)
+	{
+		for(c=0;c<n;c++)
+			block_QBB[b*n+c] = block_Q[b*len+block[c]];
+		block_alpha[b] = alpha[block[b]];
+		block_G[b] = G[block[b]];
+	}
+
+	// solved to a tolerance relative to the violation of the whole problem,
+	// later blocks correct what this one leaves
+	double sub_eps = max(eps,0.1*violation);
+	int steps, max_steps = 10*n;
+	for(steps=0;steps<max_steps;steps++)
+	{
+		// select_working_set among the block
+		double Gmax = -INF;
+		double Gmax2 = -INF;
+		int i = -1, j = -1;
+		double obj_diff_min = INF;
+		for(b=0;b<n;b++)
+		{
+			int t = block[b];
+			if(y[t]==+1 ? block_alpha[b] < get_C(t) : block_alpha[b] > 0)
+			{
+				double v = y[t]==+1 ? -block_G[b] : block_G[b];
+				if(v >= Gmax)
+				{
+					Gmax = v;
+					i = b;
+				}
+			}
+		}
+		if(i == -1)
+			break;
+		const double *Q_i = &block_QBB[i*n];
+		schar y_i = y[block[i]];
+		for(b=0;b<n;b++)
+		{
+			int t = block[b];
+			double grad_diff, quad_coef;
+			if(y[t]==+1)
+			{
+				if(block_alpha[b] <= 0)
+					continue;
+				grad_diff = Gmax+block_G[b];
+				Gmax2 = max(Gmax2,block_G[b]);
+				quad_coef = QD[block[i]]+QD[t]-2.0*y_i*Q_i[b];
+			}
+			else
+			{
+				if(block_alpha[b] >= get_C(t))
+					continue;
+				grad_diff = Gmax-block_G[b];
+				Gmax2 = max(Gmax2,-block_G[b]);
+				quad_coef = QD[block[i]]+QD[t]+2.0*y_i*Q_i[b];
+			}
+			if(grad_diff > 0)
+			{
+				double obj_diff = -(grad_diff*grad_diff)/(quad_coef > 0 ? quad_coef : TAU);
+				if(obj_diff <= obj_diff_min)
+				{
+					j = b;
+					obj_diff_min = obj_diff;
+				}
+			}
+		}
+		if(Gmax+Gmax2 < sub_eps || j == -1)
+			break;
+
+		int t_i = block[i], t_j = block[j];
+		double old_alpha_i = block_alpha[i];
+		double old_alpha_j = block_alpha[j];
+		solve_pair(y[t_i],y[t_j],block_G[i],block_G[j],QD[t_i],QD[t_j],Q_i[j],
+			   get_C(t_i),get_C(t_j),block_alpha[i],block_alpha[j]);
+		double delta_alpha_i = block_alpha[i] - old_alpha_i;
+		double delta_alpha_j = block_alpha[j] - old_alpha_j;
+		const double *Q_j = &block_QBB[j*n];
+		for(b=0;b<n;b++)
+			block_G[b] += Q_i[b]*delta_alpha_i + Q_j[b]*delta_alpha_j;
+	}
+
+	int m = 0;
+	for(b=0;b<n;b++)
+		if(block_alpha[b] != alpha[block[b]])
+		{
+			block_changed[m] = b;
+			block_delta[m++] = block_alpha[b] - alpha[block[b]];
+		}
+
+	// update G in row blocks, each of them stays in cache for all n columns
+#ifdef _OPENMP
+#pragma omp parallel for private(k,c) schedule(static)
+#endif
+	for(int k0=0;k0<active_size;k0+=GRADIENT_BLOCK)
+	{
+		int k1 = min(k0+GRADIENT_BLOCK,active_size);
+		for(c=0;c<m;c++)
+		{
+			const Qfloat *Q_c = &block_Q[block_changed[c]*len];
+			double delta = block_delta[c];
+			for(k=k0;k<k1;k++)
+				G[k] += Q_c[k]*delta;
+		}
+	}
+
+	// update alpha, alpha_status and G_bar
+	for(c=0;c<m;c++)
+	{
+		int t = block[block_changed[c]];
+		bool u = is_upper_bound(t);
+		alpha[t] = block_alpha[block_changed[c]];
+		update_alpha_status(t);
+		if(u != is_upper_bound(t))
+		{
+			const Qfloat *Q_t = Q->get_Q(t,l);
+			double C_t = get_C(t);
+			if(u)
+				for(k=0;k<l;k++)
+					G_bar[k] -= C_t * Q_t[k];
+			else
+				for(k=0;k<l;k++)
+					G_bar[k] += C_t * Q_t[k];
+		}
+	}
+
+	return max(steps,1);
 }
 
 // return 1 if already optimal, return 0 otherwise
@@ -800,25 +2466,34 @@ int Solver::select_working_set(int &out_i, int &out_j)
 	int Gmax_idx = -1;
 	int Gmin_idx = -1;
 	double obj_diff_min = INF;
+	reset_candidates();
 
 	for(int t=0;t<active_size;t++)
 		if(y[t]==+1)
 		{
 			if(!is_upper_bound(t))
+			{
 				if(-G[t] >= Gmax)
 				{
 					Gmax = -G[t];
 					Gmax_idx = t;
 				}
+				if(-G[t] > candidate_min)
+					add_candidate(t,-G[t]);
+			}
 		}
 		else
 		{
 			if(!is_lower_bound(t))
+			{
 				if(G[t] >= Gmax)
 				{
 					Gmax = G[t];
 					Gmax_idx = t;
 				}
+				if(G[t] > candidate_min)
+					add_candidate(t,G[t]);
+			}
 		}
 
 	int i = Gmax_idx;
@@ -835,6 +2510,8 @@ int Solver::select_working_set(int &out_i, int &out_j)
 				double grad_diff=Gmax+G[j];
 				if (G[j] >= Gmax2)
 					Gmax2 = G[j];
+				if (G[j] > candidate_min)
+					add_candidate(j,G[j]);
 				if (grad_diff > 0)
 				{
 					double obj_diff;
@@ -859,6 +2536,8 @@ int Solver::select_working_set(int &out_i, int &out_j)
 				double grad_diff= Gmax-G[j];
 				if (-G[j] >= Gmax2)
 					Gmax2 = -G[j];
+				if (-G[j] > candidate_min)
+					add_candidate(j,-G[j]);
 				if (grad_diff > 0)
 				{
 					double obj_diff;
@@ -878,11 +2557,13 @@ int Solver::select_working_set(int &out_i, int &out_j)
 		}
 	}
 
+	violation = Gmax+Gmax2;
 	if(Gmax+Gmax2 < eps || Gmin_idx == -1)
 		return 1;
 
 	out_i = Gmax_idx;
 	out_j = Gmin_idx;
+	prefetch_candidates(out_i,out_j);
 	return 0;
 }
 
@@ -976,6 +2657,10 @@ double Solver::calculate_rho()
 	{
 		double yG = y[i]*G[i];
 
+		// no optimality condition bounds rho through a fixed variable
+		if(is_fixed(i))
+			continue;
+
 		if(is_upper_bound(i))
 		{
 			if(y[i]==-1)
@@ -1015,14 +2700,15 @@ class Solver_NU: public Solver
 public:
 	Solver_NU() {}
 	void Solve(int l, const QMatrix& Q, const double *p, const schar *y,
-		   double *alpha, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking)
+		   double *alpha, double Cp, double Cn, const double *W, double eps,
+		   SolutionInfo* si, int shrinking, train_context *ctx)
 	{
 		this->si = si;
-		Solver::Solve(l,Q,p,y,alpha,Cp,Cn,eps,si,shrinking);
+		Solver::Solve(l,Q,p,y,alpha,Cp,Cn,W,eps,si,shrinking,ctx);
 	}
 private:
 	SolutionInfo *si;
+	bool pairs_only() const { return true; }
 	int select_working_set(int &i, int &j);
 	double calculate_rho();
 	bool be_shrunk(int i, double Gmax1, double Gmax2, double Gmax3, double Gmax4);
@@ -1048,25 +2734,34 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 
 	int Gmin_idx = -1;
 	double obj_diff_min = INF;
+	reset_candidates();
 
 	for(int t=0;t<active_size;t++)
 		if(y[t]==+1)
 		{
 			if(!is_upper_bound(t))
+			{
 				if(-G[t] >= Gmaxp)
 				{
 					Gmaxp = -G[t];
 					Gmaxp_idx = t;
 				}
+				if(-G[t] > candidate_min)
+					add_candidate(t,-G[t]);
+			}
 		}
 		else
 		{
 			if(!is_lower_bound(t))
+			{
 				if(G[t] >= Gmaxn)
 				{
 					Gmaxn = G[t];
 					Gmaxn_idx = t;
 				}
+				if(G[t] > candidate_min)
+					add_candidate(t,G[t]);
+			}
 		}
 
 	int ip = Gmaxp_idx;
@@ -1087,6 +2782,8 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 				double grad_diff=Gmaxp+G[j];
 				if (G[j] >= Gmaxp2)
 					Gmaxp2 = G[j];
+				if (G[j] > candidate_min)
+					add_candidate(j,G[j]);
 				if (grad_diff > 0)
 				{
 					double obj_diff;
@@ -1111,6 +2808,8 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 				double grad_diff=Gmaxn-G[j];
 				if (-G[j] >= Gmaxn2)
 					Gmaxn2 = -G[j];
+				if (-G[j] > candidate_min)
+					add_candidate(j,-G[j]);
 				if (grad_diff > 0)
 				{
 					double obj_diff;
@@ -1130,6 +2829,7 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 		}
 	}
 
+	violation = max(Gmaxp+Gmaxp2,Gmaxn+Gmaxn2);
 	if(max(Gmaxp+Gmaxp2,Gmaxn+Gmaxn2) < eps || Gmin_idx == -1)
 		return 1;
 
@@ -1138,6 +2838,7 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 	else
 		out_i = Gmaxn_idx;
 	out_j = Gmin_idx;
+	prefetch_candidates(out_i,out_j);
 
 	return 0;
 }
@@ -1223,6 +2924,9 @@ double Solver_NU::calculate_rho()
 
 	for(int i=0;i<active_size;i++)
 	{
+		if(is_fixed(i))
+			continue;
+
 		if(y[i]==+1)
 		{
 			if(is_upper_bound(i))
@@ -1265,105 +2969,665 @@ double Solver_NU::calculate_rho()
 }
 
 //
-// Q matrices for various formulations
+// Small generator with a fixed sequence for a given seed (splitmix64),
+// so seeded results do not depend on rand() or the C++ library
 //
-class SVC_Q: public Kernel
+struct rng_state
 {
-public:
-	SVC_Q(const svm_problem& prob, const svm_parameter& param, const schar *y_)
-	:Kernel(prob.l, prob.x, param)
-	{
-		clone(y,y_,prob.l);
-		cache = new Cache(prob.l,(size_t)(param.cache_size*(1<<20)));
-		QD = new double[prob.l];
-		for(int i=0;i<prob.l;i++)
-			QD[i] = (this->*kernel_function)(i,i);
-	}
+	unsigned long long s;
+};
 
-	Qfloat *get_Q(int i, int len) const
-	{
-		Qfloat *data;
-		int start, j;
-		if((start = cache->get_data(i,&data,len)) < len)
-		{
-#ifdef _OPENMP
-#pragma omp parallel for private(j) schedule(guided)
-#endif
-			for(j=start;j<len;j++)
-				data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
-		}
-		return data;
-	}
+static unsigned long long rng_next(rng_state *r)
+{
+	unsigned long long z = (r->s += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
 
-	double *get_QD() const
-	{
-		return QD;
-	}
+// uniform in [0,n)
+static int rng_int(rng_state *r, int n)
+{
+	return (int)(rng_next(r) % (unsigned long long)n);
+}
 
-	void swap_index(int i, int j) const
+// first m entries of perm become a uniform random sample of [0,l)
+static void sample_indices(int l, int m, rng_state *rng, int *perm)
+{
+	int i;
+	for(i=0;i<l;i++)
+		perm[i] = i;
+	for(i=0;i<m;i++)
+		swap(perm[i],perm[i+rng_int(rng,l-i)]);
+}
+
+// uniform in (0,1]
+static double rng_uniform(rng_state *r)
+{
+	return ((rng_next(r) >> 11) + 1.0)*(1.0/9007199254740992.0);
+}
+
+// standard normal, Box-Muller
+static double rng_normal(rng_state *r)
+{
+	double u = rng_uniform(r);
+	double v = rng_uniform(r);
+	return sqrt(-2*log(u))*cos(TWO_PI*v);
+}
+
+// progress report and time budget of the linear solvers, called once per pass;
+// obj is only used if progress_func is set. Returns true to stop.
+static bool linear_solver_stop(train_context *ctx, int iter, double violation,
+	double obj, int active_size, int l)
+{
+	const svm_parameter *param = ctx->param;
+	svm_progress progress;
+	progress.elapsed = wall_time() - ctx->start_time;
+	bool stop = param->max_train_time > 0 && progress.elapsed >= param->max_train_time;
+	if(param->progress_func != NULL)
 	{
-		cache->swap_index(i,j);
-		Kernel::swap_index(i,j);
-		swap(y[i],y[j]);
-		swap(QD[i],QD[j]);
+		progress.iter = iter;
+		progress.violation = violation;
+		progress.obj = obj;
+		progress.active_size = active_size;
+		progress.l = l;
+		if(param->progress_func(&progress,param->progress_arg) != 0)
+			stop = true;
 	}
-
-	~SVC_Q()
+	if(stop)
 	{
-		delete[] y;
-		delete cache;
-		delete[] QD;
+		fprintf(stderr,"\nWARNING: training cancelled or out of time, solution is not optimal\n");
+		ctx->stopped = true;
 	}
-private:
-	schar *y;
-	Cache *cache;
-	double *QD;
-};
+	return stop;
+}
 
-class ONE_CLASS_Q: public Kernel
+//
+// Dual coordinate descent for linear SVM, Hsieh et al., ICML 2008
+// Solves the C_SVC dual without the equality constraint:
+//
+//	min 0.5(\alpha^T Q \alpha) - e^T \alpha
+//
+//		y_i = +1 or -1
+//		0 <= alpha_i <= Cp W_i for y_i = 1
+//		0 <= alpha_i <= Cn W_i for y_i = -1
+//
+// Q_ij = y_i y_j (x_i^T x_j + 1), the 1 being a bias feature, so each step
+// updates one alpha_i in closed form and w = \sum y_i alpha_i [x_i,1] is
+// kept explicitly. The stopping criterion is the one of Solver: the spread
+// of the projected gradient is at most eps.
+//
+// Rows gives access to the data: dim, and dot(i,w), axpy(i,a,w) and
+// sqnorm(i) for row i of the problem. w has dim+1 entries, w[dim] is the bias.
+//
+// returns false if stopped by max_iter or train_context; iterations are passes over
+// the active variables, max_iter counts single-variable steps as in Solver
+//
+template <class Rows>
+static bool solve_linear_svc(const Rows& rows, int l, const schar *y, double Cp, double Cn,
+	const double *W, double eps, int shrinking, unsigned int seed, train_context *ctx, double *alpha, double *w)
 {
-public:
-	ONE_CLASS_Q(const svm_problem& prob, const svm_parameter& param)
-	:Kernel(prob.l, prob.x, param)
+	int dim = rows.dim;
+	int i, s, iter = 0;
+	// as in Solver, max_iter bounds the number of single-variable steps
+	const svm_parameter *param = ctx->param;
+	long long max_iter = param->max_iter > 0 ? param->max_iter : max(10000000LL,100LL*l);
+	long long nr_step = 0;
+	bool optimal = false;
+	int active_size = l;
+	int *index = new int[l];
+	double *QD = new double[l];
+	double PGmax_old = INF;
+	double PGmin_old = -INF;
+	double PGmax_new, PGmin_new;
+	rng_state rng = {seed};
+
+	for(i=0;i<=dim;i++)
+		w[i] = 0;
+	for(i=0;i<l;i++)
 	{
-		cache = new Cache(prob.l,(size_t)(param.cache_size*(1<<20)));
-		QD = new double[prob.l];
-		for(int i=0;i<prob.l;i++)
-			QD[i] = (this->*kernel_function)(i,i);
+		alpha[i] = 0;
+		QD[i] = rows.sqnorm(i) + 1;
+		index[i] = i;
 	}
 
-	Qfloat *get_Q(int i, int len) const
+	while(nr_step < max_iter && !ctx->stopped)
 	{
-		Qfloat *data;
-		int start, j;
-		if((start = cache->get_data(i,&data,len)) < len)
+		PGmax_new = -INF;
+		PGmin_new = INF;
+		nr_step += active_size;
+
+		for(s=0;s<active_size;s++)
+			swap(index[s],index[s+rng_int(&rng,active_size-s)]);
+
+		for(s=0;s<active_size;s++)
 		{
-			for(j=start;j<len;j++)
-				data[j] = (Qfloat)(this->*kernel_function)(i,j);
+			i = index[s];
+			double C = ((y[i] > 0)? Cp : Cn) * (W? W[i] : 1);
+
+			// a row of weight 0 keeps alpha_i = 0 and takes no part
+			if(C == 0)
+				continue;
+
+			double G = y[i]*(rows.dot(i,w) + w[dim]) - 1;
+			double PG = 0;
+
+			if(alpha[i] == 0)
+			{
+				if(shrinking && G > PGmax_old)
+				{
+					active_size--;
+					swap(index[s],index[active_size]);
+					s--;
+					continue;
+				}
+				else if(G < 0)
+					PG = G;
+			}
+			else if(alpha[i] == C)
+			{
+				if(shrinking && G < PGmin_old)
+				{
+					active_size--;
+					swap(index[s],index[active_size]);
+					s--;
+					continue;
+				}
+				else if(G > 0)
+					PG = G;
+			}
+			else
+				PG = G;
+
+			PGmax_new = max(PGmax_new,PG);
+			PGmin_new = min(PGmin_new,PG);
+
+			if(fabs(PG) > TAU)
+			{
+				double alpha_old = alpha[i];
+				alpha[i] = min(max(alpha[i] - G/QD[i],0.0),C);
+				double d = (alpha[i] - alpha_old)*y[i];
+				rows.axpy(i,d,w);
+				w[dim] += d;
+			}
 		}
-		return data;
+
+		iter++;
+		if(iter % 10 == 0)
+			info(".");
+
+		if(param->progress_func != NULL || param->max_train_time > 0)
+		{
+			double v = 0;
+			if(param->progress_func != NULL)
+			{
+				for(i=0;i<=dim;i++)
+					v += w[i]*w[i];
+				v /= 2;
+				for(i=0;i<l;i++)
+					v -= alpha[i];
+			}
+			if(linear_solver_stop(ctx,iter,PGmax_new-PGmin_new,v,active_size,l))
+				break;
+		}
+
+		if(PGmax_new - PGmin_new <= eps)
+		{
+			if(active_size == l)
+			{
+				optimal = true;
+				break;
+			}
+			else
+			{
+				// check the shrunk variables once more without shrinking
+				active_size = l;
+				info("*");
+				PGmax_old = INF;
+				PGmin_old = -INF;
+				continue;
+			}
+		}
+		PGmax_old = PGmax_new;
+		PGmin_old = PGmin_new;
+		if(PGmax_old <= 0)
+			PGmax_old = INF;
+		if(PGmin_old >= 0)
+			PGmin_old = -INF;
 	}
 
-	double *get_QD() const
+	if(!optimal && !ctx->stopped && param->max_iter <= 0)
+		fprintf(stderr,"\nWARNING: reaching max number of iterations\n");
+	info("\noptimization finished, #iter = %d\n",iter);
+
+	delete[] index;
+	delete[] QD;
+	return optimal;
+}
+
+//
+// Dual coordinate descent for linear epsilon-SVR, Ho and Lin, JMLR 13(2012)
+// Solves:
+//
+//	min 0.5(\beta^T Q \beta) - y^T \beta + p \sum |\beta_i|
+//
+//		-C W_i <= beta_i <= C W_i
+//
+// with Q_ij = x_i^T x_j + 1 and w = \sum \beta_i [x_i,1] as in solve_linear_svc.
+// Stops when the largest violation of the optimality conditions is at most eps.
+//
+template <class Rows>
+static bool solve_linear_svr(const Rows& rows, int l, const double *y, double C_, const double *W,
+	double p, double eps, int shrinking, unsigned int seed, train_context *ctx, double *beta, double *w)
+{
+	int dim = rows.dim;
+	int i, s, iter = 0;
+	// as in Solver, max_iter bounds the number of single-variable steps
+	const svm_parameter *param = ctx->param;
+	long long max_iter = param->max_iter > 0 ? param->max_iter : max(10000000LL,100LL*l);
+	long long nr_step = 0;
+	bool optimal = false;
+	int active_size = l;
+	int *index = new int[l];
+	double *QD = new double[l];
+	double Gmax_old = INF;
+	double Gmax_new;
+	rng_state rng = {seed};
+
+	for(i=0;i<=dim;i++)
+		w[i] = 0;
+	for(i=0;i<l;i++)
 	{
-		return QD;
+		beta[i] = 0;
+		QD[i] = rows.sqnorm(i) + 1;
+		index[i] = i;
 	}
 
-	void swap_index(int i, int j) const
+	while(nr_step < max_iter && !ctx->stopped)
 	{
-		cache->swap_index(i,j);
-		Kernel::swap_index(i,j);
+		Gmax_new = 0;
+		nr_step += active_size;
+
+		for(s=0;s<active_size;s++)
+			swap(index[s],index[s+rng_int(&rng,active_size-s)]);
+
+		for(s=0;s<active_size;s++)
+		{
+			i = index[s];
+			double C = C_ * (W? W[i] : 1);
+
+			// a row of weight 0 keeps beta_i = 0 and takes no part
+			if(C == 0)
+				continue;
+
+			double G = rows.dot(i,w) + w[dim] - y[i];
+			double H = QD[i];
+			double Gp = G + p;
+			double Gn = G - p;
+			double violation = 0;
+
+			if(beta[i] == 0)
+			{
+				if(Gp < 0)
+					violation = -Gp;
+				else if(Gn > 0)
+					violation = Gn;
+				else if(shrinking && Gp > Gmax_old && Gn < -Gmax_old)
+				{
+					active_size--;
+					swap(index[s],index[active_size]);
+					s--;
+					continue;
+				}
+			}
+			else if(beta[i] >= C)
+			{
+				if(Gp > 0)
+					violation = Gp;
+				else if(shrinking && Gp < -Gmax_old)
+				{
+					active_size--;
+					swap(index[s],index[active_size]);
+					s--;
+					continue;
+				}
+			}
+			else if(beta[i] <= -C)
+			{
+				if(Gn < 0)
+					violation = -Gn;
+				else if(shrinking && Gn > Gmax_old)
+				{
+					active_size--;
+					swap(index[s],index[active_size]);
+					s--;
+					continue;
+				}
+			}
+			else if(beta[i] > 0)
+				violation = fabs(Gp);
+			else
+				violation = fabs(Gn);
+
+			Gmax_new = max(Gmax_new,violation);
+
+			// Newton step of the one-variable problem, |beta_i| is not smooth at 0
+			double d;
+			if(Gp < H*beta[i])
+				d = -Gp/H;
+			else if(Gn > H*beta[i])
+				d = -Gn/H;
+			else
+				d = -beta[i];
+
+			if(fabs(d) > TAU)
+			{
+				double beta_old = beta[i];
+				beta[i] = min(max(beta[i]+d,-C),C);
+				d = beta[i] - beta_old;
+				rows.axpy(i,d,w);
+				w[dim] += d;
+			}
+		}
+
+		iter++;
+		if(iter % 10 == 0)
+			info(".");
+
+		if(param->progress_func != NULL || param->max_train_time > 0)
+		{
+			double v = 0;
+			if(param->progress_func != NULL)
+			{
+				for(i=0;i<=dim;i++)
+					v += w[i]*w[i];
+				v /= 2;
+				for(i=0;i<l;i++)
+					v += p*fabs(beta[i]) - y[i]*beta[i];
+			}
+			if(linear_solver_stop(ctx,iter,Gmax_new,v,active_size,l))
+				break;
+		}
+
+		if(Gmax_new <= eps)
+		{
+			if(active_size == l)
+			{
+				optimal = true;
+				break;
+			}
+			else
+			{
+				active_size = l;
+				info("*");
+				Gmax_old = INF;
+				continue;
+			}
+		}
+		Gmax_old = Gmax_new;
+	}
+
+	if(!optimal && !ctx->stopped && param->max_iter <= 0)
+		fprintf(stderr,"\nWARNING: reaching max number of iterations\n");
+	info("\noptimization finished, #iter = %d\n",iter);
+
+	delete[] index;
+	delete[] QD;
+	return optimal;
+}
+
+// rows of svm_problem.x, for the linear solvers
+struct sparse_rows
+{
+	const svm_node * const *x;
+	int dim;		// indices are below dim
+
+	double dot(int i, const double *w) const
+	{
+		double sum = 0;
+		for(const svm_node *p=x[i];p->index!=-1;p++)
+			sum += p->value*w[p->index];
+		return sum;
+	}
+	void axpy(int i, double a, double *w) const
+	{
+		for(const svm_node *p=x[i];p->index!=-1;p++)
+			w[p->index] += a*p->value;
+	}
+	double sqnorm(int i) const
+	{
+		double sum = 0;
+		for(const svm_node *p=x[i];p->index!=-1;p++)
+			sum += p->value*p->value;
+		return sum;
+	}
+};
+
+//
+// Q matrices for various formulations
+//
+
+// bytes of kernel cache for a solver over len variables: cache_size less
+// the copies of the block columns, if the solver uses block working sets
+static size_t cache_bytes(const svm_parameter& param, size_t len)
+{
+	size_t size = (size_t)(param.cache_size*(1<<20));
+	if(param.working_set_size > 2 && param.svm_type != NU_SVC && param.svm_type != NU_SVR)
+	{
+		size_t block = min((size_t)param.working_set_size,len)*len*sizeof(Qfloat);
+		size = size > block? size-block : 0;	// Cache keeps room for two columns
+	}
+	return size;
+}
+
+class SVC_Q: public Kernel
+{
+public:
+	SVC_Q(const svm_problem& prob, const svm_parameter& param, const schar *y_)
+	:Kernel(prob.l, prob.x, param)
+	{
+		l = prob.l;
+		clone(y,y_,l);
+		cache = new Cache(l,cache_bytes(param,l),param.cache_type,placement_of(param));
+		QD = new double[l];
+		index = new int[l];
+		for(int i=0;i<l;i++)
+		{
+			index[i] = i;
+			QD[i] = (this->*kernel_function)(i,i);
+		}
+		buffer[0] = new Qfloat[l];
+		buffer[1] = new Qfloat[l];
+		next_buffer = 0;
+		first_moved = l;
+		prefetcher = param.prefetch_threads > 0 ? new Prefetcher(this,param.prefetch_threads,l) : NULL;
+	}
+
+	Qfloat *get_Q(int i, int len) const
+	{
+		Qfloat *data;
+		int start, j, real_i = index[i];
+		if((start = cache->get_data(real_i,&data,l)) < l)
+		{
+			if(prefetcher == NULL || !prefetcher->take(real_i,data,start,l))
+			{
+				begin_column(real_i);
+				for(int b=start,e;b<l;b=e)
+				{
+					e = fill_block(b,start,l);
+#ifdef _OPENMP
+#pragma omp parallel for private(j) schedule(guided)
+#endif
+					for(j=b;j<e;j++)
+						data[j] = (Qfloat)(y[real_i]*y[j]*(this->*column_function)(real_i,j));
+				}
+				end_column(real_i);
+			}
+			cache->store(real_i,data,start,l);
+		}
+
+		// reorder, unless positions [0,len) are all in place
+		if(len <= first_moved)
+			return data;
+		Qfloat *buf = buffer[next_buffer];
+		next_buffer = 1 - next_buffer;
+		for(j=0;j<len;j++)
+			buf[j] = data[index[j]];
+		return buf;
+	}
+
+	double *get_QD() const
+	{
+		return QD;
+	}
+
+	void swap_index(int i, int j) const
+	{
+		swap(index[i],index[j]);
+		swap(QD[i],QD[j]);
+		if(i != j)
+			first_moved = min(first_moved,min(i,j));
+	}
+
+	void prefetch(int i) const
+	{
+		if(prefetcher != NULL && !cache->has_data(index[i],l))
+			prefetcher->request(index[i],l);
+	}
+
+	int prefetch_depth() const
+	{
+		return prefetcher != NULL ? prefetcher->depth() : 0;
+	}
+
+	~SVC_Q()
+	{
+		delete prefetcher;
+		delete[] y;
+		delete cache;
+		delete[] index;
+		delete[] buffer[0];
+		delete[] buffer[1];
+		delete[] QD;
+	}
+private:
+	int l;
+	schar *y;	// by original index
+	Cache *cache;
+	Prefetcher *prefetcher;
+	int *index;	// original index of each position, columns are cached by it
+	mutable int first_moved;	// positions before it have not been swapped
+	mutable int next_buffer;
+	Qfloat *buffer[2];
+	double *QD;
+
+	void compute_column(int i, Qfloat *data, int len) const
+	{
+		for(int j=0;j<len;j++)
+			data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
+	}
+};
+
+class ONE_CLASS_Q: public Kernel
+{
+public:
+	ONE_CLASS_Q(const svm_problem& prob, const svm_parameter& param)
+	:Kernel(prob.l, prob.x, param)
+	{
+		l = prob.l;
+		cache = new Cache(l,cache_bytes(param,l),param.cache_type,placement_of(param));
+		QD = new double[l];
+		index = new int[l];
+		for(int i=0;i<l;i++)
+		{
+			index[i] = i;
+			QD[i] = (this->*kernel_function)(i,i);
+		}
+		buffer[0] = new Qfloat[l];
+		buffer[1] = new Qfloat[l];
+		next_buffer = 0;
+		first_moved = l;
+		prefetcher = param.prefetch_threads > 0 ? new Prefetcher(this,param.prefetch_threads,l) : NULL;
+	}
+
+	Qfloat *get_Q(int i, int len) const
+	{
+		Qfloat *data;
+		int start, j, real_i = index[i];
+		if((start = cache->get_data(real_i,&data,l)) < l)
+		{
+			if(prefetcher == NULL || !prefetcher->take(real_i,data,start,l))
+			{
+				begin_column(real_i);
+				for(int b=start,e;b<l;b=e)
+				{
+					e = fill_block(b,start,l);
+					for(j=b;j<e;j++)
+						data[j] = (Qfloat)(this->*column_function)(real_i,j);
+				}
+				end_column(real_i);
+			}
+			cache->store(real_i,data,start,l);
+		}
+
+		// reorder, unless positions [0,len) are all in place
+		if(len <= first_moved)
+			return data;
+		Qfloat *buf = buffer[next_buffer];
+		next_buffer = 1 - next_buffer;
+		for(j=0;j<len;j++)
+			buf[j] = data[index[j]];
+		return buf;
+	}
+
+	double *get_QD() const
+	{
+		return QD;
+	}
+
+	void swap_index(int i, int j) const
+	{
+		swap(index[i],index[j]);
 		swap(QD[i],QD[j]);
+		if(i != j)
+			first_moved = min(first_moved,min(i,j));
+	}
+
+	void prefetch(int i) const
+	{
+		if(prefetcher != NULL && !cache->has_data(index[i],l))
+			prefetcher->request(index[i],l);
+	}
+
+	int prefetch_depth() const
+	{
+		return prefetcher != NULL ? prefetcher->depth() : 0;
 	}
 
 	~ONE_CLASS_Q()
 	{
+		delete prefetcher;
 		delete cache;
+		delete[] index;
+		delete[] buffer[0];
+		delete[] buffer[1];
 		delete[] QD;
 	}
 private:
+	int l;
 	Cache *cache;
+	Prefetcher *prefetcher;
+	int *index;	// original index of each position, columns are cached by it
+	mutable int first_moved;	// positions before it have not been swapped
+	mutable int next_buffer;
+	Qfloat *buffer[2];
 	double *QD;
+
+	void compute_column(int i, Qfloat *data, int len) const
+	{
+		for(int j=0;j<len;j++)
+			data[j] = (Qfloat)(this->*kernel_function)(i,j);
+	}
 };
 
 class SVR_Q: public Kernel
@@ -1373,7 +3637,7 @@ public:
 	:Kernel(prob.l, prob.x, param)
 	{
 		l = prob.l;
-		cache = new Cache(l,(size_t)(param.cache_size*(1<<20)));
+		cache = new Cache(l,cache_bytes(param,2*(size_t)l),param.cache_type,placement_of(param));
 		QD = new double[2*l];
 		sign = new schar[2*l];
 		index = new int[2*l];
@@ -1389,6 +3653,7 @@ public:
 		buffer[0] = new Qfloat[2*l];
 		buffer[1] = new Qfloat[2*l];
 		next_buffer = 0;
+		prefetcher = param.prefetch_threads > 0 ? new Prefetcher(this,param.prefetch_threads,l) : NULL;
 	}
 
 	void swap_index(int i, int j) const
@@ -1398,17 +3663,38 @@ public:
 		swap(QD[i],QD[j]);
 	}
 
+	void prefetch(int i) const
+	{
+		if(prefetcher != NULL && !cache->has_data(index[i],l))
+			prefetcher->request(index[i],l);
+	}
+
+	int prefetch_depth() const
+	{
+		return prefetcher != NULL ? prefetcher->depth() : 0;
+	}
+
 	Qfloat *get_Q(int i, int len) const
 	{
 		Qfloat *data;
-		int j, real_i = index[i];
-		if(cache->get_data(real_i,&data,l) < l)
+		int start, j, real_i = index[i];
+		if((start = cache->get_data(real_i,&data,l)) < l)
 		{
+			if(prefetcher == NULL || !prefetcher->take(real_i,data,start,l))
+			{
+				begin_column(real_i);
+				for(int b=start,e;b<l;b=e)
+				{
+					e = fill_block(b,start,l);
 #ifdef _OPENMP
 #pragma omp parallel for private(j) schedule(guided)
 #endif
-			for(j=0;j<l;j++)
-				data[j] = (Qfloat)(this->*kernel_function)(real_i,j);
+					for(j=b;j<e;j++)
+						data[j] = (Qfloat)(this->*column_function)(real_i,j);
+				}
+				end_column(real_i);
+			}
+			cache->store(real_i,data,start,l);
 		}
 
 		// reorder and copy
@@ -1427,6 +3713,7 @@ public:
 
 	~SVR_Q()
 	{
+		delete prefetcher;
 		delete cache;
 		delete[] sign;
 		delete[] index;
@@ -1437,56 +3724,553 @@ public:
 private:
 	int l;
 	Cache *cache;
+	Prefetcher *prefetcher;
 	schar *sign;
 	int *index;
 	mutable int next_buffer;
 	Qfloat *buffer[2];
 	double *QD;
+
+	void compute_column(int i, Qfloat *data, int len) const
+	{
+		for(int j=0;j<len;j++)
+			data[j] = (Qfloat)(this->*kernel_function)(i,j);
+	}
 };
 
 //
-// construct and solve various formulations
+// Kernel rows shared by the k*(k-1)/2 one-vs-one sub-problems
 //
-static void solve_c_svc(
-	const svm_problem *prob, const svm_parameter* param,
-	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn)
+// x is the class-grouped training data. A row K(a,.) is cached in one
+// segment per class, so K(a,b) is computed once however many pairs use it.
+// Rows are keyed by the fixed index a and never swapped; SVC_Pair_Q
+// applies the shrinking permutation and the signs on the fly.
+//
+class Shared_Kernel: public Kernel
 {
-    qInfo() << "Solving using solve_c_svc." << Qt::endl;
-	int l = prob->l;
-	double *minus_ones = new double[l];
-	schar *y = new schar[l];
-
-	int i;
+public:
+	Shared_Kernel(int l, svm_node * const * x, const svm_parameter& param,
+		      int nr_class, const int *start_, const int *count_)
+	:Kernel(l, x, param), nr_class(nr_class)
+	{
+		clone(start,start_,nr_class);
+		clone(count,count_,nr_class);
+		// a sub-problem has at most l variables
+		cache = new Cache(l*nr_class,cache_bytes(param,l),param.cache_type,placement_of(param));
+		QD = new double[l];
+		for(int i=0;i<l;i++)
+			QD[i] = (this->*kernel_function)(i,i);
+		int max_count = 0;
+		for(int c=0;c<nr_class;c++)
+			max_count = max(max_count,count[c]);
+		prefetcher = param.prefetch_threads > 0 ? new Prefetcher(this,param.prefetch_threads,max_count) : NULL;
+	}
 
-	for(i=0;i<l;i++)
+	// K(a,b) for b = start[c],...,start[c]+count[c]-1
+	const Qfloat *get_segment(int a, int c) const
 	{
-		alpha[i] = 0;
-		minus_ones[i] = -1;
-		if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
+		Qfloat *data;
+		int first, j, len = count[c], s = start[c];
+		if((first = cache->get_data(a*nr_class+c,&data,len)) < len)
+		{
+			if(prefetcher == NULL || !prefetcher->take(a*nr_class+c,data,first,len))
+			{
+				begin_column(a);
+				for(int b=first,e;b<len;b=e)
+				{
+					e = fill_block(s+b,s+first,s+len)-s;
+#ifdef _OPENMP
+#pragma omp parallel for private(j) schedule(guided)
+#endif
+					for(j=b;j<e;j++)
+						data[j] = (Qfloat)(this->*column_function)(a,s+j);
+				}
+				end_column(a);
+			}
+			cache->store(a*nr_class+c,data,first,len);
+		}
+		return data;
 	}
 
-	Solver s;
+	// hint that segment c of row a will likely be asked for soon
+	void prefetch_segment(int a, int c) const
+	{
+		if(prefetcher != NULL && !cache->has_data(a*nr_class+c,count[c]))
+			prefetcher->request(a*nr_class+c,count[c]);
+	}
 
-	s.Solve(l, SVC_Q(*prob,*param,y), minus_ones, y,
-		alpha, Cp, Cn, param->eps, si, param->shrinking);
+	int prefetch_depth() const
+	{
+		return prefetcher != NULL ? prefetcher->depth() : 0;
+	}
 
-	double sum_alpha=0;
-	for(i=0;i<l;i++)
-		sum_alpha += alpha[i];
+	int get_start(int c) const { return start[c]; }
+	int get_count(int c) const { return count[c]; }
 
-	if (Cp==Cn)
-		info("nu = %f\n", sum_alpha/(Cp*prob->l));
+	// rows are read by segment only
+	Qfloat *get_Q(int column, int len) const { return NULL; }
 
-	for(i=0;i<l;i++)
-		alpha[i] *= y[i];
+	double *get_QD() const
+	{
+		return QD;
+	}
 
-	delete[] minus_ones;
-	delete[] y;
-}
+	void swap_index(int i, int j) const {}	// indices are fixed
+
+	~Shared_Kernel()
+	{
+		delete prefetcher;
+		delete cache;
+		delete[] start;
+		delete[] count;
+		delete[] QD;
+	}
+private:
+	const int nr_class;
+	int *start;
+	int *count;
+	Cache *cache;
+	Prefetcher *prefetcher;
+	double *QD;
+
+	void compute_column(int key, Qfloat *data, int len) const
+	{
+		int a = key/nr_class, s = start[key%nr_class];
+		for(int j=0;j<len;j++)
+			data[j] = (Qfloat)(this->*kernel_function)(a,s+j);
+	}
+};
+
+class SVC_Pair_Q: public QMatrix
+{
+public:
+	SVC_Pair_Q(const Shared_Kernel& rows, int class_i, int class_j, const schar *y_)
+	:rows(rows), class_i(class_i), class_j(class_j)
+	{
+		ci = rows.get_count(class_i);
+		l = ci + rows.get_count(class_j);
+		clone(y,y_,l);
+		QD = new double[l];
+		index = new int[l];
+		const double *row_QD = rows.get_QD();
+		for(int k=0;k<l;k++)
+		{
+			index[k] = k;
+			QD[k] = row_QD[real_index(k)];
+		}
+		buffer[0] = new Qfloat[l];
+		buffer[1] = new Qfloat[l];
+		next_buffer = 0;
+	}
+
+	void swap_index(int i, int j) const
+	{
+		swap(y[i],y[j]);
+		swap(index[i],index[j]);
+		swap(QD[i],QD[j]);
+	}
+
+	void prefetch(int i) const
+	{
+		int real_i = real_index(index[i]);
+		rows.prefetch_segment(real_i,class_i);
+		rows.prefetch_segment(real_i,class_j);
+	}
+
+	// a column is two segments
+	int prefetch_depth() const
+	{
+		return rows.prefetch_depth()/2;
+	}
+
+	Qfloat *get_Q(int i, int len) const
+	{
+		int j, real_i = real_index(index[i]);
+
+		// gather from both class segments and apply signs
+		Qfloat *buf = buffer[next_buffer];
+		next_buffer = 1 - next_buffer;
+		schar yi = y[i];
+		const Qfloat *seg = rows.get_segment(real_i,class_i);
+		for(j=0;j<len;j++)
+			if(index[j] < ci)
+				buf[j] = (Qfloat) yi * (Qfloat) y[j] * seg[index[j]];
+		seg = rows.get_segment(real_i,class_j);
+		for(j=0;j<len;j++)
+			if(index[j] >= ci)
+				buf[j] = (Qfloat) yi * (Qfloat) y[j] * seg[index[j]-ci];
+		return buf;
+	}
+
+	double *get_QD() const
+	{
+		return QD;
+	}
+
+	~SVC_Pair_Q()
+	{
+		delete[] y;
+		delete[] index;
+		delete[] buffer[0];
+		delete[] buffer[1];
+		delete[] QD;
+	}
+private:
+	const Shared_Kernel& rows;
+	const int class_i, class_j;
+	int ci;		// the first ci variables are class_i, the rest class_j
+	int l;
+	schar *y;
+	int *index;
+	mutable int next_buffer;
+	Qfloat *buffer[2];
+	double *QD;
+
+	// sub-problem index to index in the class-grouped data
+	int real_index(int k) const
+	{
+		return k < ci ? rows.get_start(class_i)+k : rows.get_start(class_j)+k-ci;
+	}
+};
+
+//
+// construct and solve various formulations
+//
+// with instance weights W, the bounds of alpha_i are multiplied by W_i
+// and nu counts weight instead of instances
+//
+static double sum_weights(const svm_problem *prob)
+{
+	if(prob->W == NULL)
+		return prob->l;
+	double sum = 0;
+	for(int i=0;i<prob->l;i++)
+		sum += prob->W[i];
+	return sum;
+}
+
+static void solve_c_svc(
+	const svm_problem *prob, const svm_parameter* param,
+	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn,
+	train_context *ctx)
+{
+    qInfo() << "Solving using solve_c_svc." << Qt::endl;
+	int l = prob->l;
+	double *minus_ones = new double[l];
+	schar *y = new schar[l];
+
+	int i;
+
+	for(i=0;i<l;i++)
+	{
+		alpha[i] = 0;
+		minus_ones[i] = -1;
+		if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
+	}
+
+	Solver s;
+
+	if(ctx->rows != NULL)
+		s.Solve(l, SVC_Pair_Q(*ctx->rows,ctx->class_i,ctx->class_j,y), minus_ones, y,
+			alpha, Cp, Cn, prob->W, param->eps, si, param->shrinking, ctx);
+	else
+		s.Solve(l, SVC_Q(*prob,*param,y), minus_ones, y,
+			alpha, Cp, Cn, prob->W, param->eps, si, param->shrinking, ctx);
+
+	double sum_alpha=0;
+	for(i=0;i<l;i++)
+		sum_alpha += alpha[i];
+
+	if (Cp==Cn)
+		info("nu = %f\n", sum_alpha/(Cp*prob->l));
+
+	for(i=0;i<l;i++)
+		alpha[i] *= y[i];
+
+	delete[] minus_ones;
+	delete[] y;
+}
+
+//
+// Cascade SVM, Graf et al., NIPS 2005
+//
+// The data is split into cascade_parts random parts, solved in parallel.
+// The SVs of two sets are merged and solved again, layer by layer, down
+// to one set. As feedback, points outside that set that violate the
+// optimality conditions are added to its SVs and the set is solved again,
+// until there are none left and so the SV set no longer changes. Only
+// solves over the final set report progress; none writes checkpoints.
+//
+// Merged SVs and added points keep y^T alpha = 0, so every solve starts
+// from the alphas found so far.
+//
+struct cascade_set
+{
+	int l;
+	int *index;	// into the problem
+	double *alpha;	// signed, start values on input, NULL for zeros
+	Solver::SolutionInfo si;
+	bool stopped;
+};
+
+static void solve_cascade_set(
+	const svm_problem *prob, const svm_parameter *param, cascade_set *set,
+	double Cp, double Cn, const train_context *ctx)
+{
+	int l = set->l;
+	svm_problem sub;
+	sub.l = l;
+	sub.x = Malloc(svm_node *,l);
+	sub.y = Malloc(double,l);
+	sub.W = NULL;	// passed to Solve directly
+	double *minus_ones = new double[l];
+	schar *y = new schar[l];
+	double *alpha = Malloc(double,l);
+	double *W = prob->W? new double[l] : NULL;
+	int i;
+
+	for(i=0;i<l;i++)
+	{
+		sub.x[i] = prob->x[set->index[i]];
+		sub.y[i] = prob->y[set->index[i]];
+		if(W) W[i] = prob->W[set->index[i]];
+		minus_ones[i] = -1;
+		if(sub.y[i] > 0) y[i] = +1; else y[i] = -1;
+		alpha[i] = (set->alpha != NULL)? set->alpha[i]*y[i] : 0;
+	}
+
+	train_context sub_ctx = *ctx;
+	sub_ctx.param = param;
+	sub_ctx.stopped = false;
+	sub_ctx.resume = NULL;
+	sub_ctx.rows = NULL;
+
+	Solver s;
+	s.Solve(l, SVC_Q(sub,*param,y), minus_ones, y,
+		alpha, Cp, Cn, W, param->eps, &set->si, param->shrinking, &sub_ctx);
+	set->stopped = sub_ctx.stopped;
+
+	for(i=0;i<l;i++)
+		alpha[i] *= y[i];
+	free(set->alpha);
+	set->alpha = alpha;
+
+	delete[] minus_ones;
+	delete[] y;
+	delete[] W;
+	free(sub.x);
+	free(sub.y);
+}
+
+// the SVs of a and b with their alphas as a new set; a and b are freed
+static cascade_set merge_cascade_sets(cascade_set *a, cascade_set *b)
+{
+	cascade_set m;
+	m.l = 0;
+	m.index = Malloc(int,a->l+(b?b->l:0));
+	m.alpha = Malloc(double,a->l+(b?b->l:0));
+	for(int k=0;k<2;k++)
+	{
+		cascade_set *s = (k == 0)? a : b;
+		if(s == NULL)
+			continue;
+		for(int i=0;i<s->l;i++)
+			if(s->alpha[i] != 0)
+			{
+				m.index[m.l] = s->index[i];
+				m.alpha[m.l++] = s->alpha[i];
+			}
+		free(s->index);
+		free(s->alpha);
+	}
+	return m;
+}
+
+static void solve_cascade_c_svc(
+	const svm_problem *prob, const svm_parameter* param,
+	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn,
+	train_context *ctx)
+{
+	int l = prob->l;
+	int nr_part = min(param->cascade_parts,l);
+	int max_pass = 10;
+	int nr_thread = 1;
+#ifdef _OPENMP
+	nr_thread = omp_get_max_threads();
+#endif
+	int i, k;
+
+	// parts run concurrently: split the cache, keep callbacks to this thread
+	svm_parameter part_param = *param;
+	part_param.cache_size = max(param->cache_size/min(nr_thread,nr_part),1.0);
+	part_param.progress_func = NULL;
+	part_param.checkpoint_file = NULL;
+	svm_parameter final_param = *param;
+	final_param.checkpoint_file = NULL;
+
+	rng_state rng = {param->seed};
+	int *perm = Malloc(int,l);
+	sample_indices(l,l,&rng,perm);
+
+	cascade_set *sets = Malloc(cascade_set,nr_part);
+	for(k=0;k<nr_part;k++)
+	{
+		int begin = (int)((long long)k*l/nr_part);
+		int end = (int)((long long)(k+1)*l/nr_part);
+		sets[k].l = end-begin;
+		sets[k].index = Malloc(int,end-begin);
+		sets[k].alpha = NULL;
+		memcpy(sets[k].index,&perm[begin],sizeof(int)*(end-begin));
+	}
+
+	int nr_set = nr_part;
+	int layer = 0;
+	while(nr_set > 1 && !ctx->stopped)
+	{
+		bool stopped = false;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1) reduction(||:stopped)
+#endif
+		for(k=0;k<nr_set;k++)
+		{
+			solve_cascade_set(prob,&part_param,&sets[k],Cp,Cn,ctx);
+			stopped = stopped || sets[k].stopped;
+		}
+		if(stopped)
+			ctx->stopped = true;
+
+		int total = 0;
+		for(k=0;k<nr_set;k++)
+			total += sets[k].l;
+		for(k=0;k<nr_set;k+=2)
+			sets[k/2] = merge_cascade_sets(&sets[k],(k+1 < nr_set)? &sets[k+1] : NULL);
+		nr_set = (nr_set+1)/2;
+		int merged = 0;
+		for(k=0;k<nr_set;k++)
+			merged += sets[k].l;
+		info("cascade layer %d: %d -> %d points\n",layer++,total,merged);
+	}
+	for(k=1;k<nr_set;k++)
+	{
+		// only if stopped
+		free(sets[k].index);
+		free(sets[k].alpha);
+	}
+
+	cascade_set final_set = sets[0];
+	double *old_alpha = Malloc(double,final_set.l);	// at the last check
+	int *changed = Malloc(int,final_set.l);
+	char *in_set = Malloc(char,l);
+	double *dec = Malloc(double,l);		// sum_j alpha_j K(x_i,x_j)
+	for(i=0;i<final_set.l;i++)
+		old_alpha[i] = 0;
+	for(i=0;i<l;i++)
+	{
+		in_set[i] = 0;
+		dec[i] = 0;
+	}
+	// rows of a kernel_file problem are serial numbers, held mapped by svm_train
+	mapped_kernel_matrix *kmat = NULL;
+	if(param->kernel_type == PRECOMPUTED && param->kernel_file != NULL)
+		kmat = acquire_kernel_matrix(param->kernel_file);
+	bool stable = false;
+	for(int pass=0;pass<max_pass;pass++)
+	{
+		// also run when stopped, for rho; Solver returns at its first check
+		solve_cascade_set(prob,&final_param,&final_set,Cp,Cn,ctx);
+		if(final_set.stopped)
+			ctx->stopped = true;
+		if(ctx->stopped)
+			break;
+
+		// y_i f(x_i) - 1 is the gradient at alpha_i = 0, as in Solver.
+		// sum_j alpha_j K(x_i,x_j) is updated with the alphas that changed.
+		int nr_sv = 0;
+		int nr_changed = 0;
+		for(i=0;i<final_set.l;i++)
+		{
+			in_set[final_set.index[i]] = 1;
+			if(final_set.alpha[i] != 0)
+				++nr_sv;
+			if(final_set.alpha[i] != old_alpha[i])
+				changed[nr_changed++] = i;
+		}
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(guided)
+#endif
+		for(i=0;i<l;i++)
+			if(!in_set[i])
+			{
+				double sum = 0;
+				for(int j=0;j<nr_changed;j++)
+				{
+					int c = changed[j];
+					const svm_node *xc = prob->x[final_set.index[c]];
+					double k = kmat? kernel_matrix_value(kmat,prob->x[i],xc) : Kernel::k_function(prob->x[i],xc,*param);
+					sum += (final_set.alpha[c]-old_alpha[c])*k;
+				}
+				dec[i] += sum;
+			}
+
+		int nr_violator = 0;
+		for(i=0;i<l;i++)
+			if(!in_set[i])
+			{
+				double yf = (prob->y[i] > 0)? dec[i]-final_set.si.rho : final_set.si.rho-dec[i];
+				if(yf - 1 < -param->eps)
+				{
+					in_set[i] = 2;
+					++nr_violator;
+				}
+			}
+		info("cascade feedback %d: %d SVs, %d changed, %d violators\n",pass,nr_sv,nr_changed,nr_violator);
+		if(nr_violator == 0)
+		{
+			// the solution over the final set is optimal for all data
+			stable = true;
+			break;
+		}
+
+		// the set grows, so points dropped as non-SVs do not come back as violators
+		int n = final_set.l + nr_violator;
+		final_set.index = (int *)realloc(final_set.index,n*sizeof(int));
+		final_set.alpha = (double *)realloc(final_set.alpha,n*sizeof(double));
+		old_alpha = (double *)realloc(old_alpha,n*sizeof(double));
+		changed = (int *)realloc(changed,n*sizeof(int));
+		memcpy(old_alpha,final_set.alpha,final_set.l*sizeof(double));
+		for(i=0;i<l;i++)
+			if(in_set[i] == 2)
+			{
+				old_alpha[final_set.l] = 0;
+				final_set.index[final_set.l] = i;
+				final_set.alpha[final_set.l++] = 0;
+			}
+	}
+	release_kernel_matrix(kmat);
+	if(!stable && !ctx->stopped)
+		info("WARNING: cascade SV set did not stabilize in %d passes\n",max_pass);
+
+	for(i=0;i<l;i++)
+		alpha[i] = 0;
+	if(final_set.alpha != NULL)
+		for(i=0;i<final_set.l;i++)
+			alpha[final_set.index[i]] = final_set.alpha[i];
+	*si = final_set.si;
+	si->converged = si->converged && stable;
+
+	free(final_set.index);
+	free(final_set.alpha);
+	free(old_alpha);
+	free(changed);
+	free(sets);
+	free(in_set);
+	free(dec);
+	free(perm);
+}
 
 static void solve_nu_svc(
 	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int i;
 	int l = prob->l;
@@ -1500,18 +4284,18 @@ static void solve_nu_svc(
 		else
 			y[i] = -1;
 
-	double sum_pos = nu*l/2;
-	double sum_neg = nu*l/2;
+	double sum_pos = nu*sum_weights(prob)/2;
+	double sum_neg = sum_pos;
 
 	for(i=0;i<l;i++)
 		if(y[i] == +1)
 		{
-			alpha[i] = min(1.0,sum_pos);
+			alpha[i] = min(prob->W? prob->W[i] : 1.0,sum_pos);
 			sum_pos -= alpha[i];
 		}
 		else
 		{
-			alpha[i] = min(1.0,sum_neg);
+			alpha[i] = min(prob->W? prob->W[i] : 1.0,sum_neg);
 			sum_neg -= alpha[i];
 		}
 
@@ -1521,8 +4305,12 @@ static void solve_nu_svc(
 		zeros[i] = 0;
 
 	Solver_NU s;
-	s.Solve(l, SVC_Q(*prob,*param,y), zeros, y,
-		alpha, 1.0, 1.0, param->eps, si,  param->shrinking);
+	if(ctx->rows != NULL)
+		s.Solve(l, SVC_Pair_Q(*ctx->rows,ctx->class_i,ctx->class_j,y), zeros, y,
+			alpha, 1.0, 1.0, prob->W, param->eps, si,  param->shrinking, ctx);
+	else
+		s.Solve(l, SVC_Q(*prob,*param,y), zeros, y,
+			alpha, 1.0, 1.0, prob->W, param->eps, si,  param->shrinking, ctx);
 	double r = si->r;
 
 	info("C = %f\n",1/r);
@@ -1541,21 +4329,20 @@ static void solve_nu_svc(
 
 static void solve_one_class(
 	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int l = prob->l;
 	double *zeros = new double[l];
 	schar *ones = new schar[l];
 	int i;
 
-	int n = (int)(param->nu*prob->l);	// # of alpha's at upper bound
-
-	for(i=0;i<n;i++)
-		alpha[i] = 1;
-	if(n<prob->l)
-		alpha[n] = param->nu * prob->l - n;
-	for(i=n+1;i<l;i++)
-		alpha[i] = 0;
+	// the first alpha's at upper bound, summing to nu times the total weight
+	double nu_l = param->nu*sum_weights(prob);
+	for(i=0;i<l;i++)
+	{
+		alpha[i] = min(prob->W? prob->W[i] : 1.0,nu_l);
+		nu_l -= alpha[i];
+	}
 
 	for(i=0;i<l;i++)
 	{
@@ -1565,7 +4352,7 @@ static void solve_one_class(
 
 	Solver s;
 	s.Solve(l, ONE_CLASS_Q(*prob,*param), zeros, ones,
-		alpha, 1.0, 1.0, param->eps, si, param->shrinking);
+		alpha, 1.0, 1.0, prob->W, param->eps, si, param->shrinking, ctx);
 
 	delete[] zeros;
 	delete[] ones;
@@ -1573,12 +4360,13 @@ static void solve_one_class(
 
 static void solve_epsilon_svr(
 	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int l = prob->l;
 	double *alpha2 = new double[2*l];
 	double *linear_term = new double[2*l];
 	schar *y = new schar[2*l];
+	double *W2 = prob->W? new double[2*l] : NULL;
 	int i;
 
 	for(i=0;i<l;i++)
@@ -1590,11 +4378,14 @@ static void solve_epsilon_svr(
 		alpha2[i+l] = 0;
 		linear_term[i+l] = param->p + prob->y[i];
 		y[i+l] = -1;
+
+		if(W2)
+			W2[i] = W2[i+l] = prob->W[i];
 	}
 
 	Solver s;
 	s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
-		alpha2, param->C, param->C, param->eps, si, param->shrinking);
+		alpha2, param->C, param->C, W2, param->eps, si, param->shrinking, ctx);
 
 	double sum_alpha = 0;
 	for(i=0;i<l;i++)
@@ -1607,58 +4398,136 @@ static void solve_epsilon_svr(
 	delete[] alpha2;
 	delete[] linear_term;
 	delete[] y;
+	delete[] W2;
 }
 
-static void solve_nu_svr(
-	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+// LINEAR kernel: the dual coordinate descent solvers keep w explicitly and
+// never form kernel columns. The bias is the weight of a constant feature
+// and so regularized, unlike in Solver.
+static int linear_dim(const svm_problem *prob)
+{
+	int dim = 0;
+	for(int i=0;i<prob->l;i++)
+		for(const svm_node *p=prob->x[i];p->index!=-1;p++)
+			dim = max(dim,p->index+1);
+	return dim;
+}
+
+static void solve_linear_c_svc(
+	const svm_problem *prob, const svm_parameter* param,
+	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn,
+	train_context *ctx)
 {
 	int l = prob->l;
-	double C = param->C;
-	double *alpha2 = new double[2*l];
-	double *linear_term = new double[2*l];
-	schar *y = new schar[2*l];
+	schar *y = new schar[l];
+	sparse_rows rows = {prob->x,linear_dim(prob)};
+	double *w = new double[rows.dim+1];
 	int i;
 
-	double sum = C * param->nu * l / 2;
 	for(i=0;i<l;i++)
-	{
-		alpha2[i] = alpha2[i+l] = min(sum,C);
-		sum -= alpha2[i];
-
-		linear_term[i] = - prob->y[i];
-		y[i] = 1;
+		if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
 
-		linear_term[i+l] = prob->y[i];
-		y[i+l] = -1;
-	}
+	si->converged = solve_linear_svc(rows,l,y,Cp,Cn,prob->W,param->eps,param->shrinking,param->seed,ctx,alpha,w);
+	si->iter = 0;
+	si->rho = -w[rows.dim];
+	si->upper_bound_p = Cp;
+	si->upper_bound_n = Cn;
 
-	Solver_NU s;
-	s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
-		alpha2, C, C, param->eps, si, param->shrinking);
+	double v = 0;
+	for(i=0;i<=rows.dim;i++)
+		v += w[i]*w[i];
+	v /= 2;
+	double sum_alpha = 0;
+	for(i=0;i<l;i++)
+		sum_alpha += alpha[i];
+	si->obj = v - sum_alpha;
 
-	info("epsilon = %f\n",-si->r);
+	if (Cp==Cn)
+		info("nu = %f\n", sum_alpha/(Cp*prob->l));
 
 	for(i=0;i<l;i++)
-		alpha[i] = alpha2[i] - alpha2[i+l];
+		alpha[i] *= y[i];
 
-	delete[] alpha2;
-	delete[] linear_term;
+	delete[] w;
 	delete[] y;
 }
 
-//
-// decision_function
-//
-struct decision_function
+static void solve_linear_epsilon_svr(
+	const svm_problem *prob, const svm_parameter *param,
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
-	double *alpha;
-	double rho;
-};
+	int l = prob->l;
+	sparse_rows rows = {prob->x,linear_dim(prob)};
+	double *w = new double[rows.dim+1];
+	int i;
+
+	si->converged = solve_linear_svr(rows,l,prob->y,param->C,prob->W,param->p,param->eps,param->shrinking,param->seed,ctx,alpha,w);
+	si->iter = 0;
+	si->rho = -w[rows.dim];
+	si->upper_bound_p = param->C;
+	si->upper_bound_n = param->C;
+
+	double v = 0;
+	for(i=0;i<=rows.dim;i++)
+		v += w[i]*w[i];
+	v /= 2;
+	double sum_alpha = 0;
+	for(i=0;i<l;i++)
+	{
+		v += param->p*fabs(alpha[i]) - prob->y[i]*alpha[i];
+		sum_alpha += fabs(alpha[i]);
+	}
+	si->obj = v;
+	info("nu = %f\n",sum_alpha/(param->C*l));
+
+	delete[] w;
+}
+
+static void solve_nu_svr(
+	const svm_problem *prob, const svm_parameter *param,
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
+{
+	int l = prob->l;
+	double C = param->C;
+	double *alpha2 = new double[2*l];
+	double *linear_term = new double[2*l];
+	schar *y = new schar[2*l];
+	int i;
+
+	double *W2 = prob->W? new double[2*l] : NULL;
+	double sum = C * param->nu * sum_weights(prob) / 2;
+	for(i=0;i<l;i++)
+	{
+		alpha2[i] = alpha2[i+l] = min(sum,C*(prob->W? prob->W[i] : 1));
+		sum -= alpha2[i];
+		if(W2)
+			W2[i] = W2[i+l] = prob->W[i];
+
+		linear_term[i] = - prob->y[i];
+		y[i] = 1;
+
+		linear_term[i+l] = prob->y[i];
+		y[i+l] = -1;
+	}
+
+	Solver_NU s;
+	s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
+		alpha2, C, C, W2, param->eps, si, param->shrinking, ctx);
+
+	info("epsilon = %f\n",-si->r);
+
+	for(i=0;i<l;i++)
+		alpha[i] = alpha2[i] - alpha2[i+l];
+
+	delete[] alpha2;
+	delete[] linear_term;
+	delete[] y;
+	delete[] W2;
+}
 
 static decision_function svm_train_one(
 	const svm_problem *prob, const svm_parameter *param,
-	double Cp, double Cn)
+	double Cp, double Cn, train_context *ctx)
 {
     qInfo() << "Training a single model" << Qt::endl;
 	double *alpha = Malloc(double,prob->l);
@@ -1666,26 +4535,37 @@ static decision_function svm_train_one(
 	switch(param->svm_type)
 	{
 		case C_SVC:
-			solve_c_svc(prob,param,alpha,&si,Cp,Cn);
+			if(param->kernel_type == LINEAR)
+				solve_linear_c_svc(prob,param,alpha,&si,Cp,Cn,ctx);
+			else if(param->cascade_parts > 1)
+				solve_cascade_c_svc(prob,param,alpha,&si,Cp,Cn,ctx);
+			else
+				solve_c_svc(prob,param,alpha,&si,Cp,Cn,ctx);
 			break;
 		case NU_SVC:
-			solve_nu_svc(prob,param,alpha,&si);
+			solve_nu_svc(prob,param,alpha,&si,ctx);
 			break;
 		case ONE_CLASS:
-			solve_one_class(prob,param,alpha,&si);
+			solve_one_class(prob,param,alpha,&si,ctx);
 			break;
 		case EPSILON_SVR:
-			solve_epsilon_svr(prob,param,alpha,&si);
+			if(param->kernel_type == LINEAR)
+				solve_linear_epsilon_svr(prob,param,alpha,&si,ctx);
+			else
+				solve_epsilon_svr(prob,param,alpha,&si,ctx);
 			break;
 		case NU_SVR:
-			solve_nu_svr(prob,param,alpha,&si);
+			solve_nu_svr(prob,param,alpha,&si,ctx);
 			break;
 	}
 
 	info("obj = %f, rho = %f\n",si.obj,si.rho);
+	if(!si.converged)
+		ctx->converged = false;
 
 	// output SVs
 
+	// the bound of alpha_i is scaled by its instance weight
 	int nSV = 0;
 	int nBSV = 0;
 	for(int i=0;i<prob->l;i++)
@@ -1693,14 +4573,15 @@ static decision_function svm_train_one(
 		if(fabs(alpha[i]) > 0)
 		{
 			++nSV;
+			double w = prob->W? prob->W[i] : 1;
 			if(prob->y[i] > 0)
 			{
-				if(fabs(alpha[i]) >= si.upper_bound_p)
+				if(fabs(alpha[i]) >= si.upper_bound_p*w)
 					++nBSV;
 			}
 			else
 			{
-				if(fabs(alpha[i]) >= si.upper_bound_n)
+				if(fabs(alpha[i]) >= si.upper_bound_n*w)
 					++nBSV;
 			}
 		}
@@ -1711,20 +4592,22 @@ static decision_function svm_train_one(
 	decision_function f;
 	f.alpha = alpha;
 	f.rho = si.rho;
+	f.l = prob->l;
 	return f;
 }
 
 // Platt's binary SVM Probablistic Output: an improvement from Lin et al.
 static void sigmoid_train(
-	int l, const double *dec_values, const double *labels,
+	int l, const double *dec_values, const double *labels, const double *W,
 	double& A, double& B)
 {
 	double prior1=0, prior0 = 0;
 	int i;
 
+	// with instance weights, each term of the likelihood counts W[i] times
 	for (i=0;i<l;i++)
-		if (labels[i] > 0) prior1+=1;
-		else prior0+=1;
+		if (labels[i] > 0) prior1+=W?W[i]:1;
+		else prior0+=W?W[i]:1;
 
 	int max_iter=100;	// Maximal number of iterations
 	double min_step=1e-10;	// Minimal step taken in line search
@@ -1747,9 +4630,9 @@ static void sigmoid_train(
 		else t[i]=loTarget;
 		fApB = dec_values[i]*A+B;
 		if (fApB>=0)
-			fval += t[i]*fApB + log(1+exp(-fApB));
+			fval += (W?W[i]:1)*(t[i]*fApB + log(1+exp(-fApB)));
 		else
-			fval += (t[i] - 1)*fApB +log(1+exp(fApB));
+			fval += (W?W[i]:1)*((t[i] - 1)*fApB +log(1+exp(fApB)));
 	}
 	for (iter=0;iter<max_iter;iter++)
 	{
@@ -1770,11 +4653,11 @@ static void sigmoid_train(
 				p=1.0/(1.0+exp(fApB));
 				q=exp(fApB)/(1.0+exp(fApB));
 			}
-			d2=p*q;
+			d2=p*q*(W?W[i]:1);
 			h11+=dec_values[i]*dec_values[i]*d2;
 			h22+=d2;
 			h21+=dec_values[i]*d2;
-			d1=t[i]-p;
+			d1=(t[i]-p)*(W?W[i]:1);
 			g1+=dec_values[i]*d1;
 			g2+=d1;
 		}
@@ -1802,9 +4685,9 @@ static void sigmoid_train(
 			{
 				fApB = dec_values[i]*newA+newB;
 				if (fApB >= 0)
-					newf += t[i]*fApB + log(1+exp(-fApB));
+					newf += (W?W[i]:1)*(t[i]*fApB + log(1+exp(-fApB)));
 				else
-					newf += (t[i] - 1)*fApB +log(1+exp(fApB));
+					newf += (W?W[i]:1)*((t[i] - 1)*fApB +log(1+exp(fApB)));
 			}
 			// Check sufficient decrease
 			if (newf<fval+0.0001*stepsize*gd)
@@ -1929,18 +4812,21 @@ static void svm_binary_svc_probability(
 		subprob.l = prob->l-(end-begin);
 		subprob.x = Malloc(struct svm_node*,subprob.l);
 		subprob.y = Malloc(double,subprob.l);
+		subprob.W = prob->W? Malloc(double,subprob.l) : NULL;
 
 		k=0;
 		for(j=0;j<begin;j++)
 		{
 			subprob.x[k] = prob->x[perm[j]];
 			subprob.y[k] = prob->y[perm[j]];
+			if(subprob.W) subprob.W[k] = prob->W[perm[j]];
 			++k;
 		}
 		for(j=end;j<prob->l;j++)
 		{
 			subprob.x[k] = prob->x[perm[j]];
 			subprob.y[k] = prob->y[perm[j]];
+			if(subprob.W) subprob.W[k] = prob->W[perm[j]];
 			++k;
 		}
 		int p_count=0,n_count=0;
@@ -1963,6 +4849,10 @@ static void svm_binary_svc_probability(
 		{
 			svm_parameter subparam = *param;
 			subparam.probability=0;
+			// internal cross-validation is not reported, budgeted or checkpointed
+			subparam.progress_func=NULL;
+			subparam.max_train_time=0;
+			subparam.checkpoint_file=NULL;
 			subparam.C=1.0;
 			subparam.nr_weight=2;
 			subparam.weight_label = Malloc(int,2);
@@ -1983,8 +4873,9 @@ static void svm_binary_svc_probability(
 		}
 		free(subprob.x);
 		free(subprob.y);
+		free(subprob.W);
 	}
-	sigmoid_train(prob->l,dec_values,prob->y,probA,probB);
+	sigmoid_train(prob->l,dec_values,prob->y,prob->W,probA,probB);
 	free(dec_values);
 	free(perm);
 }
@@ -2077,22 +4968,26 @@ static double svm_svr_probability(
 
 	svm_parameter newparam = *param;
 	newparam.probability = 0;
+	// internal cross-validation is not reported, budgeted or checkpointed
+	newparam.progress_func = NULL;
+	newparam.max_train_time = 0;
+	newparam.checkpoint_file = NULL;
 	svm_cross_validation(prob,&newparam,nr_fold,ymv);
 	for(i=0;i<prob->l;i++)
 	{
 		ymv[i]=prob->y[i]-ymv[i];
-		mae += fabs(ymv[i]);
+		mae += (prob->W?prob->W[i]:1)*fabs(ymv[i]);
 	}
-	mae /= prob->l;
+	mae /= sum_weights(prob);
 	double std=sqrt(2*mae*mae);
-	int count=0;
+	double count=0;	// weight of the outliers
 	mae=0;
 	for(i=0;i<prob->l;i++)
 		if (fabs(ymv[i]) > 5*std)
-			count=count+1;
+			count+=prob->W?prob->W[i]:1;
 		else
-			mae+=fabs(ymv[i]);
-	mae /= (prob->l-count);
+			mae+=(prob->W?prob->W[i]:1)*fabs(ymv[i]);
+	mae /= (sum_weights(prob)-count);
 	info("Prob. model for test data: target value = predicted value + z,\nz: Laplace distribution e^(-|z|/sigma)/(2sigma),sigma= %g\n",mae);
 	free(ymv);
 	return mae;
@@ -2163,84 +5058,1935 @@ static void svm_group_classes(const svm_problem *prob, int *nr_class_ret, int **
 			//add the label to the set of unique labels
 			label[nr_class] = this_label;
 
-			//increment the count of the newly observed label
-			count[nr_class] = 1;
+			//increment the count of the newly observed label
+			count[nr_class] = 1;
+
+			//increment the number of classes
+			++nr_class;
+		}
+	}
+
+	//
+	// Labels are ordered by their first occurrence in the training set.
+	// However, for two-class sets with -1/+1 labels and -1 appears first,
+	// we swap labels to ensure that internally the binary SVM has positive data corresponding to the +1 instances.
+	//
+
+	if (nr_class == 2 && label[0] == -1 && label[1] == 1) //handling two-class problems with -1 and 1 labels
+	{
+		swap(label[0],label[1]);
+		swap(count[0],count[1]);
+		for(i=0;i<l;i++)
+		{
+			if(data_label[i] == 0)
+				data_label[i] = 1;
+			else
+				data_label[i] = 0;
+		}
+	}
+
+	//array of ?
+	int *start = Malloc(int,nr_class);
+
+    //class 0 data starts at index 0
+	start[0] = 0;
+
+    //initialize the starting indices for each of the classes
+	for(i=1;i<nr_class;i++)
+		start[i] = start[i-1]+count[i-1];
+
+    //populate perm
+	for(i=0;i<l;i++)
+	{
+		perm[start[data_label[i]]] = i;
+		++start[data_label[i]];
+	}
+
+    //reset the start array
+	start[0] = 0;
+	for(i=1;i<nr_class;i++)
+		start[i] = start[i-1]+count[i-1];
+
+    // set the number of classes
+    *nr_class_ret = nr_class;
+
+	//return the set of unique labels
+	*label_ret = label;
+
+    //set the start array to start
+	*start_ret = start;
+
+	//return the number of observations of each class
+	*count_ret = count;
+
+	//free up the memory
+	free(data_label);
+}
+
+// C of each class, param->C scaled by param->weight
+static double *svm_weighted_C(const svm_parameter *param, int nr_class, const int *label)
+{
+	double *weighted_C = Malloc(double, nr_class);
+	int i;
+	for(i=0;i<nr_class;i++)
+		weighted_C[i] = param->C;
+	for(i=0;i<param->nr_weight;i++)
+	{
+		int j;
+		for(j=0;j<nr_class;j++)
+			if(param->weight_label[i] == label[j])
+				break;
+		if(j == nr_class)
+			fprintf(stderr,"WARNING: class label %d specified in weight is not found\n", param->weight_label[i]);
+		else
+			weighted_C[j] *= param->weight[i];
+	}
+	return weighted_C;
+}
+
+//
+// Low-rank kernel approximations
+//
+// The data is mapped to z(x) in R^D with z(x)^T z(y) ~ K(x,y) and a linear
+// SVM is trained on z by solve_linear_svc. With landmarks u_1..u_m and
+// K(u,u) = L L^T, Nystrom uses z(x) = L^{-1} k(u,x), k(u,x)_j = K(u_j,x).
+// The model keeps the landmarks as SVs and folds L^{-T} into the weights,
+// so prediction is sum_j approx_w_j K(u_j,x) - rho, O(m) kernel evaluations.
+//
+// Random Fourier features (Rahimi and Recht, NIPS 2007) approximate the RBF
+// kernel by z(x)_j = sqrt(2/D) cos(omega_j^T x + b_j), omega_j ~ N(0,2 gamma I),
+// b_j ~ U[0,2 pi). Each row is mapped on its own in O(#nonzeros*D), and the
+// model stores only the seed the frequencies are drawn from and the weights.
+//
+struct approx_map
+{
+	int type;		// APPROX_NYSTROM or APPROX_RFF
+	int dim;		// D
+	const svm_parameter *param;
+
+	// Nystrom
+	svm_node **landmarks;	// landmarks[0] is the start of one block holding all
+	double *chol;		// lower Cholesky factor of K(u,u), dim*dim
+
+	// random Fourier features
+	int n;			// features with index 0..n-1 are used
+	double *omega;		// from rff_frequencies
+};
+
+// omega[k*D+j] is the k-th component of omega_j, followed by b[0..D-1];
+// the same seed, gamma, n and D always give the same frequencies
+static double *rff_frequencies(unsigned int seed, double gamma, int n, int D)
+{
+	rng_state rng = {seed};
+	double *omega = Malloc(double,(size_t)(n+1)*D);
+	double sigma = sqrt(2*gamma);
+	size_t i;
+	for(i=0;i<(size_t)n*D;i++)
+		omega[i] = sigma*rng_normal(&rng);
+	for(i=0;i<(size_t)D;i++)
+		omega[(size_t)n*D+i] = TWO_PI*rng_uniform(&rng);
+	return omega;
+}
+
+// z = z(x) for random Fourier features, features beyond n are ignored
+static void rff_transform(const double *omega, int n, int D, const svm_node *x, double *z)
+{
+	const double *b = &omega[(size_t)n*D];
+	int j;
+	for(j=0;j<D;j++)
+		z[j] = b[j];
+	for(;x->index!=-1;x++)
+		if(x->index >= 0 && x->index < n)
+		{
+			const double *o = &omega[(size_t)x->index*D];
+			double v = x->value;
+			for(j=0;j<D;j++)
+				z[j] += v*o[j];
+		}
+	double scale = sqrt(2.0/D);
+	for(j=0;j<D;j++)
+		z[j] = scale*cos(z[j]);
+}
+
+// copy the given rows into one block, the result's [0] being its start
+static svm_node **copy_rows(const svm_node * const *x, int m)
+{
+	size_t elements = 0;
+	int i;
+	for(i=0;i<m;i++)
+	{
+		const svm_node *p = x[i];
+		while(p->index != -1)
+		{
+			++elements;
+			++p;
+		}
+		++elements;
+	}
+
+	svm_node **landmarks = Malloc(svm_node *,m);
+	svm_node *x_space = Malloc(svm_node,elements);
+	size_t j = 0;
+	for(i=0;i<m;i++)
+	{
+		const svm_node *p = x[i];
+		landmarks[i] = &x_space[j];
+		while(p->index != -1)
+			x_space[j++] = *p++;
+		x_space[j++].index = -1;
+	}
+	return landmarks;
+}
+
+static svm_node **random_landmarks(const svm_problem *prob, int m, rng_state *rng)
+{
+	int *perm = Malloc(int,prob->l);
+	const svm_node **x = Malloc(const svm_node *,m);
+	sample_indices(prob->l,m,rng,perm);
+	for(int i=0;i<m;i++)
+		x[i] = prob->x[perm[i]];
+	svm_node **landmarks = copy_rows(x,m);
+	free(x);
+	free(perm);
+	return landmarks;
+}
+
+// k-means centers of a random sample, Lloyd's algorithm in dense form
+static svm_node **kmeans_landmarks(const svm_problem *prob, int m, rng_state *rng)
+{
+	int l = prob->l;
+	int n = 0;
+	int i, k, c;
+	for(i=0;i<l;i++)
+		for(const svm_node *p=prob->x[i];p->index!=-1;p++)
+			n = max(n,p->index+1);
+	int s = min(l,max(20*m,1000));
+	if((double)(s+2*m)*n > 5e7)
+	{
+		info("WARNING: data too wide for k-means landmarks, sampling them at random\n");
+		return random_landmarks(prob,m,rng);
+	}
+
+	int *perm = Malloc(int,l);
+	sample_indices(l,s,rng,perm);
+
+	double *X = Malloc(double,(size_t)s*n);
+	double *center = Malloc(double,(size_t)m*n);
+	double *sum = Malloc(double,(size_t)m*n);
+	int *count = Malloc(int,m);
+	int *assign = Malloc(int,s);
+	for(i=0;i<s;i++)
+	{
+		double *xi = &X[(size_t)i*n];
+		for(k=0;k<n;k++)
+			xi[k] = 0;
+		for(const svm_node *p=prob->x[perm[i]];p->index!=-1;p++)
+			if(p->index >= 0)
+				xi[p->index] = p->value;
+		assign[i] = -1;
+	}
+	// the sample is random, so its first m points are a random start
+	memcpy(center,X,sizeof(double)*m*n);
+
+	int max_iter = 20;
+	for(int iter=0;iter<max_iter;iter++)
+	{
+		int changed = 0;
+#ifdef _OPENMP
+#pragma omp parallel for private(i,k,c) reduction(+:changed) schedule(guided)
+#endif
+		for(i=0;i<s;i++)
+		{
+			const double *xi = &X[(size_t)i*n];
+			int best = 0;
+			double best_d = INF;
+			for(c=0;c<m;c++)
+			{
+				const double *cc = &center[(size_t)c*n];
+				double d = 0;
+				for(k=0;k<n;k++)
+					d += (xi[k]-cc[k])*(xi[k]-cc[k]);
+				if(d < best_d)
+				{
+					best_d = d;
+					best = c;
+				}
+			}
+			if(assign[i] != best)
+			{
+				assign[i] = best;
+				++changed;
+			}
+		}
+		if(changed == 0)
+			break;
+
+		for(k=0;k<m*n;k++)
+			sum[k] = 0;
+		for(c=0;c<m;c++)
+			count[c] = 0;
+		for(i=0;i<s;i++)
+		{
+			double *sc = &sum[(size_t)assign[i]*n];
+			const double *xi = &X[(size_t)i*n];
+			for(k=0;k<n;k++)
+				sc[k] += xi[k];
+			++count[assign[i]];
+		}
+		// an empty cluster keeps its center
+		for(c=0;c<m;c++)
+			if(count[c] > 0)
+				for(k=0;k<n;k++)
+					center[(size_t)c*n+k] = sum[(size_t)c*n+k]/count[c];
+	}
+
+	// back to sparse form, dropping zeros
+	svm_node **x = Malloc(svm_node *,m);
+	svm_node *x_space = Malloc(svm_node,(size_t)m*(n+1));
+	for(c=0;c<m;c++)
+	{
+		svm_node *p = x[c] = &x_space[(size_t)c*(n+1)];
+		for(k=0;k<n;k++)
+			if(center[(size_t)c*n+k] != 0)
+			{
+				p->index = k;
+				p->value = center[(size_t)c*n+k];
+				++p;
+			}
+		p->index = -1;
+	}
+	svm_node **landmarks = copy_rows(x,m);
+
+	free(x_space);
+	free(x);
+	free(assign);
+	free(count);
+	free(sum);
+	free(center);
+	free(X);
+	free(perm);
+	return landmarks;
+}
+
+// in-place Cholesky factorization A = L L^T of a symmetric n*n matrix,
+// L overwrites the lower triangle; false if A is not positive definite
+static bool cholesky(double *A, int n)
+{
+	for(int j=0;j<n;j++)
+	{
+		double *Aj = &A[(size_t)j*n];
+		double d = Aj[j];
+		for(int k=0;k<j;k++)
+			d -= Aj[k]*Aj[k];
+		if(d <= 0)
+			return false;
+		d = sqrt(d);
+		Aj[j] = d;
+		int i;
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(static) if(n-j > 256)
+#endif
+		for(i=j+1;i<n;i++)
+		{
+			double *Ai = &A[(size_t)i*n];
+			double v = Ai[j];
+			for(int k=0;k<j;k++)
+				v -= Ai[k]*Aj[k];
+			Ai[j] = v/d;
+		}
+	}
+	return true;
+}
+
+static void build_approx_map(const svm_problem *prob, const svm_parameter *param, rng_state *rng, approx_map *map)
+{
+	int i, j;
+
+	map->type = param->approx_type;
+	map->param = param;
+	map->landmarks = NULL;
+	map->chol = NULL;
+	map->n = 0;
+	map->omega = NULL;
+
+	if(map->type == APPROX_RFF)
+	{
+		for(i=0;i<prob->l;i++)
+			for(const svm_node *p=prob->x[i];p->index!=-1;p++)
+				map->n = max(map->n,p->index+1);
+		map->dim = param->approx_dim;
+		map->omega = rff_frequencies(param->seed,param->gamma,map->n,map->dim);
+		return;
+	}
+
+	int m = min(param->approx_dim,prob->l);
+	map->dim = m;
+
+	if(param->landmark_type == LANDMARK_KMEANS)
+		map->landmarks = kmeans_landmarks(prob,m,rng);
+	else
+		map->landmarks = random_landmarks(prob,m,rng);
+
+	double *K = Malloc(double,(size_t)m*m);
+	double *A = Malloc(double,(size_t)m*m);
+	double trace = 0;
+#ifdef _OPENMP
+#pragma omp parallel for private(i,j) schedule(guided)
+#endif
+	for(i=0;i<m;i++)
+		for(j=0;j<=i;j++)
+			K[(size_t)i*m+j] = Kernel::k_function(map->landmarks[i],map->landmarks[j],*param);
+	for(i=0;i<m;i++)
+		trace += K[(size_t)i*m+i];
+
+	// K(u,u) is singular for duplicate or nearly dependent landmarks,
+	// add a growing jitter to its diagonal until it factors
+	double jitter = 0;
+	while(1)
+	{
+		memcpy(A,K,sizeof(double)*m*m);
+		for(i=0;i<m;i++)
+			A[(size_t)i*m+i] += jitter;
+		if(cholesky(A,m))
+			break;
+		jitter = (jitter == 0)? 1e-10*max(trace/m,1.0) : jitter*10;
+	}
+	if(jitter > 0)
+		info("Nystrom: added %g to the diagonal of K(u,u)\n",jitter);
+
+	map->chol = A;
+	free(K);
+}
+
+static void free_approx_map(approx_map *map)
+{
+	if(map->landmarks != NULL)
+	{
+		free(map->landmarks[0]);
+		free(map->landmarks);
+	}
+	free(map->chol);
+	free(map->omega);
+}
+
+// z = z(x), buf has dim entries
+static void approx_transform(const approx_map *map, const svm_node *x, float *z, double *buf)
+{
+	int m = map->dim;
+	if(map->type == APPROX_RFF)
+	{
+		rff_transform(map->omega,map->n,m,x,buf);
+		for(int j=0;j<m;j++)
+			z[j] = (float)buf[j];
+		return;
+	}
+
+	const double *L = map->chol;
+	for(int j=0;j<m;j++)
+	{
+		const double *Lj = &L[(size_t)j*m];
+		double v = Kernel::k_function(x,map->landmarks[j],*map->param);
+		for(int k=0;k<j;k++)
+			v -= Lj[k]*buf[k];
+		buf[j] = v/Lj[j];
+		z[j] = (float)buf[j];
+	}
+}
+
+// z(x) of the rows, for the linear solver: the first nr_cached rows of the
+// problem are mapped once and kept, as many as fit in cache_size, the others
+// are mapped again when used; the last of those is kept, as a step reads
+// its row twice
+struct approx_rows
+{
+	const approx_map *map;
+	const svm_node * const *x;
+	const float *z;		// row-major, dim columns, rows [0,nr_cached) of the problem
+	int nr_cached;
+	int dim;
+	const int *index;	// row i of the sub-problem is row index[i] of the problem
+	mutable int last;	// row of the problem in last_z, -1 for none
+	mutable float *last_z;
+	mutable double *buf;	// for approx_transform
+
+	const float *row(int i) const
+	{
+		int r = index[i];
+		if(r < nr_cached)
+			return &z[(size_t)r*dim];
+		if(r != last)
+		{
+			approx_transform(map,x[r],last_z,buf);
+			last = r;
+		}
+		return last_z;
+	}
+	double dot(int i, const double *w) const
+	{
+		const float *zi = row(i);
+		double sum = 0;
+		for(int k=0;k<dim;k++)
+			sum += zi[k]*w[k];
+		return sum;
+	}
+	void axpy(int i, double a, double *w) const
+	{
+		const float *zi = row(i);
+		for(int k=0;k<dim;k++)
+			w[k] += a*zi[k];
+	}
+	double sqnorm(int i) const
+	{
+		const float *zi = row(i);
+		double sum = 0;
+		for(int k=0;k<dim;k++)
+			sum += (double)zi[k]*zi[k];
+		return sum;
+	}
+};
+
+static svm_model *svm_train_approx(const svm_problem *prob, const svm_parameter *param)
+{
+	int l = prob->l;
+	int i;
+	rng_state rng = {param->seed};
+
+	train_context ctx;
+	ctx.param = param;
+	ctx.start_time = wall_time();
+	ctx.stopped = false;
+	ctx.converged = true;
+	ctx.l = l;
+	ctx.fingerprint = 0;
+	ctx.pair = 0;
+	ctx.nr_pairs = 1;
+	ctx.f = NULL;
+	ctx.probA = NULL;
+	ctx.probB = NULL;
+	ctx.last_checkpoint = ctx.start_time;
+	ctx.resume = NULL;
+	ctx.rows = NULL;
+
+	approx_map map;
+	build_approx_map(prob,param,&rng,&map);
+	int dim = map.dim;
+
+	// mapped rows are kept up to cache_size, O(l*dim) would not fit for large l
+	int nr_cached = (int)min((size_t)l,(size_t)(param->cache_size*(1<<20))/((size_t)dim*sizeof(float)));
+	float *Z = Malloc(float,(size_t)nr_cached*dim);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		double *buf = Malloc(double,dim);
+#ifdef _OPENMP
+#pragma omp for private(i) schedule(guided)
+#endif
+		for(i=0;i<nr_cached;i++)
+			approx_transform(&map,prob->x[i],&Z[(size_t)i*dim],buf);
+		free(buf);
+	}
+	info("kernel approximation: %d features, %d of %d rows kept, %.3g s\n",dim,nr_cached,l,wall_time()-ctx.start_time);
+	float *last_z = Malloc(float,dim);
+	double *buf = Malloc(double,dim);
+
+	int nr_class;
+	int *label = NULL;
+	int *start = NULL;
+	int *count = NULL;
+	int *perm = Malloc(int,l);
+	svm_group_classes(prob,&nr_class,&label,&start,&count,perm);
+	if(nr_class == 1)
+		info("WARNING: training data in only one class. See README for details.\n");
+	double *weighted_C = svm_weighted_C(param,nr_class,label);
+
+	int nr_pairs = nr_class*(nr_class-1)/2;
+	double **w = Malloc(double *,nr_pairs);
+	int *index = Malloc(int,l);
+	schar *y = Malloc(schar,l);
+	double *alpha = Malloc(double,l);
+	double *W = prob->W? Malloc(double,l) : NULL;
+	ctx.nr_pairs = nr_pairs;
+
+	int p = 0;
+	for(i=0;i<nr_class;i++)
+		for(int j=i+1;j<nr_class;j++)
+		{
+			int ci = count[i];
+			int cj = count[j];
+			int k;
+			for(k=0;k<ci;k++)
+			{
+				index[k] = perm[start[i]+k];
+				y[k] = +1;
+			}
+			for(k=0;k<cj;k++)
+			{
+				index[ci+k] = perm[start[j]+k];
+				y[ci+k] = -1;
+			}
+			if(W)
+				for(k=0;k<ci+cj;k++)
+					W[k] = prob->W[index[k]];
+
+			approx_rows rows = {&map,prob->x,Z,nr_cached,dim,index,-1,last_z,buf};
+			w[p] = Malloc(double,dim+1);
+			ctx.pair = p;
+			if(!solve_linear_svc(rows,ci+cj,y,weighted_C[i],weighted_C[j],W,param->eps,
+					     param->shrinking,param->seed+p,&ctx,alpha,w[p]))
+				ctx.converged = false;
+			++p;
+		}
+
+	svm_model *model = Malloc(svm_model,1);
+	model->param = *param;
+	model->nr_class = nr_class;
+	model->label = label;
+	model->probA = NULL;
+	model->probB = NULL;
+	model->prob_density_marks = NULL;
+	model->nSV = NULL;
+	model->sv_indices = NULL;
+	model->approx_type = map.type;
+	model->approx_dim = dim;
+	model->approx_n = map.n;
+	model->approx_seed = param->seed;
+	model->approx_omega = map.omega;
+	map.omega = NULL;
+	model->rho = Malloc(double,nr_pairs);
+	model->approx_w = w;
+	for(p=0;p<nr_pairs;p++)
+	{
+		double *wp = w[p];
+		model->rho[p] = -wp[dim];
+		if(map.type == APPROX_NYSTROM)
+		{
+			// w <- L^{-T} w so the weights apply to k(u,x)
+			const double *L = map.chol;
+			for(int j=dim-1;j>=0;j--)
+			{
+				double v = wp[j];
+				for(int k=j+1;k<dim;k++)
+					v -= L[(size_t)k*dim+j]*wp[k];
+				wp[j] = v/L[(size_t)j*dim+j];
+			}
+		}
+	}
+
+	// Nystrom landmarks become the SVs, owned by the model
+	model->l = (map.type == APPROX_NYSTROM)? dim : 0;
+	model->SV = map.landmarks;
+	model->free_sv = 1;
+	map.landmarks = NULL;
+	model->sv_coef = Malloc(double *,nr_class-1);
+	for(i=0;i<nr_class-1;i++)
+	{
+		model->sv_coef[i] = Malloc(double,model->l);
+		for(int j=0;j<model->l;j++)
+			model->sv_coef[i][j] = 0;
+	}
+
+	model->converged = ctx.converged;
+	if(!ctx.converged)
+		info("WARNING: returning a model that did not converge\n");
+	info("training time %.3g s\n",wall_time()-ctx.start_time);
+
+	free_approx_map(&map);
+	free(Z);
+	free(last_z);
+	free(buf);
+	free(start);
+	free(count);
+	free(perm);
+	free(weighted_C);
+	free(index);
+	free(y);
+	free(alpha);
+	free(W);
+	return model;
+}
+
+// decision values of a model from svm_train_approx
+static double predict_approx_values(const svm_model *model, const svm_node *x, double *dec_values)
+{
+	int nr_class = model->nr_class;
+	int dim = model->approx_dim;
+	int i;
+
+	double *z = Malloc(double,dim);
+	if(model->approx_type == APPROX_RFF)
+		rff_transform(model->approx_omega,model->approx_n,dim,x,z);
+	else
+	{
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(guided)
+#endif
+		for(i=0;i<dim;i++)
+			z[i] = Kernel::k_function(x,model->SV[i],model->param);
+	}
+
+	int *vote = Malloc(int,nr_class);
+	for(i=0;i<nr_class;i++)
+		vote[i] = 0;
+
+	int p = 0;
+	for(i=0;i<nr_class;i++)
+		for(int j=i+1;j<nr_class;j++)
+		{
+			const double *w = model->approx_w[p];
+			double sum = 0;
+			for(int k=0;k<dim;k++)
+				sum += w[k]*z[k];
+			dec_values[p] = sum - model->rho[p];
+			if(dec_values[p] > 0)
+				++vote[i];
+			else
+				++vote[j];
+			p++;
+		}
+
+	int vote_max_idx = 0;
+	for(i=1;i<nr_class;i++)
+		if(vote[i] > vote[vote_max_idx])
+			vote_max_idx = i;
+
+	free(z);
+	free(vote);
+	return model->label[vote_max_idx];
+}
+
+//
+// Incremental update of C_SVC models
+//
+// The SVs of the model and a batch of new rows form a small problem. Each
+// pair is solved starting from the model's alphas, the new rows starting at
+// 0, so a few SMO iterations usually suffice. Rows are grouped by class and
+// coef has the layout of sv_coef: the coefficient of a row of class a in
+// the pair with class b is coef[b<a? b : b-1].
+//
+
+// solve all pairs of a class-grouped problem, coef holds the initial and
+// returns the final coefficients
+static bool update_pairs(const svm_problem *prob, int nr_class, const int *start, const int *count,
+	const double *weighted_C, double **coef, double *rho, train_context *ctx)
+{
+	const svm_parameter *param = ctx->param;
+	bool converged = true;
+	int p = 0;
+	for(int i=0;i<nr_class;i++)
+		for(int j=i+1;j<nr_class;j++)
+		{
+			int si = start[i], ci = count[i];
+			int sj = start[j], cj = count[j];
+			int l = ci+cj, k;
+			svm_problem sub;
+			sub.l = l;
+			sub.x = Malloc(svm_node *,l);
+			sub.y = Malloc(double,l);
+			sub.W = NULL;
+			double *W = new double[l];
+			double *alpha = new double[l];
+			double *minus_ones = new double[l];
+			schar *y = new schar[l];
+			double sum_pos = 0, sum_neg = 0;
+			for(k=0;k<l;k++)
+			{
+				int r = k<ci? si+k : sj+k-ci;
+				sub.x[k] = prob->x[r];
+				y[k] = k<ci? +1 : -1;
+				sub.y[k] = y[k];
+				W[k] = prob->W? prob->W[r] : 1;
+				double C = (k<ci? weighted_C[i] : weighted_C[j])*W[k];
+				alpha[k] = min(max(y[k]*(k<ci? coef[j-1][r] : coef[i][r]),0.0),C);
+				minus_ones[k] = -1;
+				if(k<ci) sum_pos += alpha[k]; else sum_neg += alpha[k];
+			}
+
+			// scale down the larger side so that y^T alpha = 0, which the
+			// model's alphas need not satisfy once SVs are evicted or
+			// weights changed
+			double scale_pos = sum_pos > sum_neg? sum_neg/sum_pos : 1;
+			double scale_neg = sum_neg > sum_pos? sum_pos/sum_neg : 1;
+			for(k=0;k<l;k++)
+				alpha[k] *= k<ci? scale_pos : scale_neg;
+
+			Solver::SolutionInfo si_;
+			ctx->pair = p;
+			Solver s;
+			s.Solve(l, SVC_Q(sub,*param,y), minus_ones, y,
+				alpha, weighted_C[i], weighted_C[j], W, param->eps, &si_, param->shrinking, ctx);
+			converged = converged && si_.converged;
+			rho[p] = si_.rho;
+			for(k=0;k<l;k++)
+			{
+				int r = k<ci? si+k : sj+k-ci;
+				if(k<ci) coef[j-1][r] = alpha[k];
+				else coef[i][r] = -alpha[k];
+			}
+
+			delete[] W;
+			delete[] alpha;
+			delete[] minus_ones;
+			delete[] y;
+			free(sub.x);
+			free(sub.y);
+			++p;
+		}
+	return converged;
+}
+
+// the rows of a class-grouped problem for which keep[r] is set, coef and
+// start/count follow
+static void keep_rows(svm_problem *prob, int nr_class, int *start, int *count,
+	double **coef, const bool *keep)
+{
+	int n = 0;
+	for(int c=0;c<nr_class;c++)
+	{
+		int first = n;
+		for(int r=start[c];r<start[c]+count[c];r++)
+			if(keep[r])
+			{
+				prob->x[n] = prob->x[r];
+				prob->y[n] = prob->y[r];
+				if(prob->W) prob->W[n] = prob->W[r];
+				for(int k=0;k<nr_class-1;k++)
+					coef[k][n] = coef[k][r];
+				n++;
+			}
+		start[c] = first;
+		count[c] = n-first;
+	}
+	prob->l = n;
+}
+
+struct sv_score
+{
+	double useful;
+	int index;
+};
+
+static int compare_sv_score(const void *a, const void *b)
+{
+	double x = ((const sv_score *)a)->useful, y = ((const sv_score *)b)->useful;
+	return x < y ? -1 : x > y;
+}
+
+svm_model *svm_update(const svm_model *model, const svm_problem *batch, const svm_parameter *param)
+{
+	if(model->param.svm_type != C_SVC || param->svm_type != C_SVC || model->approx_type != APPROX_NONE ||
+	   model->param.kernel_type == PRECOMPUTED || model->param.kernel_type != param->kernel_type ||
+	   model->param.degree != param->degree || model->param.gamma != param->gamma ||
+	   model->param.coef0 != param->coef0)
+	{
+		fprintf(stderr,"ERROR: svm_update needs an exact C_SVC model and the parameters it was trained with\n");
+		return NULL;
+	}
+
+	int n_old = model->l;
+	int l = n_old + batch->l;
+	int i, k;
+
+	// the model's SVs followed by the batch
+	svm_problem all;
+	all.l = l;
+	all.x = Malloc(svm_node *,l);
+	all.y = Malloc(double,l);
+	all.W = NULL;
+	for(int c=0,r=0;c<model->nr_class;c++)
+		for(k=0;k<model->nSV[c];k++,r++)
+		{
+			all.x[r] = model->SV[r];
+			all.y[r] = model->label[c];
+		}
+	for(i=0;i<batch->l;i++)
+	{
+		all.x[n_old+i] = batch->x[i];
+		all.y[n_old+i] = batch->y[i];
+	}
+	if(batch->W != NULL)
+	{
+		all.W = Malloc(double,l);
+		for(i=0;i<l;i++)
+			all.W[i] = i<n_old? 1 : batch->W[i-n_old];
+	}
+
+	int nr_class;
+	int *label = NULL;
+	int *start = NULL;
+	int *count = NULL;
+	int *perm = Malloc(int,l);
+	svm_group_classes(&all,&nr_class,&label,&start,&count,perm);
+
+	svm_problem prob;
+	prob.l = l;
+	prob.x = Malloc(svm_node *,l);
+	prob.y = Malloc(double,l);
+	prob.W = all.W? Malloc(double,l) : NULL;
+	for(i=0;i<l;i++)
+	{
+		prob.x[i] = all.x[perm[i]];
+		prob.y[i] = all.y[perm[i]];
+		if(prob.W) prob.W[i] = all.W[perm[i]];
+	}
+
+	// old class of each class, -1 if it is new
+	int *old_class = Malloc(int,nr_class);
+	for(i=0;i<nr_class;i++)
+	{
+		old_class[i] = -1;
+		for(int c=0;c<model->nr_class;c++)
+			if(model->label[c] == label[i])
+				old_class[i] = c;
+	}
+
+	// start from the model's coefficients
+	int nr_pairs = nr_class*(nr_class-1)/2;
+	double **coef = Malloc(double *,max(nr_class-1,1));
+	for(k=0;k<nr_class-1;k++)
+	{
+		coef[k] = Malloc(double,l);
+		for(i=0;i<l;i++)
+			coef[k][i] = 0;
+	}
+	for(int a=0;a<nr_class;a++)
+		for(int r=start[a];r<start[a]+count[a];r++)
+		{
+			int sv = perm[r];
+			if(sv >= n_old)
+				continue;
+			int oa = old_class[a];
+			for(int b=0;b<nr_class;b++)
+			{
+				int ob = old_class[b];
+				if(b != a && ob >= 0)
+					coef[b<a? b : b-1][r] = model->sv_coef[ob<oa? ob : ob-1][sv];
+			}
+		}
+
+	svm_parameter update_param = *param;
+	update_param.probability = 0;
+	update_param.checkpoint_file = NULL;	// the update is short, restart it instead
+
+	train_context ctx;
+	ctx.param = &update_param;
+	ctx.start_time = wall_time();
+	ctx.stopped = false;
+	ctx.converged = true;
+	ctx.l = l;
+	ctx.fingerprint = 0;
+	ctx.pair = 0;
+	ctx.nr_pairs = nr_pairs;
+	ctx.f = NULL;
+	ctx.probA = NULL;
+	ctx.probB = NULL;
+	ctx.last_checkpoint = ctx.start_time;
+	ctx.resume = NULL;
+	ctx.rows = NULL;
+
+	double *weighted_C = svm_weighted_C(param,nr_class,label);
+	double *rho = Malloc(double,max(nr_pairs,1));
+	bool converged = update_pairs(&prob,nr_class,start,count,weighted_C,coef,rho,&ctx);
+
+	// the rows with a nonzero coefficient in any pair are the SVs
+	bool *keep = Malloc(bool,l);
+	double *useful = Malloc(double,l);
+	int nr_sv = 0;
+	for(i=0;i<l;i++)
+	{
+		useful[i] = 0;
+		for(k=0;k<nr_class-1;k++)
+			useful[i] += fabs(coef[k][i]);
+		keep[i] = useful[i] > 0;
+		if(keep[i]) ++nr_sv;
+	}
+
+	// over the budget, drop the SVs of least total |coefficient| and solve
+	// the remaining ones again
+	if(param->sv_budget > 0 && nr_sv > param->sv_budget)
+	{
+		sv_score *order = Malloc(sv_score,nr_sv);
+		int n = 0;
+		for(i=0;i<l;i++)
+			if(keep[i])
+			{
+				order[n].useful = useful[i];
+				order[n].index = i;
+				n++;
+			}
+		qsort(order,n,sizeof(sv_score),compare_sv_score);
+		for(i=0;i<nr_sv-param->sv_budget;i++)
+			keep[order[i].index] = false;
+		free(order);
+		info("svm_update: evicting %d of %d SVs\n",nr_sv-param->sv_budget,nr_sv);
+
+		keep_rows(&prob,nr_class,start,count,coef,keep);
+		converged = update_pairs(&prob,nr_class,start,count,weighted_C,coef,rho,&ctx) && converged;
+		nr_sv = 0;
+		for(i=0;i<prob.l;i++)
+		{
+			keep[i] = false;
+			for(k=0;k<nr_class-1;k++)
+				keep[i] = keep[i] || coef[k][i] != 0;
+			if(keep[i]) ++nr_sv;
+		}
+	}
+
+	svm_model *updated = Malloc(svm_model,1);
+	updated->param = *param;
+	updated->nr_class = nr_class;
+	updated->l = nr_sv;
+	updated->label = label;
+	updated->rho = rho;
+	updated->nSV = Malloc(int,nr_class);
+	updated->sv_coef = Malloc(double *,max(nr_class-1,1));
+	for(k=0;k<nr_class-1;k++)
+		updated->sv_coef[k] = Malloc(double,nr_sv);
+	svm_node **sv = Malloc(svm_node *,nr_sv);
+	int n = 0;
+	for(int c=0;c<nr_class;c++)
+	{
+		updated->nSV[c] = 0;
+		for(int r=start[c];r<start[c]+count[c];r++)
+			if(keep[r])
+			{
+				sv[n] = prob.x[r];
+				for(k=0;k<nr_class-1;k++)
+					updated->sv_coef[k][n] = coef[k][r];
+				++updated->nSV[c];
+				++n;
+			}
+	}
+	// the batch belongs to the caller and the SVs to the old model
+	updated->SV = copy_rows(sv,nr_sv);
+	updated->free_sv = 1;
+	updated->sv_indices = NULL;
+	updated->converged = converged && !ctx.stopped;
+
+	// the sigmoids of the old model are kept if the classes did not change
+	updated->probA = NULL;
+	updated->probB = NULL;
+	updated->prob_density_marks = NULL;
+	if(model->probA != NULL && model->probB != NULL && nr_class == model->nr_class)
+	{
+		bool same = true;
+		for(i=0;i<nr_class;i++)
+			same = same && old_class[i] == i;
+		if(same)
+		{
+			updated->probA = Malloc(double,nr_pairs);
+			updated->probB = Malloc(double,nr_pairs);
+			memcpy(updated->probA,model->probA,sizeof(double)*nr_pairs);
+			memcpy(updated->probB,model->probB,sizeof(double)*nr_pairs);
+		}
+	}
+	updated->param.probability = updated->probA != NULL;
+
+	updated->approx_type = APPROX_NONE;
+	updated->approx_dim = 0;
+	updated->approx_w = NULL;
+	updated->approx_n = 0;
+	updated->approx_seed = 0;
+	updated->approx_omega = NULL;
+
+	info("svm_update: %d SVs and %d new rows -> %d SVs in %.3fs\n",
+	     n_old,batch->l,nr_sv,wall_time()-ctx.start_time);
+
+	free(sv);
+	free(keep);
+	free(useful);
+	free(weighted_C);
+	for(k=0;k<nr_class-1;k++)
+		free(coef[k]);
+	free(coef);
+	free(old_class);
+	free(prob.x);
+	free(prob.y);
+	free(prob.W);
+	free(all.x);
+	free(all.y);
+	free(all.W);
+	free(perm);
+	free(start);
+	free(count);
+	return updated;
+}
+
+//
+// Reduced-set compression
+//
+// Each decision function sum_k a_k K(s_k,x) is approximated with a subset
+// of its SVs by orthogonal matching pursuit: the SV whose kernel column
+// best matches the residual on a set of reference points is added, then
+// all coefficients are refit by least squares. The reference points are
+// up to COMPRESS_REF rows spread over the caller's data, which should not
+// be the SVs alone: a fit on the SVs interpolates them and generalizes
+// poorly.
+//
+#define COMPRESS_REF 2000
+
+// one decision function of a model: the SVs it uses and where their
+// coefficients are kept
+struct compress_function
+{
+	int n;
+	int *sv;	// indices into model->SV
+	double *coef;	// model coefficients, refit ones on return
+	double rho;
+	int n_ref;
+	const svm_node **ref;	// where the decision values are compared
+};
+
+// refit f on at most target of its SVs, or fewer once the largest error on
+// the reference points is at most tolerance; return the number kept, whose
+// coefficients are nonzero
+static int compress_function_omp(const svm_model *model, compress_function *f, int target,
+	double tolerance, bool report, double *rms_ret, double *max_ret)
+{
+	int n = f->n;
+	int m = (int)min((long long)f->n_ref,min((long long)COMPRESS_REF,max(256LL,(1LL<<26)/max(n,1))));
+	int i, c, r;
+
+	// a random sample of f->ref, rows in a fixed order would follow any
+	// pattern of the data; K[c*m+r] = K(sv_c,ref_r)
+	int *perm = Malloc(int,f->n_ref);
+	rng_state rng = {model->param.seed};
+	sample_indices(f->n_ref,m,&rng,perm);
+	float *K = Malloc(float,(size_t)n*m);
+#ifdef _OPENMP
+#pragma omp parallel for private(c) schedule(guided)
+#endif
+	for(c=0;c<n;c++)
+		for(int r=0;r<m;r++)
+			K[(size_t)c*m+r] = (float)Kernel::k_function(model->SV[f->sv[c]],
+				f->ref[perm[r]],model->param);
+	free(perm);
+
+	double *t = Malloc(double,m);	// decision values without rho
+	double *e = Malloc(double,m);	// residual
+	for(r=0;r<m;r++)
+		t[r] = 0;
+	for(c=0;c<n;c++)
+		for(r=0;r<m;r++)
+			t[r] += f->coef[c]*K[(size_t)c*m+r];
+	for(r=0;r<m;r++)
+		e[r] = t[r];
+
+	double *norm2 = Malloc(double,n);
+	double trace = 0;
+	for(c=0;c<n;c++)
+	{
+		double s = 0;
+		for(r=0;r<m;r++)
+			s += (double)K[(size_t)c*m+r]*K[(size_t)c*m+r];
+		norm2[c] = s;
+		trace += s;
+	}
+	double ridge = 1e-10*trace/max(n,1);
+
+	target = min(target,n);
+	int *S = Malloc(int,target);
+	double *L = Malloc(double,(size_t)target*target);	// Cholesky factor of K_S^T K_S + ridge I
+	double *b = Malloc(double,target);		// K_S^T t
+	double *beta = Malloc(double,target);
+	double *tmp = Malloc(double,target);
+	double *score = Malloc(double,n);
+	char *used = Malloc(char,n);
+	for(c=0;c<n;c++)
+		used[c] = 0;
+
+	int k = 0;
+	double rms = 0, emax = 0;
+	for(r=0;r<m;r++)
+	{
+		rms += e[r]*e[r];
+		emax = max(emax,fabs(e[r]));
+	}
+	rms = sqrt(rms/m);
+	int next_report = 1;
+	while(k < target && emax > tolerance)
+	{
+#ifdef _OPENMP
+#pragma omp parallel for private(c) schedule(guided)
+#endif
+		for(c=0;c<n;c++)
+		{
+			double s = 0;
+			if(!used[c] && norm2[c] > 0)
+			{
+				const float *Kc = &K[(size_t)c*m];
+				for(int r=0;r<m;r++)
+					s += Kc[r]*e[r];
+				s = s*s/norm2[c];
+			}
+			score[c] = s;
+		}
+		int best = -1;
+		for(c=0;c<n;c++)
+			if(!used[c] && (best < 0 || score[c] > score[best]))
+				best = c;
+		if(best < 0 || score[best] <= 0)
+			break;
+		used[best] = 1;
+
+		// new row of L from the inner products with the selected columns
+		const float *Kb = &K[(size_t)best*m];
+		for(i=0;i<k;i++)
+		{
+			const float *Ks = &K[(size_t)S[i]*m];
+			double g = 0;
+			for(r=0;r<m;r++)
+				g += (double)Ks[r]*Kb[r];
+			for(int j=0;j<i;j++)
+				g -= L[(size_t)k*target+j]*L[(size_t)i*target+j];
+			L[(size_t)k*target+i] = g/L[(size_t)i*target+i];
+		}
+		double d = norm2[best] + ridge;
+		for(i=0;i<k;i++)
+			d -= L[(size_t)k*target+i]*L[(size_t)k*target+i];
+		if(d <= ridge)
+			continue;	// in the span of the selected ones
+		L[(size_t)k*target+k] = sqrt(d);
+		double bt = 0;
+		for(r=0;r<m;r++)
+			bt += Kb[r]*t[r];
+		b[k] = bt;
+		S[k++] = best;
+
+		// beta = (L L^T)^{-1} b, then the residual
+		for(i=0;i<k;i++)
+		{
+			double s = b[i];
+			for(int j=0;j<i;j++)
+				s -= L[(size_t)i*target+j]*tmp[j];
+			tmp[i] = s/L[(size_t)i*target+i];
+		}
+		for(i=k-1;i>=0;i--)
+		{
+			double s = tmp[i];
+			for(int j=i+1;j<k;j++)
+				s -= L[(size_t)j*target+i]*beta[j];
+			beta[i] = s/L[(size_t)i*target+i];
+		}
+		for(r=0;r<m;r++)
+			e[r] = t[r];
+		for(i=0;i<k;i++)
+		{
+			const float *Ks = &K[(size_t)S[i]*m];
+			for(r=0;r<m;r++)
+				e[r] -= beta[i]*Ks[r];
+		}
+		rms = 0;
+		emax = 0;
+		for(r=0;r<m;r++)
+		{
+			rms += e[r]*e[r];
+			emax = max(emax,fabs(e[r]));
+		}
+		rms = sqrt(rms/m);
+
+		if(report && (k == next_report || k == target))
+		{
+			info("  %d SVs: decision value error rms %g, max %g\n",k,rms,emax);
+			next_report *= 2;
+		}
+	}
+
+	// a constant residual goes into rho
+	double mean = 0;
+	for(r=0;r<m;r++)
+		mean += e[r];
+	mean /= m;
+	f->rho -= mean;
+	rms = 0;
+	emax = 0;
+	for(r=0;r<m;r++)
+	{
+		rms += (e[r]-mean)*(e[r]-mean);
+		emax = max(emax,fabs(e[r]-mean));
+	}
+	*rms_ret = sqrt(rms/m);
+	*max_ret = emax;
+
+	for(c=0;c<n;c++)
+		f->coef[c] = 0;
+	for(i=0;i<k;i++)
+		f->coef[S[i]] = beta[i];
+
+	free(K);
+	free(t);
+	free(e);
+	free(norm2);
+	free(S);
+	free(L);
+	free(b);
+	free(beta);
+	free(tmp);
+	free(score);
+	free(used);
+	return k;
+}
+
+svm_model *svm_compress_model(const svm_model *model, const svm_problem *ref, int target_sv, double tolerance)
+{
+	if(model->approx_type != APPROX_NONE || model->param.kernel_type == PRECOMPUTED ||
+	   model->l == 0 || ref->l == 0)
+	{
+		fprintf(stderr,"ERROR: svm_compress_model needs an exact model with SVs and reference rows\n");
+		return NULL;
+	}
+	if(target_sv <= 0 || target_sv > model->l)
+		target_sv = model->l;
+
+	int l = model->l;
+	int i, k;
+	int svm_type = model->param.svm_type;
+	bool one_function = svm_type == ONE_CLASS || svm_type == EPSILON_SVR || svm_type == NU_SVR;
+	int nr_class = one_function? 2 : model->nr_class;
+	int nr_f = one_function? 1 : nr_class*(nr_class-1)/2;
+
+	// the decision functions, for pair (i,j) the SVs of both classes
+	int *start = Malloc(int,nr_class);
+	start[0] = 0;
+	for(i=1;i<nr_class && !one_function;i++)
+		start[i] = start[i-1]+model->nSV[i-1];
+	compress_function *f = Malloc(compress_function,nr_f);
+	if(one_function)
+	{
+		f[0].n = l;
+		f[0].sv = Malloc(int,l);
+		f[0].coef = Malloc(double,l);
+		for(k=0;k<l;k++)
+		{
+			f[0].sv[k] = k;
+			f[0].coef[k] = model->sv_coef[0][k];
+		}
+		f[0].rho = model->rho[0];
+		f[0].n_ref = ref->l;
+		f[0].ref = (const svm_node **)ref->x;
+	}
+	else
+	{
+		int p = 0;
+		for(i=0;i<nr_class;i++)
+			for(int j=i+1;j<nr_class;j++,p++)
+			{
+				int ci = model->nSV[i], cj = model->nSV[j];
+				f[p].n = ci+cj;
+				f[p].sv = Malloc(int,ci+cj);
+				f[p].coef = Malloc(double,ci+cj);
+				for(k=0;k<ci;k++)
+				{
+					f[p].sv[k] = start[i]+k;
+					f[p].coef[k] = model->sv_coef[j-1][start[i]+k];
+				}
+				for(k=0;k<cj;k++)
+				{
+					f[p].sv[ci+k] = start[j]+k;
+					f[p].coef[ci+k] = model->sv_coef[i][start[j]+k];
+				}
+				f[p].rho = model->rho[p];
+
+				// a pair only decides between its classes, so compare on their rows
+				f[p].ref = Malloc(const svm_node *,ref->l);
+				f[p].n_ref = 0;
+				for(k=0;k<ref->l;k++)
+					if(ref->y[k] == model->label[i] || ref->y[k] == model->label[j])
+						f[p].ref[f[p].n_ref++] = ref->x[k];
+				if(f[p].n_ref == 0)
+				{
+					f[p].n_ref = ref->l;
+					memcpy(f[p].ref,ref->x,sizeof(svm_node *)*ref->l);
+				}
+			}
+	}
+
+	// share the target by the SVs each function uses
+	long long total = 0;
+	for(int p=0;p<nr_f;p++)
+		total += f[p].n;
+	double worst_rms = 0, worst_max = 0;
+	double start_time = wall_time();
+	for(int p=0;p<nr_f;p++)
+	{
+		int target = (int)max(1LL,(long long)target_sv*f[p].n/max(total,1LL));
+		double rms, emax;
+		int kept = compress_function_omp(model,&f[p],target,tolerance,nr_f == 1,&rms,&emax);
+		if(nr_f > 1)
+			info("  pair %d: %d of %d SVs, decision value error rms %g, max %g\n",p,kept,f[p].n,rms,emax);
+		worst_rms = max(worst_rms,rms);
+		worst_max = max(worst_max,emax);
+	}
+
+	// an SV is kept if any function still uses it
+	double **coef = Malloc(double *,nr_class-1);
+	for(k=0;k<nr_class-1;k++)
+	{
+		coef[k] = Malloc(double,l);
+		for(i=0;i<l;i++)
+			coef[k][i] = 0;
+	}
+	if(one_function)
+		memcpy(coef[0],f[0].coef,sizeof(double)*l);
+	else
+	{
+		int p = 0;
+		for(i=0;i<nr_class;i++)
+			for(int j=i+1;j<nr_class;j++,p++)
+			{
+				int ci = model->nSV[i];
+				for(k=0;k<f[p].n;k++)
+					coef[k<ci? j-1 : i][f[p].sv[k]] = f[p].coef[k];
+			}
+	}
+	bool *keep = Malloc(bool,l);
+	int nr_sv = 0;
+	for(i=0;i<l;i++)
+	{
+		keep[i] = false;
+		for(k=0;k<nr_class-1;k++)
+			keep[i] = keep[i] || coef[k][i] != 0;
+		if(keep[i]) ++nr_sv;
+	}
+
+	svm_model *compressed = Malloc(svm_model,1);
+	*compressed = *model;
+	compressed->l = nr_sv;
+	compressed->rho = Malloc(double,nr_f);
+	for(int p=0;p<nr_f;p++)
+		compressed->rho[p] = f[p].rho;
+	compressed->sv_coef = Malloc(double *,nr_class-1);
+	for(k=0;k<nr_class-1;k++)
+		compressed->sv_coef[k] = Malloc(double,nr_sv);
+	svm_node **sv = Malloc(svm_node *,nr_sv);
+	compressed->sv_indices = model->sv_indices? Malloc(int,nr_sv) : NULL;
+	int n = 0;
+	for(i=0;i<l;i++)
+		if(keep[i])
+		{
+			sv[n] = model->SV[i];
+			for(k=0;k<nr_class-1;k++)
+				compressed->sv_coef[k][n] = coef[k][i];
+			if(model->sv_indices)
+				compressed->sv_indices[n] = model->sv_indices[i];
+			++n;
+		}
+	compressed->SV = copy_rows(sv,nr_sv);
+	compressed->free_sv = 1;
+
+	int nr_pairs = model->nr_class*(model->nr_class-1)/2;
+	compressed->label = NULL;
+	compressed->nSV = NULL;
+	if(model->label)
+	{
+		compressed->label = Malloc(int,model->nr_class);
+		memcpy(compressed->label,model->label,sizeof(int)*model->nr_class);
+	}
+	if(model->nSV)
+	{
+		compressed->nSV = Malloc(int,model->nr_class);
+		for(i=0;i<model->nr_class;i++)
+		{
+			compressed->nSV[i] = 0;
+			for(k=start[i];k<start[i]+model->nSV[i];k++)
+				if(keep[k]) ++compressed->nSV[i];
+		}
+	}
+	compressed->probA = NULL;
+	compressed->probB = NULL;
+	compressed->prob_density_marks = NULL;
+	if(model->probA)
+	{
+		int n_prob = one_function? 1 : nr_pairs;
+		compressed->probA = Malloc(double,n_prob);
+		memcpy(compressed->probA,model->probA,sizeof(double)*n_prob);
+	}
+	if(model->probB)
+	{
+		compressed->probB = Malloc(double,nr_pairs);
+		memcpy(compressed->probB,model->probB,sizeof(double)*nr_pairs);
+	}
+	if(model->prob_density_marks)
+	{
+		compressed->prob_density_marks = Malloc(double,10);
+		memcpy(compressed->prob_density_marks,model->prob_density_marks,sizeof(double)*10);
+	}
+
+	info("compressed %d -> %d SVs (%.1fx fewer kernel evaluations) in %.3fs,\n"
+	     "decision value error on the reference rows: rms %g, max %g\n",
+	     l,nr_sv,(double)l/max(nr_sv,1),wall_time()-start_time,worst_rms,worst_max);
+
+	free(sv);
+	free(keep);
+	for(k=0;k<nr_class-1;k++)
+		free(coef[k]);
+	free(coef);
+	for(int p=0;p<nr_f;p++)
+	{
+		free(f[p].sv);
+		free(f[p].coef);
+		if(!one_function)
+			free(f[p].ref);
+	}
+	free(f);
+	free(start);
+	return compressed;
+}
+
+//
+// Checkpoint files
+//
+// layout, in native byte order:
+//	"SVMCKPT2" svm_type l fingerprint nr_pairs nr_done converged has_prob has_state
+//	nr_done times: len rho alpha[len]
+//	if has_prob: probA[nr_done+has_state] probB[nr_done+has_state]
+//	if has_state: pair sl iter counter active_size unshrink
+//		active_set[sl] alpha[sl] G[sl] G_bar[sl] alpha_status[sl] y[sl] p[sl]
+//
+// files are written to "<checkpoint_file>.tmp" and renamed,
+// so an interrupted write never replaces the last good checkpoint
+//
+
+// FNV-1a over 64-bit words, as hash_row
+static unsigned long long fingerprint_add(unsigned long long h, double v)
+{
+	unsigned long long b;
+	memcpy(&b,&v,sizeof(b));
+	return (h ^ b) * 1099511628211ULL;
+}
+
+// hash of the rows, labels and weights and of the parameters that define the
+// solution; a checkpoint is only resumed with the ones it was taken with.
+// For a kernel_file the serial numbers are hashed, not the matrix.
+static unsigned long long checkpoint_fingerprint(const svm_problem *prob, const svm_parameter *param)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	h = fingerprint_add(h,param->svm_type);
+	h = fingerprint_add(h,param->kernel_type);
+	h = fingerprint_add(h,param->degree);
+	h = fingerprint_add(h,param->gamma);
+	h = fingerprint_add(h,param->coef0);
+	h = fingerprint_add(h,param->C);
+	h = fingerprint_add(h,param->nu);
+	h = fingerprint_add(h,param->p);
+	h = fingerprint_add(h,param->eps);
+	for(int i=0;i<param->nr_weight;i++)
+	{
+		h = fingerprint_add(h,param->weight_label[i]);
+		h = fingerprint_add(h,param->weight[i]);
+	}
+	h = fingerprint_add(h,prob->l);
+	for(int i=0;i<prob->l;i++)
+	{
+		h = fingerprint_add(h,prob->y[i]);
+		h = fingerprint_add(h,prob->W? prob->W[i] : 1);
+		const svm_node *x = prob->x[i];
+		for(;x->index!=-1;x++)
+		{
+			h = fingerprint_add(h,x->index);
+			h = fingerprint_add(h,x->value);
+		}
+		h = fingerprint_add(h,x->index);
+	}
+	return h;
+}
+
+static FILE *open_checkpoint(const train_context *ctx, char **tmp_file)
+{
+	const char *file = ctx->param->checkpoint_file;
+	*tmp_file = Malloc(char,strlen(file)+5);
+	sprintf(*tmp_file,"%s.tmp",file);
+	FILE *fp = fopen(*tmp_file,"wb");
+	if(fp == NULL)
+	{
+		fprintf(stderr,"WARNING: cannot open checkpoint file %s\n",*tmp_file);
+		free(*tmp_file);
+	}
+	return fp;
+}
+
+static void write_checkpoint_head(FILE *fp, const train_context *ctx, int nr_done, int has_state)
+{
+	int converged = ctx->converged;
+	int has_prob = ctx->probA != NULL;
+
+	fwrite("SVMCKPT2",sizeof(char),8,fp);
+	fwrite(&ctx->param->svm_type,sizeof(int),1,fp);
+	fwrite(&ctx->l,sizeof(int),1,fp);
+	fwrite(&ctx->fingerprint,sizeof(unsigned long long),1,fp);
+	fwrite(&ctx->nr_pairs,sizeof(int),1,fp);
+	fwrite(&nr_done,sizeof(int),1,fp);
+	fwrite(&converged,sizeof(int),1,fp);
+	fwrite(&has_prob,sizeof(int),1,fp);
+	fwrite(&has_state,sizeof(int),1,fp);
+	for(int i=0;i<nr_done;i++)
+	{
+		fwrite(&ctx->f[i].l,sizeof(int),1,fp);
+		fwrite(&ctx->f[i].rho,sizeof(double),1,fp);
+		fwrite(ctx->f[i].alpha,sizeof(double),ctx->f[i].l,fp);
+	}
+	if(has_prob)
+	{
+		fwrite(ctx->probA,sizeof(double),nr_done+has_state,fp);
+		fwrite(ctx->probB,sizeof(double),nr_done+has_state,fp);
+	}
+}
+
+static void finish_checkpoint(FILE *fp, char *tmp_file, train_context *ctx)
+{
+	const char *file = ctx->param->checkpoint_file;
+	bool ok = ferror(fp) == 0;
+	if(fclose(fp) != 0)
+		ok = false;
+#ifdef _WIN32
+	if(ok)
+		remove(file);	// rename does not replace an existing file on Windows
+#endif
+	if(ok && rename(tmp_file,file) != 0)
+		ok = false;
+	if(!ok)
+	{
+		fprintf(stderr,"WARNING: failed to write checkpoint file %s\n",file);
+		remove(tmp_file);
+	}
+	free(tmp_file);
+	ctx->last_checkpoint = wall_time();
+}
+
+// checkpoint taken between sub-problems, with no solve in progress
+static void save_finished_checkpoint(train_context *ctx, int nr_done)
+{
+	char *tmp_file;
+	FILE *fp = open_checkpoint(ctx,&tmp_file);
+	if(fp == NULL)
+		return;
+	write_checkpoint_head(fp,ctx,nr_done,0);
+	finish_checkpoint(fp,tmp_file,ctx);
+}
+
+static void free_checkpoint(checkpoint_state *ckpt)
+{
+	if(ckpt->f != NULL)
+		for(int i=0;i<ckpt->nr_done;i++)
+			free(ckpt->f[i].alpha);
+	free(ckpt->f);
+	free(ckpt->probA);
+	free(ckpt->probB);
+	free(ckpt->active_set);
+	free(ckpt->alpha);
+	free(ckpt->G);
+	free(ckpt->G_bar);
+	free(ckpt->alpha_status);
+	free(ckpt->y);
+	free(ckpt->p);
+	free(ckpt);
+}
+
+#define FREAD(_ptr, _size, _n) do{ if (fread(_ptr, _size, _n, fp) != (size_t)(_n)) return false; }while(0)
+static bool read_checkpoint_body(FILE *fp, checkpoint_state *ckpt)
+{
+	char magic[8];
+	int converged, has_prob, has_state;
+	FREAD(magic,sizeof(char),8);
+	if(memcmp(magic,"SVMCKPT2",8) != 0)
+		return false;
+	FREAD(&ckpt->svm_type,sizeof(int),1);
+	FREAD(&ckpt->l,sizeof(int),1);
+	FREAD(&ckpt->fingerprint,sizeof(unsigned long long),1);
+	FREAD(&ckpt->nr_pairs,sizeof(int),1);
+	FREAD(&ckpt->nr_done,sizeof(int),1);
+	FREAD(&converged,sizeof(int),1);
+	FREAD(&has_prob,sizeof(int),1);
+	FREAD(&has_state,sizeof(int),1);
+	if(ckpt->l <= 0 || ckpt->nr_pairs <= 0 || ckpt->nr_done < 0 || ckpt->nr_done > ckpt->nr_pairs)
+		return false;
+	ckpt->converged = converged != 0;
+
+	ckpt->f = (decision_function *)calloc(ckpt->nr_pairs,sizeof(decision_function));
+	for(int i=0;i<ckpt->nr_done;i++)
+	{
+		decision_function& f = ckpt->f[i];
+		FREAD(&f.l,sizeof(int),1);
+		FREAD(&f.rho,sizeof(double),1);
+		if(f.l <= 0 || f.l > ckpt->l)
+			return false;
+		f.alpha = Malloc(double,f.l);
+		FREAD(f.alpha,sizeof(double),f.l);
+	}
+
+	if(has_prob)
+	{
+		int n = ckpt->nr_done+(has_state != 0);
+		ckpt->probA = Malloc(double,n);
+		ckpt->probB = Malloc(double,n);
+		FREAD(ckpt->probA,sizeof(double),n);
+		FREAD(ckpt->probB,sizeof(double),n);
+	}
 
-			//increment the number of classes
-			++nr_class;
-		}
+	ckpt->pair = -1;
+	if(has_state)
+	{
+		char unshrink;
+		FREAD(&ckpt->pair,sizeof(int),1);
+		FREAD(&ckpt->sl,sizeof(int),1);
+		FREAD(&ckpt->iter,sizeof(int),1);
+		FREAD(&ckpt->counter,sizeof(int),1);
+		FREAD(&ckpt->active_size,sizeof(int),1);
+		FREAD(&unshrink,sizeof(char),1);
+		int sl = ckpt->sl;
+		if(ckpt->pair != ckpt->nr_done || ckpt->pair >= ckpt->nr_pairs || sl <= 0 || sl > 2*ckpt->l ||
+		   ckpt->active_size < 0 || ckpt->active_size > sl || ckpt->counter <= 0)
+			return false;
+		ckpt->unshrink = unshrink != 0;
+		ckpt->active_set = Malloc(int,sl);
+		ckpt->alpha = Malloc(double,sl);
+		ckpt->G = Malloc(double,sl);
+		ckpt->G_bar = Malloc(double,sl);
+		ckpt->alpha_status = Malloc(char,sl);
+		ckpt->y = Malloc(schar,sl);
+		ckpt->p = Malloc(double,sl);
+		FREAD(ckpt->active_set,sizeof(int),sl);
+		FREAD(ckpt->alpha,sizeof(double),sl);
+		FREAD(ckpt->G,sizeof(double),sl);
+		FREAD(ckpt->G_bar,sizeof(double),sl);
+		FREAD(ckpt->alpha_status,sizeof(char),sl);
+		FREAD(ckpt->y,sizeof(schar),sl);
+		FREAD(ckpt->p,sizeof(double),sl);
 	}
+	return true;
+}
 
-	//
-	// Labels are ordered by their first occurrence in the training set.
-	// However, for two-class sets with -1/+1 labels and -1 appears first,
-	// we swap labels to ensure that internally the binary SVM has positive data corresponding to the +1 instances.
-	//
+static checkpoint_state *read_checkpoint(const char *file)
+{
+	FILE *fp = fopen(file,"rb");
+	if(fp == NULL)
+		return NULL;
+	checkpoint_state *ckpt = (checkpoint_state *)calloc(1,sizeof(checkpoint_state));
+	bool ok = read_checkpoint_body(fp,ckpt);
+	fclose(fp);
+	if(!ok)
+	{
+		free_checkpoint(ckpt);
+		return NULL;
+	}
+	return ckpt;
+}
 
-	if (nr_class == 2 && label[0] == -1 && label[1] == 1) //handling two-class problems with -1 and 1 labels
+static svm_model *svm_train_context(const svm_problem *prob, const svm_parameter *param, checkpoint_state *resume);
+
+//
+// Merging duplicate rows
+//
+// Identical rows with the same label become one instance whose weight is
+// the sum of the weights of the copies. The solution is the same, since
+// copies of a row can share their alphas in proportion to their weights,
+// but the problem has fewer variables and kernel columns.
+//
+static unsigned long long hash_row(const svm_node *x, double y)
+{
+	unsigned long long h = 14695981039346656037ULL;	// FNV-1a
+	memcpy(&h,&y,sizeof(h));
+	h = (14695981039346656037ULL ^ h) * 1099511628211ULL;
+	for(;x->index!=-1;x++)
 	{
-		swap(label[0],label[1]);
-		swap(count[0],count[1]);
-		for(i=0;i<l;i++)
-		{
-			if(data_label[i] == 0)
-				data_label[i] = 1;
-			else
-				data_label[i] = 0;
-		}
+		double v = x->value == 0? 0 : x->value;	// -0 == 0
+		unsigned long long b;
+		memcpy(&b,&v,sizeof(b));
+		h = (h ^ (unsigned int)x->index) * 1099511628211ULL;
+		h = (h ^ b) * 1099511628211ULL;
 	}
+	return h;
+}
 
-	//array of ?
-	int *start = Malloc(int,nr_class);
+static bool same_row(const svm_node *x, const svm_node *y)
+{
+	for(;x->index!=-1;x++,y++)
+		if(x->index != y->index || x->value != y->value)
+			return false;
+	return y->index == -1;
+}
 
-    //class 0 data starts at index 0
-	start[0] = 0;
+// the distinct rows of prob in order of first occurrence, weighted by
+// their copies; first maps them back to prob
+struct distinct_rows
+{
+	svm_problem prob;
+	int *first;
+};
 
-    //initialize the starting indices for each of the classes
-	for(i=1;i<nr_class;i++)
-		start[i] = start[i-1]+count[i-1];
+static void merge_duplicate_rows(const svm_problem *prob, distinct_rows *d)
+{
+	int l = prob->l;
+	int size = 1;
+	while(size < 2*l)
+		size *= 2;
+	int *table = Malloc(int,size);	// open addressing, -1 for empty
+	unsigned long long *hash = Malloc(unsigned long long,l);
+	int i, n = 0;
 
-    //populate perm
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(static)
+#endif
+	for(i=0;i<l;i++)
+		hash[i] = hash_row(prob->x[i],prob->y[i]);
+	for(i=0;i<size;i++)
+		table[i] = -1;
+
+	d->prob.x = Malloc(svm_node *,l);
+	d->prob.y = Malloc(double,l);
+	d->prob.W = Malloc(double,l);
+	d->first = Malloc(int,l);
 	for(i=0;i<l;i++)
 	{
-		perm[start[data_label[i]]] = i;
-		++start[data_label[i]];
+		int s = (int)(hash[i] & (size-1));
+		for(;table[s]!=-1;s=(s+1)&(size-1))
+		{
+			int k = d->first[table[s]];
+			if(hash[k] == hash[i] && prob->y[k] == prob->y[i] && same_row(prob->x[k],prob->x[i]))
+				break;
+		}
+		if(table[s] == -1)
+		{
+			table[s] = n;
+			d->prob.x[n] = prob->x[i];
+			d->prob.y[n] = prob->y[i];
+			d->prob.W[n] = 0;
+			d->first[n] = i;
+			n++;
+		}
+		d->prob.W[table[s]] += prob->W? prob->W[i] : 1;
 	}
+	d->prob.l = n;
 
-    //reset the start array
-	start[0] = 0;
-	for(i=1;i<nr_class;i++)
-		start[i] = start[i-1]+count[i-1];
-
-    // set the number of classes
-    *nr_class_ret = nr_class;
+	free(table);
+	free(hash);
+}
 
-	//return the set of unique labels
-	*label_ret = label;
+static void free_distinct_rows(distinct_rows *d)
+{
+	free(d->prob.x);
+	free(d->prob.y);
+	free(d->prob.W);
+	free(d->first);
+}
 
-    //set the start array to start
-	*start_ret = start;
+static svm_model *svm_train_distinct(const svm_problem *prob, const svm_parameter *param, checkpoint_state *resume)
+{
+	double start = wall_time();
+	distinct_rows d;
+	merge_duplicate_rows(prob,&d);
+	info("merged duplicate rows: l = %d -> %d (%.1f%%) in %.3fs\n",
+	     prob->l,d.prob.l,100.0*d.prob.l/max(prob->l,1),wall_time()-start);
+
+	svm_model *model = NULL;
+	if(resume != NULL && resume->l != d.prob.l)
+		fprintf(stderr,"ERROR: checkpoint file %s does not match the problem\n",param->checkpoint_file);
+	else
+		model = svm_train_context(&d.prob,param,resume);
+
+	// SV holds rows of prob already; indices refer to it too
+	if(model != NULL && model->sv_indices != NULL)
+		for(int k=0;k<model->l;k++)
+			model->sv_indices[k] = d.first[model->sv_indices[k]-1]+1;
+	if(model != NULL)
+		info("total training time %.3fs\n",wall_time()-start);
+	free_distinct_rows(&d);
+	return model;
+}
 
-	//return the number of observations of each class
-	*count_ret = count;
+// a kernel matrix file is mapped once for the whole training, so a file
+// that changed or went away since svm_check_parameter fails here
+static svm_model *svm_train_mapped(const svm_problem *prob, const svm_parameter *param, checkpoint_state *resume)
+{
+	mapped_kernel_matrix *kmat = NULL;
+	if(param->kernel_type == PRECOMPUTED && param->kernel_file != NULL)
+	{
+		kmat = acquire_kernel_matrix(param->kernel_file);
+		if(kmat == NULL)
+		{
+			fprintf(stderr,"ERROR: cannot map kernel matrix file %s\n",param->kernel_file);
+			return NULL;
+		}
+	}
 
-	//free up the memory
-	free(data_label);
+	svm_model *model = param->merge_duplicates? svm_train_distinct(prob,param,resume) :
+		svm_train_context(prob,param,resume);
+	release_kernel_matrix(kmat);
+	return model;
 }
 
 //
 // Interface functions
 //
 svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
+{
+	return svm_train_mapped(prob,param,NULL);
+}
+
+svm_model *svm_train_resume(const svm_problem *prob, const svm_parameter *param)
+{
+	if(param->checkpoint_file == NULL)
+		return NULL;
+
+	checkpoint_state *ckpt = read_checkpoint(param->checkpoint_file);
+	if(ckpt == NULL)
+	{
+		fprintf(stderr,"ERROR: cannot read checkpoint file %s\n",param->checkpoint_file);
+		return NULL;
+	}
+	if(ckpt->svm_type != param->svm_type || (!param->merge_duplicates && ckpt->l != prob->l))
+	{
+		fprintf(stderr,"ERROR: checkpoint file %s does not match the problem\n",param->checkpoint_file);
+		free_checkpoint(ckpt);
+		return NULL;
+	}
+
+	svm_model *model = svm_train_mapped(prob,param,ckpt);
+	free_checkpoint(ckpt);
+	return model;
+}
+
+static svm_model *svm_train_context(const svm_problem *prob, const svm_parameter *param, checkpoint_state *resume)
 {
     qInfo() << "Beginning Training." << Qt::endl;
 
+	if(param->approx_type != APPROX_NONE)
+		return svm_train_approx(prob,param);
+
+	// merged rows are hashed as merged, which they are again on resume
+	unsigned long long fingerprint = param->checkpoint_file != NULL? checkpoint_fingerprint(prob,param) : 0;
+	if(resume != NULL && resume->fingerprint != fingerprint)
+	{
+		fprintf(stderr,"ERROR: checkpoint file %s does not match the problem\n",param->checkpoint_file);
+		return NULL;
+	}
+
     //initialize the model which will be returned.
 	svm_model *model = Malloc(svm_model,1);
 
     //set the models params
 	model->param = *param;
 	model->free_sv = 0;	// XXX
+	model->approx_type = APPROX_NONE;
+	model->approx_dim = 0;
+	model->approx_w = NULL;
+	model->approx_omega = NULL;
+
+	train_context ctx;
+	ctx.param = param;
+	ctx.start_time = wall_time();
+	ctx.stopped = false;
+	ctx.converged = resume == NULL || resume->converged;
+	ctx.l = prob->l;
+	ctx.fingerprint = fingerprint;
+	ctx.pair = 0;
+	ctx.nr_pairs = 1;
+	ctx.f = NULL;
+	ctx.probA = NULL;
+	ctx.probB = NULL;
+	ctx.last_checkpoint = ctx.start_time;
+	ctx.resume = resume;
+	ctx.rows = NULL;
 
 	if(param->svm_type == ONE_CLASS ||
 	   param->svm_type == EPSILON_SVR ||
@@ -2254,7 +7000,12 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 		model->prob_density_marks = NULL;
 		model->sv_coef = Malloc(double *,1);
 
-		decision_function f = svm_train_one(prob,param,0,0);
+		if(resume != NULL && (resume->nr_pairs != 1 || resume->nr_done != 0))
+		{
+			fprintf(stderr,"WARNING: checkpoint does not match the problem, starting over\n");
+			ctx.resume = NULL;
+		}
+		decision_function f = svm_train_one(prob,param,0,0,&ctx);
 		model->rho = Malloc(double,1);
 		model->rho[0] = f.rho;
 
@@ -2322,28 +7073,17 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
         //reorder the data using the permutation
 		for(i=0;i<l;i++)
 			x[i] = prob->x[perm[i]];
+		double *W = NULL;
+		if(prob->W != NULL)
+		{
+			W = Malloc(double,l);
+			for(i=0;i<l;i++)
+				W[i] = prob->W[perm[i]];
+		}
 
 		// calculate weighted C
 
-        //initialize an array of size nr_classes of doubles
-		double *weighted_C = Malloc(double, nr_class);
-
-        // initialize each weight to C
-		for(i=0;i<nr_class;i++)
-			weighted_C[i] = param->C;
-
-
-		for(i=0;i<param->nr_weight;i++)
-		{
-			int j;
-			for(j=0;j<nr_class;j++)
-				if(param->weight_label[i] == label[j])
-					break;
-			if(j == nr_class)
-				fprintf(stderr,"WARNING: class label %d specified in weight is not found\n", param->weight_label[i]);
-			else
-				weighted_C[j] *= param->weight[i];
-		}
+		double *weighted_C = svm_weighted_C(param,nr_class,label);
 
 		// train k*(k-1)/2 models
 
@@ -2370,11 +7110,28 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 
         //otherwise begin training
 
+		ctx.nr_pairs = nr_class*(nr_class-1)/2;
+		ctx.f = f;
+		ctx.probA = probA;
+		ctx.probB = probB;
+		if(resume != NULL && (resume->nr_pairs != ctx.nr_pairs ||
+		   (param->probability && resume->probA == NULL)))
+		{
+			fprintf(stderr,"WARNING: checkpoint does not match the problem, starting over\n");
+			resume = ctx.resume = NULL;
+		}
+
+		// with more than one pair, all pairs read kernel rows from one shared cache
+		Shared_Kernel *rows = NULL;
+		if(nr_class > 2 && param->kernel_type != LINEAR && param->cascade_parts <= 1)
+			rows = new Shared_Kernel(l,x,*param,nr_class,start,count);
+		ctx.rows = rows;
+
 		int p = 0;
 
         //for each class
 		for(i=0;i<nr_class;i++)
-
+		{
             qInfo() << "Computing model: " << i << " " << Qt::endl;
 
             for(int j=i+1;j<nr_class;j++)
@@ -2404,6 +7161,15 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
                 //array to hold classes
 				sub_prob.y = Malloc(double,sub_prob.l);
 
+				//instance weights, if any
+				sub_prob.W = NULL;
+				if(W != NULL)
+				{
+					sub_prob.W = Malloc(double,sub_prob.l);
+					memcpy(sub_prob.W,W+si,sizeof(double)*ci);
+					memcpy(sub_prob.W+ci,W+sj,sizeof(double)*cj);
+				}
+
 
 				int k;
 
@@ -2421,14 +7187,43 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 					sub_prob.y[ci+k] = -1;
 				}
 
-                //if probability is required
-				if(param->probability)
-					svm_binary_svc_probability(&sub_prob,param,weighted_C[i],weighted_C[j],probA[p],probB[p]);
+				ctx.pair = p;
+				ctx.class_i = i;
+				ctx.class_j = j;
+
+				if(resume != NULL && p < resume->nr_done)
+				{
+					//finished before the checkpoint was taken, take over its solution
+					f[p] = resume->f[p];
+					resume->f[p].alpha = NULL;
+					if(param->probability)
+					{
+						probA[p] = resume->probA[p];
+						probB[p] = resume->probB[p];
+					}
+				}
+				else
+				{
+	                //if probability is required
+					if(param->probability)
+					{
+						if(resume != NULL && p == resume->pair)
+						{
+							probA[p] = resume->probA[p];
+							probB[p] = resume->probB[p];
+						}
+						else
+							svm_binary_svc_probability(&sub_prob,param,weighted_C[i],weighted_C[j],probA[p],probB[p]);
+					}
+
+	                qInfo() << "Computing decision boundary between class " << i << "and class" << j << "." << Qt::endl;
 
-                qInfo() << "Computing decision boundary between class " << i << "and class" << j << "." << Qt::endl;
+	                //train the pth model
+					f[p] = svm_train_one(&sub_prob,param,weighted_C[i],weighted_C[j],&ctx);
 
-                //train the pth model
-				f[p] = svm_train_one(&sub_prob,param,weighted_C[i],weighted_C[j]);
+					if(param->checkpoint_file != NULL && !ctx.stopped)
+						save_finished_checkpoint(&ctx,p+1);
+				}
 
 
 				for(k=0;k<ci;k++)
@@ -2439,8 +7234,13 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 						nonzero[sj+k] = true;
 				free(sub_prob.x);
 				free(sub_prob.y);
+				free(sub_prob.W);
 				++p;
 			}
+		}
+		delete rows;
+		ctx.rows = NULL;
+		free(W);
 
 		// build output
 
@@ -2553,6 +7353,10 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 		free(nz_count);
 		free(nz_start);
 	}
+
+	model->converged = ctx.converged;
+	if(!ctx.converged)
+		info("WARNING: returning a model that did not converge\n");
     return model;
 }
 
@@ -2562,8 +7366,23 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 	int i;
 	int *fold_start;
 	int l = prob->l;
-	int *perm = Malloc(int,l);
 	int nr_class;
+
+	// the folds are trained and predicted on one mapping of a kernel matrix file
+	mapped_kernel_matrix *kmat = NULL;
+	if(param->kernel_type == PRECOMPUTED && param->kernel_file != NULL)
+	{
+		kmat = acquire_kernel_matrix(param->kernel_file);
+		if(kmat == NULL)
+		{
+			fprintf(stderr,"ERROR: cannot map kernel matrix file %s\n",param->kernel_file);
+			for(i=0;i<l;i++)
+				target[i] = NAN;
+			return;
+		}
+	}
+
+	int *perm = Malloc(int,l);
 	if (nr_fold > l)
 	{
 		fprintf(stderr,"WARNING: # folds (%d) > # data (%d). Will use # folds = # data instead (i.e., leave-one-out cross validation)\n", nr_fold, l);
@@ -2643,18 +7462,21 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 		subprob.l = l-(end-begin);
 		subprob.x = Malloc(struct svm_node*,subprob.l);
 		subprob.y = Malloc(double,subprob.l);
+		subprob.W = prob->W? Malloc(double,subprob.l) : NULL;
 
 		k=0;
 		for(j=0;j<begin;j++)
 		{
 			subprob.x[k] = prob->x[perm[j]];
 			subprob.y[k] = prob->y[perm[j]];
+			if(subprob.W) subprob.W[k] = prob->W[perm[j]];
 			++k;
 		}
 		for(j=end;j<l;j++)
 		{
 			subprob.x[k] = prob->x[perm[j]];
 			subprob.y[k] = prob->y[perm[j]];
+			if(subprob.W) subprob.W[k] = prob->W[perm[j]];
 			++k;
 		}
 		struct svm_model *submodel = svm_train(&subprob,param);
@@ -2672,11 +7494,199 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 		svm_free_and_destroy_model(&submodel);
 		free(subprob.x);
 		free(subprob.y);
+		free(subprob.W);
 	}
 	free(fold_start);
 	free(perm);
+	release_kernel_matrix(kmat);
+}
+
+// compute the kernel matrix of prob->x once and write it for svm_parameter.kernel_file
+int svm_precompute_kernel(const char *kernel_file_name, const svm_problem *prob, const svm_parameter *param)
+{
+	if(param->kernel_type == PRECOMPUTED)
+		return -1;
+
+	FILE *fp = fopen(kernel_file_name,"wb");
+	if(fp==NULL) return -1;
+
+	int l = prob->l;
+	char header[KMAT_HEADER];
+	memset(header,0,KMAT_HEADER);
+	memcpy(header,"SVMKMAT1",8);
+	memcpy(header+8,&l,sizeof(int));
+	memcpy(header+12,&param->kernel_type,sizeof(int));
+	memcpy(header+16,&param->degree,sizeof(int));
+	memcpy(header+24,&param->gamma,sizeof(double));
+	memcpy(header+32,&param->coef0,sizeof(double));
+	fwrite(header,1,KMAT_HEADER,fp);
+
+	// compute a tile of rows in parallel, then write it
+	int tile = (int)min((size_t)l,max((size_t)1,((size_t)64<<20)/(sizeof(float)*l)));
+	float *buf = Malloc(float,(size_t)tile*l);
+	for(int r=0;r<l && ferror(fp)==0;r+=tile)
+	{
+		int n = min(tile,l-r);
+		long k, nl = (long)n*l;
+#ifdef _OPENMP
+#pragma omp parallel for private(k) schedule(guided)
+#endif
+		for(k=0;k<nl;k++)
+			buf[k] = (float)Kernel::k_function(prob->x[r+k/l],prob->x[k%l],*param);
+		fwrite(buf,sizeof(float),(size_t)nl,fp);
+		info(".");
+	}
+	info("\n");
+	free(buf);
+
+	if (ferror(fp) != 0 || fclose(fp) != 0) return -1;
+	else return 0;
+}
+
+struct svm_dataset_writer
+{
+	FILE *fp;
+	int64_t l, nr_node, max_l;
+	double *y;
+	int64_t *row;
+};
+
+svm_dataset_writer *svm_dataset_create(const char *dataset_file_name)
+{
+	FILE *fp = fopen(dataset_file_name,"wb");
+	if(fp==NULL) return NULL;
+
+	char header[DATA_HEADER];
+	memset(header,0,DATA_HEADER);
+	fwrite(header,1,DATA_HEADER,fp);	// written by svm_dataset_close
+
+	svm_dataset_writer *w = Malloc(svm_dataset_writer,1);
+	w->fp = fp;
+	w->l = 0;
+	w->nr_node = 0;
+	w->max_l = 1024;
+	w->y = Malloc(double,w->max_l);
+	w->row = Malloc(int64_t,w->max_l);
+	return w;
+}
+
+int svm_dataset_add(svm_dataset_writer *w, double y, const svm_node *x)
+{
+	if(w->l == w->max_l)
+	{
+		w->max_l *= 2;
+		w->y = (double *)realloc(w->y,w->max_l*sizeof(double));
+		w->row = (int64_t *)realloc(w->row,w->max_l*sizeof(int64_t));
+	}
+	int n = 0;
+	while(x[n].index != -1)
+		n++;
+	n++;	// the terminator is stored too
+	w->y[w->l] = y;
+	w->row[w->l] = w->nr_node;
+	w->l++;
+	w->nr_node += n;
+	return fwrite(x,sizeof(svm_node),n,w->fp) == (size_t)n ? 0 : -1;
+}
+
+int svm_dataset_close(svm_dataset_writer *w)
+{
+	FILE *fp = w->fp;
+	int64_t header[DATA_HEADER/sizeof(int64_t)];
+	memset(header,0,DATA_HEADER);
+	memcpy(header,"SVMDATA1",8);
+	header[1] = w->l;
+	header[2] = w->nr_node;
+	header[3] = sizeof(svm_node);
+	header[4] = DATA_HEADER + w->nr_node*(int64_t)sizeof(svm_node);
+	header[5] = header[4] + w->l*(int64_t)sizeof(double);
+
+	fwrite(w->y,sizeof(double),(size_t)w->l,fp);
+	fwrite(w->row,sizeof(int64_t),(size_t)w->l,fp);
+	fseek(fp,0,SEEK_SET);
+	fwrite(header,1,DATA_HEADER,fp);
+
+	free(w->y);
+	free(w->row);
+	free(w);
+	if (ferror(fp) != 0 || fclose(fp) != 0) return -1;
+	else return 0;
+}
+
+svm_problem *svm_map_dataset(const char *dataset_file_name)
+{
+	mapped_file m;
+	if(!map_file(dataset_file_name,&m))
+		return NULL;
+
+	int64_t header[6];
+	if(m.size >= DATA_HEADER)
+		memcpy(header,m.addr,sizeof(header));
+	if(m.size < DATA_HEADER || memcmp(m.addr,"SVMDATA1",8) != 0 ||
+	   header[1] <= 0 || header[1] > INT_MAX || header[3] != (int64_t)sizeof(svm_node) ||
+	   header[4] != DATA_HEADER + header[2]*header[3] ||
+	   header[5] != header[4] + header[1]*(int64_t)sizeof(double) ||
+	   (uint64_t)header[5] + header[1]*sizeof(int64_t) > m.size)
+	{
+		unmap_file(&m);
+		return NULL;
+	}
+
+	// the last row must be terminated inside the node block, or the kernels
+	// would run off the end of the mapping
+	const svm_node *nodes = (const svm_node *)(m.addr + DATA_HEADER);
+	if(header[2] <= 0 || nodes[header[2]-1].index != -1)
+	{
+		unmap_file(&m);
+		return NULL;
+	}
+
+	int l = (int)header[1];
+	const int64_t *row = (const int64_t *)(m.addr + header[5]);
+
+	mapped_dataset *d = Malloc(mapped_dataset,1);
+	d->file = m;
+	d->prob.l = l;
+	d->prob.W = NULL;
+	d->prob.y = Malloc(double,l);
+	d->prob.x = Malloc(svm_node *,l);
+	memcpy(d->prob.y,m.addr + header[4],sizeof(double)*l);
+	for(int i=0;i<l;i++)
+	{
+		if(row[i] < 0 || row[i] >= header[2])
+		{
+			free(d->prob.y);
+			free(d->prob.x);
+			free(d);
+			unmap_file(&m);
+			return NULL;
+		}
+		d->prob.x[i] = (svm_node *)(nodes + row[i]);
+	}
+
+	std::lock_guard<std::mutex> lock(mapped_datasets_lock);
+	d->next = mapped_datasets;
+	mapped_datasets = d;
+	return &d->prob;
 }
 
+void svm_unmap_dataset(svm_problem *prob)
+{
+	if(prob == NULL)
+		return;
+	mapped_dataset *d = (mapped_dataset *)prob;
+	{
+		std::lock_guard<std::mutex> lock(mapped_datasets_lock);
+		mapped_dataset **p = &mapped_datasets;
+		while(*p != d)
+			p = &(*p)->next;
+		*p = d->next;
+	}
+	free(d->prob.y);
+	free(d->prob.x);
+	unmap_file(&d->file);
+	free(d);
+}
 
 int svm_get_svm_type(const svm_model *model)
 {
@@ -2688,51 +7698,141 @@ int svm_get_nr_class(const svm_model *model)
 	return model->nr_class;
 }
 
-void svm_get_labels(const svm_model *model, int* label)
-{
-	if (model->label != NULL)
-		for(int i=0;i<model->nr_class;i++)
-			label[i] = model->label[i];
-}
+void svm_get_labels(const svm_model *model, int* label)
+{
+	if (model->label != NULL)
+		for(int i=0;i<model->nr_class;i++)
+			label[i] = model->label[i];
+}
+
+void svm_get_sv_indices(const svm_model *model, int* indices)
+{
+	if (model->sv_indices != NULL)
+		for(int i=0;i<model->l;i++)
+			indices[i] = model->sv_indices[i];
+}
+
+int svm_get_nr_sv(const svm_model *model)
+{
+	return model->l;
+}
+
+double svm_get_svr_probability(const svm_model *model)
+{
+	if ((model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) &&
+	    model->probA!=NULL)
+		return model->probA[0];
+	else
+	{
+		fprintf(stderr,"Model doesn't contain information for SVR probability inference\n");
+		return 0;
+	}
+}
+
+// one-vs-one votes from the kernel values of x against all SVs
+static double predict_from_kvalue(const svm_model *model, const double *kvalue, double *dec_values)
+{
+	int i;
+	int nr_class = model->nr_class;
+
+	int *start = Malloc(int,nr_class);
+	start[0] = 0;
+	for(i=1;i<nr_class;i++)
+		start[i] = start[i-1]+model->nSV[i-1];
+
+	int *vote = Malloc(int,nr_class);
+	for(i=0;i<nr_class;i++)
+		vote[i] = 0;
+
+	int p=0;
+	for(i=0;i<nr_class;i++)
+		for(int j=i+1;j<nr_class;j++)
+		{
+			double sum = 0;
+			int si = start[i];
+			int sj = start[j];
+			int ci = model->nSV[i];
+			int cj = model->nSV[j];
+
+			int k;
+			double *coef1 = model->sv_coef[j-1];
+			double *coef2 = model->sv_coef[i];
+			for(k=0;k<ci;k++)
+				sum += coef1[si+k] * kvalue[si+k];
+			for(k=0;k<cj;k++)
+				sum += coef2[sj+k] * kvalue[sj+k];
+			sum -= model->rho[p];
+			dec_values[p] = sum;
+
+			if(dec_values[p] > 0)
+				++vote[i];
+			else
+				++vote[j];
+			p++;
+		}
 
-void svm_get_sv_indices(const svm_model *model, int* indices)
-{
-	if (model->sv_indices != NULL)
-		for(int i=0;i<model->l;i++)
-			indices[i] = model->sv_indices[i];
+	int vote_max_idx = 0;
+	for(i=1;i<nr_class;i++)
+		if(vote[i] > vote[vote_max_idx])
+			vote_max_idx = i;
+
+	free(start);
+	free(vote);
+	return model->label[vote_max_idx];
 }
 
-int svm_get_nr_sv(const svm_model *model)
+// a training row of a kernel_file problem, 0:serial alone, as cross
+// validation and the probability folds predict; it has no kernel values
+// of its own, they are read from the mapped file
+static bool is_kernel_file_row(const svm_node *x, const svm_parameter& param)
 {
-	return model->l;
+	return param.kernel_type == PRECOMPUTED && param.kernel_file != NULL &&
+	       x[0].index == 0 && x[1].index == -1;
 }
 
-double svm_get_svr_probability(const svm_model *model)
+static void kernel_file_values(const svm_node *x, svm_node * const *SV, int l, const svm_parameter& param, double *kvalue)
 {
-	if ((model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) &&
-	    model->probA!=NULL)
-		return model->probA[0];
-	else
+	mapped_kernel_matrix *kmat = acquire_kernel_matrix(param.kernel_file);
+	if(kmat == NULL || x[0].value < 1 || x[0].value > kmat->l)
 	{
-		fprintf(stderr,"Model doesn't contain information for SVR probability inference\n");
-		return 0;
+		fprintf(stderr,"ERROR: row %g is not in kernel matrix file %s\n",x[0].value,param.kernel_file);
+		for(int i=0;i<l;i++)
+			kvalue[i] = 0;
 	}
+	else
+		for(int i=0;i<l;i++)
+			kvalue[i] = kernel_matrix_value(kmat,x,SV[i]);
+	release_kernel_matrix(kmat);
 }
 
 double svm_predict_values(const svm_model *model, const svm_node *x, double* dec_values)
 {
 	int i;
+	if(model->approx_type != APPROX_NONE)
+		return predict_approx_values(model,x,dec_values);
+
 	if(model->param.svm_type == ONE_CLASS ||
 	   model->param.svm_type == EPSILON_SVR ||
 	   model->param.svm_type == NU_SVR)
 	{
 		double *sv_coef = model->sv_coef[0];
 		double sum = 0;
+		if(is_kernel_file_row(x,model->param))
+		{
+			double *kvalue = Malloc(double,model->l);
+			kernel_file_values(x,model->SV,model->l,model->param,kvalue);
+			for(i=0;i<model->l;i++)
+				sum += sv_coef[i] * kvalue[i];
+			free(kvalue);
+		}
+		else
+		{
 #ifdef _OPENMP
 #pragma omp parallel for private(i) reduction(+:sum) schedule(guided)
 #endif
-		for(i=0;i<model->l;i++)
-			sum += sv_coef[i] * Kernel::k_function(x,model->SV[i],model->param);
+			for(i=0;i<model->l;i++)
+				sum += sv_coef[i] * Kernel::k_function(x,model->SV[i],model->param);
+		}
 		sum -= model->rho[0];
 		*dec_values = sum;
 
@@ -2743,61 +7843,378 @@ double svm_predict_values(const svm_model *model, const svm_node *x, double* dec
 	}
 	else
 	{
-		int nr_class = model->nr_class;
 		int l = model->l;
 
 		double *kvalue = Malloc(double,l);
+		if(is_kernel_file_row(x,model->param))
+			kernel_file_values(x,model->SV,l,model->param,kvalue);
+		else
+		{
 #ifdef _OPENMP
 #pragma omp parallel for private(i) schedule(guided)
 #endif
-		for(i=0;i<l;i++)
-			kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
+			for(i=0;i<l;i++)
+				kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
+		}
 
-		int *start = Malloc(int,nr_class);
-		start[0] = 0;
-		for(i=1;i<nr_class;i++)
-			start[i] = start[i-1]+model->nSV[i-1];
+		double pred_result = predict_from_kvalue(model,kvalue,dec_values);
+		free(kvalue);
+		return pred_result;
+	}
+}
 
-		int *vote = Malloc(int,nr_class);
-		for(i=0;i<nr_class;i++)
-			vote[i] = 0;
+// rows of a batch scored together, so each SV is read once per group
+#define PREDICT_GROUP 64
 
-		int p=0;
-		for(i=0;i<nr_class;i++)
-			for(int j=i+1;j<nr_class;j++)
+void svm_predict_batch(const svm_model *model, const svm_node * const *x, int n, double *pred)
+{
+	int i, r;
+	int svm_type = model->param.svm_type;
+	int nr_class = model->nr_class;
+	bool one_function = svm_type == ONE_CLASS || svm_type == EPSILON_SVR || svm_type == NU_SVR;
+	double *dec_values = Malloc(double,one_function? 1 : nr_class*(nr_class-1)/2);
+
+	if(model->approx_type != APPROX_NONE || n == 1 || model->param.kernel_file != NULL)
+	{
+		for(r=0;r<n;r++)
+			pred[r] = svm_predict_values(model,x[r],dec_values);
+		free(dec_values);
+		return;
+	}
+
+	int l = model->l;
+	double *kvalue = Malloc(double,(size_t)PREDICT_GROUP*l);
+	for(int begin=0;begin<n;begin+=PREDICT_GROUP)
+	{
+		int size = min(PREDICT_GROUP,n-begin);
+
+		// SV-major, each thread keeps its SVs in cache over the group
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(guided)
+#endif
+		for(i=0;i<l;i++)
+			for(int r=0;r<size;r++)
+				kvalue[(size_t)r*l+i] = Kernel::k_function(x[begin+r],model->SV[i],model->param);
+
+		for(r=0;r<size;r++)
+		{
+			const double *k = &kvalue[(size_t)r*l];
+			if(one_function)
 			{
 				double sum = 0;
-				int si = start[i];
-				int sj = start[j];
-				int ci = model->nSV[i];
-				int cj = model->nSV[j];
+				for(i=0;i<l;i++)
+					sum += model->sv_coef[0][i]*k[i];
+				sum -= model->rho[0];
+				if(svm_type == ONE_CLASS)
+					pred[begin+r] = (sum>0)?1:-1;
+				else
+					pred[begin+r] = sum;
+			}
+			else
+				pred[begin+r] = predict_from_kvalue(model,k,dec_values);
+		}
+	}
+	free(kvalue);
+	free(dec_values);
+}
 
-				int k;
-				double *coef1 = model->sv_coef[j-1];
-				double *coef2 = model->sv_coef[i];
-				for(k=0;k<ci;k++)
-					sum += coef1[si+k] * kvalue[si+k];
-				for(k=0;k<cj;k++)
-					sum += coef2[sj+k] * kvalue[sj+k];
-				sum -= model->rho[p];
-				dec_values[p] = sum;
+//
+// Quantized SVs for prediction
+//
+// The SVs are stored as a dense l x dim block of fp16 values, or of 8-bit
+// codes with a per-feature offset and step, instead of svm_node pairs. A
+// row x is expanded to dense floats once, then each kernel value is a
+// contiguous loop over the block that the compiler can vectorize.
+//
+struct svm_quantized_model
+{
+	svm_model model;	// decision functions, SV is NULL
+	int quant_type;
+	int dim;		// features 1..dim
+	void *data;		// SV i at data + i*dim
+	float *offset;		// QUANT_INT8: value = offset[j] + step[j]*code
+	float *step;
+};
 
-				if(dec_values[p] > 0)
-					++vote[i];
-				else
-					++vote[j];
-				p++;
+static double quantized_kernel(const svm_quantized_model *q, const float *xd, double x_square, int i)
+{
+	int dim = q->dim;
+	int kernel_type = q->model.param.kernel_type;
+	float dot = 0, dist = 0;
+	int j;
+
+	if(q->quant_type == QUANT_FP16)
+	{
+		const Qhalf *v = (const Qhalf *)q->data + (size_t)i*dim;
+		if(kernel_type == RBF)
+		{
+#ifdef _OPENMP
+#pragma omp simd reduction(+:dist)
+#endif
+			for(j=0;j<dim;j++)
+			{
+				float d = xd[j] - fp16_to_float_finite(v[j]);
+				dist += d*d;
+			}
+		}
+		else
+		{
+#ifdef _OPENMP
+#pragma omp simd reduction(+:dot)
+#endif
+			for(j=0;j<dim;j++)
+				dot += xd[j]*fp16_to_float_finite(v[j]);
+		}
+	}
+	else
+	{
+		const unsigned char *v = (const unsigned char *)q->data + (size_t)i*dim;
+		const float *offset = q->offset, *step = q->step;
+		if(kernel_type == RBF)
+		{
+#ifdef _OPENMP
+#pragma omp simd reduction(+:dist)
+#endif
+			for(j=0;j<dim;j++)
+			{
+				float d = xd[j] - (offset[j] + step[j]*v[j]);
+				dist += d*d;
 			}
+		}
+		else
+		{
+#ifdef _OPENMP
+#pragma omp simd reduction(+:dot)
+#endif
+			for(j=0;j<dim;j++)
+				dot += xd[j]*(offset[j] + step[j]*v[j]);
+		}
+	}
 
-		int vote_max_idx = 0;
-		for(i=1;i<nr_class;i++)
-			if(vote[i] > vote[vote_max_idx])
-				vote_max_idx = i;
+	const svm_parameter& param = q->model.param;
+	switch(kernel_type)
+	{
+		case LINEAR:
+			return dot;
+		case POLY:
+			return powi(param.gamma*dot+param.coef0,param.degree);
+		case RBF:
+			return exp(-param.gamma*(dist+x_square));
+		case SIGMOID:
+			return tanh(param.gamma*dot+param.coef0);
+		default:
+			return 0;  // Unreachable
+	}
+}
 
-		free(kvalue);
-		free(start);
-		free(vote);
-		return model->label[vote_max_idx];
+double svm_predict_quantized(const svm_quantized_model *q, const svm_node *x, double *dec_values)
+{
+	const svm_model *model = &q->model;
+	int l = model->l;
+	int i;
+
+	// features beyond dim only add to the RBF distance
+	float *xd = Malloc(float,max(q->dim,1));
+	double x_square = 0;
+	for(i=0;i<q->dim;i++)
+		xd[i] = 0;
+	for(;x->index != -1;x++)
+		if(x->index >= 1 && x->index <= q->dim)
+			xd[x->index-1] = (float)x->value;
+		else
+			x_square += x->value*x->value;
+
+	double *kvalue = Malloc(double,l);
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(guided)
+#endif
+	for(i=0;i<l;i++)
+		kvalue[i] = quantized_kernel(q,xd,x_square,i);
+
+	double pred_result;
+	int svm_type = model->param.svm_type;
+	if(svm_type == ONE_CLASS || svm_type == EPSILON_SVR || svm_type == NU_SVR)
+	{
+		double sum = 0;
+		for(i=0;i<l;i++)
+			sum += model->sv_coef[0][i]*kvalue[i];
+		sum -= model->rho[0];
+		*dec_values = sum;
+		if(svm_type == ONE_CLASS)
+			pred_result = (sum>0)?1:-1;
+		else
+			pred_result = sum;
+	}
+	else
+		pred_result = predict_from_kvalue(model,kvalue,dec_values);
+
+	free(xd);
+	free(kvalue);
+	return pred_result;
+}
+
+svm_quantized_model *svm_quantize_model(const svm_model *model, int quant_type, const svm_problem *ref)
+{
+	if(model->approx_type != APPROX_NONE || model->param.kernel_type == PRECOMPUTED || model->l == 0)
+	{
+		fprintf(stderr,"ERROR: svm_quantize_model needs an exact model with SVs\n");
+		return NULL;
+	}
+	if(quant_type != QUANT_FP16 && quant_type != QUANT_INT8)
+	{
+		fprintf(stderr,"ERROR: unknown quant_type %d\n",quant_type);
+		return NULL;
+	}
+
+	int l = model->l;
+	int i, j, k;
+	int dim = 0;
+	long long nr_nodes = 0;
+	for(i=0;i<l;i++)
+		for(const svm_node *p=model->SV[i];p->index != -1;p++)
+		{
+			if(p->index < 1)
+			{
+				fprintf(stderr,"ERROR: svm_quantize_model needs feature indices >= 1\n");
+				return NULL;
+			}
+			dim = max(dim,p->index);
+			++nr_nodes;
+		}
+
+	svm_quantized_model *q = Malloc(svm_quantized_model,1);
+	q->quant_type = quant_type;
+	q->dim = dim;
+	q->offset = NULL;
+	q->step = NULL;
+
+	// the decision functions, owned by q so model can be freed
+	int svm_type = model->param.svm_type;
+	int nr_class = model->nr_class;
+	bool one_function = svm_type == ONE_CLASS || svm_type == EPSILON_SVR || svm_type == NU_SVR;
+	int nr_f = one_function? 1 : nr_class*(nr_class-1)/2;
+	svm_model *m = &q->model;
+	*m = *model;
+	m->SV = NULL;
+	m->free_sv = 0;
+	m->sv_indices = NULL;
+	m->probA = NULL;
+	m->probB = NULL;
+	m->prob_density_marks = NULL;
+	m->param.probability = 0;
+	m->sv_coef = Malloc(double *,nr_class-1);
+	for(k=0;k<nr_class-1;k++)
+	{
+		m->sv_coef[k] = Malloc(double,l);
+		memcpy(m->sv_coef[k],model->sv_coef[k],sizeof(double)*l);
+	}
+	m->rho = Malloc(double,nr_f);
+	memcpy(m->rho,model->rho,sizeof(double)*nr_f);
+	if(model->label)
+	{
+		m->label = Malloc(int,nr_class);
+		memcpy(m->label,model->label,sizeof(int)*nr_class);
+	}
+	if(model->nSV)
+	{
+		m->nSV = Malloc(int,nr_class);
+		memcpy(m->nSV,model->nSV,sizeof(int)*nr_class);
+	}
+
+	// the dense block, zero for absent features
+	size_t size = (size_t)l*dim;
+	if(quant_type == QUANT_FP16)
+	{
+		Qhalf *data = Malloc(Qhalf,max(size,(size_t)1));
+		for(size_t s=0;s<size;s++)
+			data[s] = 0;
+		for(i=0;i<l;i++)
+			for(const svm_node *p=model->SV[i];p->index != -1;p++)
+				data[(size_t)i*dim+p->index-1] = float_to_fp16((Qfloat)p->value);
+		q->data = data;
+	}
+	else
+	{
+		// per feature, 255 steps from the smallest to the largest value
+		float *lo = Malloc(float,max(dim,1));
+		float *hi = Malloc(float,max(dim,1));
+		for(j=0;j<dim;j++)
+			lo[j] = hi[j] = 0;
+		for(i=0;i<l;i++)
+			for(const svm_node *p=model->SV[i];p->index != -1;p++)
+			{
+				lo[p->index-1] = min(lo[p->index-1],(float)p->value);
+				hi[p->index-1] = max(hi[p->index-1],(float)p->value);
+			}
+		q->offset = lo;
+		q->step = hi;
+		for(j=0;j<dim;j++)
+			q->step[j] = (hi[j] - lo[j])/255;
+
+		unsigned char *data = Malloc(unsigned char,max(size,(size_t)1));
+		for(i=0;i<l;i++)
+		{
+			unsigned char *row = data + (size_t)i*dim;
+			for(j=0;j<dim;j++)
+				row[j] = q->step[j] > 0? (unsigned char)lrint(-q->offset[j]/q->step[j]) : 0;
+			for(const svm_node *p=model->SV[i];p->index != -1;p++)
+			{
+				int c = p->index-1;
+				if(q->step[c] > 0)
+					row[c] = (unsigned char)lrint((p->value-q->offset[c])/q->step[c]);
+			}
+		}
+		q->data = data;
+	}
+
+	// decision values against the exact model
+	int nr_ref = ref? ref->l : l;
+	double *dec_exact = Malloc(double,nr_f);
+	double *dec_quant = Malloc(double,nr_f);
+	double rms = 0, emax = 0;
+	int changed = 0;
+	for(i=0;i<nr_ref;i++)
+	{
+		const svm_node *x = ref? ref->x[i] : model->SV[i];
+		double a = svm_predict_values(model,x,dec_exact);
+		double b = svm_predict_quantized(q,x,dec_quant);
+		if(!one_function || svm_type == ONE_CLASS)
+			changed += a != b;
+		for(k=0;k<nr_f;k++)
+		{
+			double e = dec_quant[k] - dec_exact[k];
+			rms += e*e;
+			emax = max(emax,fabs(e));
+		}
+	}
+	rms = sqrt(rms/max((long long)nr_ref*nr_f,1LL));
+	free(dec_exact);
+	free(dec_quant);
+
+	size_t sparse_size = sizeof(svm_node)*(size_t)(nr_nodes+l);
+	size_t dense_size = size*(quant_type == QUANT_FP16? sizeof(Qhalf) : 1);
+	info("quantized %d SVs x %d features to %s: %.1f MB -> %.1f MB,\n"
+	     "decision value error on %d %s: rms %g, max %g, %d predictions changed\n",
+	     l,dim,quant_type == QUANT_FP16? "fp16" : "int8",
+	     sparse_size/1048576.0,dense_size/1048576.0,
+	     nr_ref,ref? "reference rows" : "SVs",rms,emax,changed);
+	if(dense_size > sparse_size)
+		info("WARNING: the dense block is larger than the sparse SVs\n");
+
+	return q;
+}
+
+void svm_free_quantized_model(svm_quantized_model **q_ptr)
+{
+	if(q_ptr != NULL && *q_ptr != NULL)
+	{
+		svm_quantized_model *q = *q_ptr;
+		svm_free_model_content(&q->model);
+		free(q->data);
+		free(q->offset);
+		free(q->step);
+		free(q);
+		*q_ptr = NULL;
 	}
 }
 
@@ -2879,6 +8296,11 @@ static const char *kernel_type_table[]=
 	"linear","polynomial","rbf","sigmoid","precomputed",NULL
 };
 
+static const char *approx_type_table[]=
+{
+	"none","nystrom","rff",NULL
+};
+
 int svm_save_model(const char *model_file_name, const svm_model *model)
 {
 	FILE *fp = fopen(model_file_name,"w");
@@ -2955,6 +8377,22 @@ int svm_save_model(const char *model_file_name, const svm_model *model)
 		fprintf(fp, "\n");
 	}
 
+	if(model->approx_type != APPROX_NONE)
+	{
+		fprintf(fp, "approx %s\n", approx_type_table[model->approx_type]);
+		fprintf(fp, "approx_dim %d\n", model->approx_dim);
+		if(model->approx_type == APPROX_RFF)
+		{
+			fprintf(fp, "approx_n %d\n", model->approx_n);
+			fprintf(fp, "approx_seed %u\n", model->approx_seed);
+		}
+		fprintf(fp, "approx_w");
+		for(int i=0;i<nr_class*(nr_class-1)/2;i++)
+			for(int j=0;j<model->approx_dim;j++)
+				fprintf(fp," %.17g",model->approx_w[i][j]);
+		fprintf(fp, "\n");
+	}
+
 	fprintf(fp, "SV\n");
 	const double * const *sv_coef = model->sv_coef;
 	const svm_node * const *SV = model->SV;
@@ -2986,6 +8424,8 @@ int svm_save_model(const char *model_file_name, const svm_model *model)
 
 static char *line = NULL;
 static int max_line_len;
+// line and strtok are shared, so models are loaded one at a time
+static std::mutex load_model_lock;
 
 static char* readline(FILE *input)
 {
@@ -3114,6 +8554,43 @@ bool read_model_header(FILE *fp, svm_model* model)
 			for(int i=0;i<n;i++)
 				FSCANF(fp,"%d",&model->nSV[i]);
 		}
+		else if(strcmp(cmd,"approx")==0)
+		{
+			FSCANF(fp,"%80s",cmd);
+			int i;
+			for(i=0;approx_type_table[i];i++)
+			{
+				if(strcmp(approx_type_table[i],cmd)==0)
+				{
+					model->approx_type=i;
+					break;
+				}
+			}
+			if(approx_type_table[i] == NULL)
+			{
+				fprintf(stderr,"unknown kernel approximation.\n");
+				return false;
+			}
+		}
+		else if(strcmp(cmd,"approx_dim")==0)
+			FSCANF(fp,"%d",&model->approx_dim);
+		else if(strcmp(cmd,"approx_n")==0)
+			FSCANF(fp,"%d",&model->approx_n);
+		else if(strcmp(cmd,"approx_seed")==0)
+			FSCANF(fp,"%u",&model->approx_seed);
+		else if(strcmp(cmd,"approx_w")==0)
+		{
+			int n = model->nr_class * (model->nr_class-1)/2;
+			model->approx_w = Malloc(double *,n);
+			for(int i=0;i<n;i++)
+				model->approx_w[i] = NULL;
+			for(int i=0;i<n;i++)
+			{
+				model->approx_w[i] = Malloc(double,model->approx_dim);
+				for(int j=0;j<model->approx_dim;j++)
+					FSCANF(fp,"%lf",&model->approx_w[i][j]);
+			}
+		}
 		else if(strcmp(cmd,"SV")==0)
 		{
 			while(1)
@@ -3136,6 +8613,7 @@ bool read_model_header(FILE *fp, svm_model* model)
 
 svm_model *svm_load_model(const char *model_file_name)
 {
+	std::lock_guard<std::mutex> lock(load_model_lock);
 	FILE *fp = fopen(model_file_name,"rb");
 	if(fp==NULL) return NULL;
 
@@ -3155,6 +8633,10 @@ svm_model *svm_load_model(const char *model_file_name)
 	model->sv_indices = NULL;
 	model->label = NULL;
 	model->nSV = NULL;
+	model->approx_type = APPROX_NONE;
+	model->approx_dim = 0;
+	model->approx_w = NULL;
+	model->approx_omega = NULL;
 
 	// read header
 	if (!read_model_header(fp, model))
@@ -3165,6 +8647,12 @@ svm_model *svm_load_model(const char *model_file_name)
 		free(model->rho);
 		free(model->label);
 		free(model->nSV);
+		if(model->approx_w)
+		{
+			for(int i=0;i<model->nr_class*(model->nr_class-1)/2;i++)
+				free(model->approx_w[i]);
+			free(model->approx_w);
+		}
 		free(model);
 		return NULL;
 	}
@@ -3240,6 +8728,9 @@ svm_model *svm_load_model(const char *model_file_name)
 		return NULL;
 
 	model->free_sv = 1;	// XXX
+	model->converged = 1;
+	if(model->approx_type == APPROX_RFF)
+		model->approx_omega = rff_frequencies(model->approx_seed,model->param.gamma,model->approx_n,model->approx_dim);
 	return model;
 }
 
@@ -3279,6 +8770,17 @@ void svm_free_model_content(svm_model* model_ptr)
 
 	free(model_ptr->nSV);
 	model_ptr->nSV = NULL;
+
+	if(model_ptr->approx_w)
+	{
+		for(int i=0;i<model_ptr->nr_class*(model_ptr->nr_class-1)/2;i++)
+			free(model_ptr->approx_w[i]);
+		free(model_ptr->approx_w);
+		model_ptr->approx_w = NULL;
+	}
+
+	free(model_ptr->approx_omega);
+	model_ptr->approx_omega = NULL;
 }
 
 void svm_free_and_destroy_model(svm_model** model_ptr_ptr)
@@ -3326,11 +8828,36 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 	if(kernel_type == POLY && param->degree < 0)
 		return "degree of polynomial kernel < 0";
 
+	if(param->kernel_file != NULL)
+	{
+		if(kernel_type != PRECOMPUTED)
+			return "kernel_file needs the precomputed kernel type";
+
+		mapped_file m;
+		int n = map_kernel_matrix(param->kernel_file,&m);
+		if(n < 0)
+			return "cannot map kernel_file";
+		unmap_file(&m);
+
+		// rows are addressed by serial number, as for PRECOMPUTED
+		for(int i=0;i<prob->l;i++)
+		{
+			double v = prob->x[i][0].value;
+			if(prob->x[i][0].index != 0 || v < 1 || v > n || v != (int)v)
+				return "x[i][0] is not a serial number in kernel_file";
+		}
+	}
+
 	// cache_size,eps,C,nu,p,shrinking
 
 	if(param->cache_size <= 0)
 		return "cache_size <= 0";
 
+	if(param->cache_type != CACHE_FLOAT &&
+	   param->cache_type != CACHE_FP16 &&
+	   param->cache_type != CACHE_BF16)
+		return "unknown cache type";
+
 	if(param->eps <= 0)
 		return "eps <= 0";
 
@@ -3358,6 +8885,62 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 	   param->probability != 1)
 		return "probability != 0 and probability != 1";
 
+	if(param->progress_interval < 0)
+		return "progress_interval < 0";
+
+	if(param->checkpoint_file != NULL && param->checkpoint_interval < 0)
+		return "checkpoint_interval < 0";
+
+	if(param->prefetch_threads < 0)
+		return "prefetch_threads < 0";
+
+	if(param->working_set_size < 0)
+		return "working_set_size < 0";
+
+	if(param->numa_policy != NUMA_DEFAULT &&
+	   param->numa_policy != NUMA_INTERLEAVE)
+		return "unknown NUMA policy";
+
+	if(param->huge_pages != 0 &&
+	   param->huge_pages != 1)
+		return "huge_pages != 0 and huge_pages != 1";
+
+	if(param->cascade_parts > 1)
+	{
+		if(svm_type != C_SVC)
+			return "cascade training needs C_SVC";
+		if(param->approx_type != APPROX_NONE)
+			return "cascade training cannot be combined with kernel approximation";
+	}
+
+	if(param->approx_type != APPROX_NONE)
+	{
+		if(param->approx_type != APPROX_NYSTROM &&
+		   param->approx_type != APPROX_RFF)
+			return "unknown kernel approximation";
+		if(svm_type != C_SVC)
+			return "kernel approximation needs C_SVC";
+		if(kernel_type == PRECOMPUTED)
+			return "kernel approximation needs a kernel function";
+		if(param->approx_type == APPROX_RFF && kernel_type != RBF)
+			return "random Fourier features need the RBF kernel";
+		if(param->approx_dim <= 0)
+			return "approx_dim <= 0";
+		if(param->landmark_type != LANDMARK_RANDOM &&
+		   param->landmark_type != LANDMARK_KMEANS)
+			return "unknown landmark type";
+		if(param->probability)
+			return "kernel approximation does not support probability estimates";
+		if(param->checkpoint_file != NULL)
+			return "kernel approximation does not support checkpoints";
+	}
+
+	if(prob->W != NULL)
+	{
+		for(int i=0;i<prob->l;i++)
+			if(!(prob->W[i] >= 0))
+				return "instance weight < 0";
+	}
 
 	// check whether nu-svc is feasible
 
@@ -3367,17 +8950,18 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 		int max_nr_class = 16;
 		int nr_class = 0;
 		int *label = Malloc(int,max_nr_class);
-		int *count = Malloc(int,max_nr_class);
+		double *count = Malloc(double,max_nr_class);	// weight of each class
 
 		int i;
 		for(i=0;i<l;i++)
 		{
 			int this_label = (int)prob->y[i];
+			double w = prob->W? prob->W[i] : 1;
 			int j;
 			for(j=0;j<nr_class;j++)
 				if(this_label == label[j])
 				{
-					++count[j];
+					count[j] += w;
 					break;
 				}
 			if(j == nr_class)
@@ -3386,20 +8970,20 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 				{
 					max_nr_class *= 2;
 					label = (int *)realloc(label,max_nr_class*sizeof(int));
-					count = (int *)realloc(count,max_nr_class*sizeof(int));
+					count = (double *)realloc(count,max_nr_class*sizeof(double));
 				}
 				label[nr_class] = this_label;
-				count[nr_class] = 1;
+				count[nr_class] = w;
 				++nr_class;
 			}
 		}
 
 		for(i=0;i<nr_class;i++)
 		{
-			int n1 = count[i];
+			double n1 = count[i];
 			for(int j=i+1;j<nr_class;j++)
 			{
-				int n2 = count[j];
+				double n2 = count[j];
 				if(param->nu*(n1+n2)/2 > min(n1,n2))
 				{
 					free(label);
@@ -20,11 +20,26 @@ struct svm_problem
 	int l;
 	double *y;
 	struct svm_node **x;
+	double *W;	/* instance weights >= 0 scaling C, or nu's count of each instance; NULL for all 1; rows of weight 0 are left out */
 };
 
 enum { C_SVC, NU_SVC, ONE_CLASS, EPSILON_SVR, NU_SVR };	/* svm_type */
 enum { LINEAR, POLY, RBF, SIGMOID, PRECOMPUTED }; /* kernel_type */
+enum { CACHE_FLOAT, CACHE_FP16, CACHE_BF16 };	/* cache_type */
+enum { APPROX_NONE, APPROX_NYSTROM, APPROX_RFF };	/* approx_type */
+enum { LANDMARK_RANDOM, LANDMARK_KMEANS };	/* landmark_type */
+enum { QUANT_FP16, QUANT_INT8 };	/* quant_type */
+enum { NUMA_DEFAULT, NUMA_INTERLEAVE };	/* numa_policy */
 
+struct svm_progress
+{
+	int iter;		/* SMO iterations of the current sub-problem */
+	double violation;	/* maximal violation Gmax+Gmax2 of the last working set selection */
+	double obj;		/* estimate of the current objective value */
+	int active_size;	/* #variables not shrunk */
+	int l;			/* #variables of the current sub-problem */
+	double elapsed;		/* seconds since svm_train was called */
+};
 struct svm_parameter
 {
 	int svm_type;
@@ -35,6 +50,8 @@ struct svm_parameter
 
 	/* these are for training only */
 	double cache_size; /* in MB */
+	int cache_type;	/* storage of cached kernel values, 16-bit types hold twice as many */
+	const char *kernel_file;	/* for PRECOMPUTED: matrix from svm_precompute_kernel, NULL to read it from x */
 	double eps;	/* stopping criteria */
 	double C;	/* for C_SVC, EPSILON_SVR and NU_SVR */
 	int nr_weight;		/* for C_SVC */
@@ -44,6 +61,58 @@ struct svm_parameter
 	double p;	/* for EPSILON_SVR */
 	int shrinking;	/* use the shrinking heuristics */
 	int probability; /* do probability estimates */
+
+	/* progress reporting and time budget, training only */
+	int (*progress_func)(const struct svm_progress *, void *);	/* return nonzero to cancel training */
+	void *progress_arg;	/* passed back to progress_func */
+	int progress_interval;	/* #iterations between progress_func calls, 0 for default */
+	double max_train_time;	/* wall-clock budget in seconds, <= 0 for none */
+
+	/* checkpointing, training only */
+	const char *checkpoint_file;	/* solver state is saved here, NULL for none */
+	double checkpoint_interval;	/* seconds between checkpoints */
+
+	/* low-rank kernel approximation, C_SVC only: a linear SVM is trained on an */
+	/* approx_dim-dimensional feature map, so training and prediction are linear in #data; */
+	/* mapped rows are kept up to cache_size and the others mapped again when used */
+	int approx_type;	/* APPROX_NONE for the exact kernel */
+	int approx_dim;		/* #landmarks for APPROX_NYSTROM, #random features for APPROX_RFF */
+	int landmark_type;	/* LANDMARK_RANDOM or LANDMARK_KMEANS */
+	unsigned int seed;	/* for landmarks, random features and the solver */
+
+	/* cascade SVM, C_SVC only: parts are solved in parallel and their SVs merged */
+	int cascade_parts;	/* #parts of the first layer, <= 1 for one solve over all data */
+
+	/* identical rows with the same label are trained as one instance whose */
+	/* weight is the sum of theirs, which gives the same solution */
+	int merge_duplicates;
+
+	int max_iter;	/* solver iterations per sub-problem, <= 0 for the default limit */
+	int sv_budget;	/* svm_update: most SVs kept, <= 0 for no limit */
+
+	/* kernel rows copied to separate index and value arrays (CSR); a column is */
+	/* computed by scattering one row and gathering the others, same results */
+	int sparse_csr;
+
+	/* helper threads computing the kernel columns the solver will likely */
+	/* need next, while it works on the current ones; 0 for none */
+	int prefetch_threads;
+
+	/* > 2: variables optimized together per solver pass; their sub-problem */
+	/* is solved by SMO and the gradient updated on all threads, which */
+	/* scales on many cores; ignored by NU_SVC and NU_SVR; the block's */
+	/* kernel columns, working_set_size*l floats, come out of cache_size */
+	int working_set_size;
+
+	/* placement of the kernel cache and of the kernel's CSR copy of the rows */
+	/* on multi-socket hosts: NUMA_INTERLEAVE spreads their pages over all */
+	/* memory nodes (Linux), NUMA_DEFAULT leaves them where first touched */
+	int numa_policy;
+
+	/* back the kernel cache and the kernel's CSR copy of the rows with 2 MB */
+	/* pages: explicit ones if reserved, else transparent ones, else normal */
+	/* pages (Linux); fewer TLB misses with caches of several GB */
+	int huge_pages;
 };
 
 //
@@ -70,11 +139,39 @@ struct svm_model
 	/* XXX */
 	int free_sv;		/* 1 if svm_model is created by svm_load_model*/
 				/* 0 if svm_model is created by svm_train */
+
+	int converged;		/* 0 if training was cancelled, ran out of time or hit max_iter */
+
+	/* for kernel approximations, sv_coef is unused and SV holds the Nystrom landmarks */
+	int approx_type;	/* APPROX_NONE for an exact model */
+	int approx_dim;		/* dimension of the feature map */
+	double **approx_w;	/* weights of the decision functions (approx_w[k*(k-1)/2][approx_dim]) */
+	int approx_n;		/* RFF: features with index < approx_n are used */
+	unsigned int approx_seed;	/* RFF: seed of the random features */
+	double *approx_omega;	/* RFF: random features, regenerated from approx_seed */
 };
 
 struct svm_model *svm_train(const struct svm_problem *prob, const struct svm_parameter *param);
+/* continues from param->checkpoint_file, NULL if it was taken for other data or parameters */
+struct svm_model *svm_train_resume(const struct svm_problem *prob, const struct svm_parameter *param);
+/* C_SVC: a new model from the SVs of model and the rows of batch, solved from */
+/* the model's alphas; the new model owns its SVs, NULL on mismatched parameters */
+struct svm_model *svm_update(const struct svm_model *model, const struct svm_problem *batch, const struct svm_parameter *param);
+/* a model with at most target_sv SVs (<= 0 for no limit), fewer once its decision values */
+/* on the rows of ref, e.g. the training data, are within tolerance; the new model owns its SVs */
+struct svm_model *svm_compress_model(const struct svm_model *model, const struct svm_problem *ref, int target_sv, double tolerance);
 void svm_cross_validation(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, double *target);
 
+int svm_precompute_kernel(const char *kernel_file_name, const struct svm_problem *prob, const struct svm_parameter *param);
+
+/* on-disk dataset for training on data larger than memory: rows are written */
+/* one at a time, then mapped; the returned problem is freed by svm_unmap_dataset */
+struct svm_dataset_writer *svm_dataset_create(const char *dataset_file_name);
+int svm_dataset_add(struct svm_dataset_writer *writer, double y, const struct svm_node *x);
+int svm_dataset_close(struct svm_dataset_writer *writer);
+struct svm_problem *svm_map_dataset(const char *dataset_file_name);
+void svm_unmap_dataset(struct svm_problem *prob);
+
 int svm_save_model(const char *model_file_name, const struct svm_model *model);
 struct svm_model *svm_load_model(const char *model_file_name);
 
@@ -87,8 +184,17 @@ double svm_get_svr_probability(const struct svm_model *model);
 
 double svm_predict_values(const struct svm_model *model, const struct svm_node *x, double* dec_values);
 double svm_predict(const struct svm_model *model, const struct svm_node *x);
+/* pred[i] = svm_predict(model,x[i]) for n rows, faster than one row at a time */
+void svm_predict_batch(const struct svm_model *model, const struct svm_node *const *x, int n, double *pred);
 double svm_predict_probability(const struct svm_model *model, const struct svm_node *x, double* prob_estimates);
 
+/* SVs of a model stored densely as fp16, or as int8 codes with a per-feature scale, for */
+/* faster prediction; the decision value error on ref (the SVs if NULL) is reported and */
+/* the quantized model does not depend on model */
+struct svm_quantized_model *svm_quantize_model(const struct svm_model *model, int quant_type, const struct svm_problem *ref);
+double svm_predict_quantized(const struct svm_quantized_model *qmodel, const struct svm_node *x, double* dec_values);
+void svm_free_quantized_model(struct svm_quantized_model **qmodel_ptr_ptr);
+
 void svm_free_model_content(struct svm_model *model_ptr);
 void svm_free_and_destroy_model(struct svm_model **model_ptr_ptr);
 void svm_destroy_param(struct svm_parameter *param);
@@ -0,0 +1,126 @@
+/*
+ * Regression test: a solve stopped by max_train_time resumes from its checkpoint
+ *
+ * A three-class problem runs out of its time budget at the first check and
+ * leaves a checkpoint. svm_train_resume must finish it into the model of an
+ * uninterrupted run, and refuse the checkpoint for other parameters or data.
+ */
+
+#include "../svm2.h"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static void quiet(const char*) {}
+
+static const char* checkpointFile = "checkpoint_resume.ckpt";
+
+//three gaussian classes, row i has label i % 3
+static std::vector<svm_node*> makeRows(int n, int d, unsigned seed, std::vector<double>& y) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<svm_node*> x;
+    for (int i = 0; i < n; i++) {
+        svm_node* row = new svm_node[d + 1];
+        for (int j = 0; j < d; j++) {
+            row[j].index = j + 1;
+            row[j].value = normal(rng) + (j % 3 == i % 3 ? 1.0 : 0.0);
+        }
+        row[d].index = -1;
+        x.push_back(row);
+        y.push_back(i % 3);
+    }
+    return x;
+}
+
+static bool sameModel(const svm_model* a, const svm_model* b) {
+    if (a->nr_class != b->nr_class || a->l != b->l) {
+        return false;
+    }
+    int nrPairs = a->nr_class * (a->nr_class - 1) / 2;
+    for (int p = 0; p < nrPairs; p++) {
+        if (a->rho[p] != b->rho[p]) {
+            return false;
+        }
+    }
+    for (int k = 0; k < a->nr_class - 1; k++) {
+        for (int i = 0; i < a->l; i++) {
+            if (a->sv_coef[k][i] != b->sv_coef[k][i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//the checkpoint must not be resumed by another problem
+static bool refused(const svm_problem& prob, const svm_parameter& param, const char* name) {
+    svm_model* model = svm_train_resume(&prob, &param);
+    bool ok = model == nullptr;
+    printf("resume with %s: %s\n", name, ok ? "refused, ok" : "accepted, FAILED");
+    if (model != nullptr) {
+        svm_free_and_destroy_model(&model);
+    }
+    return ok;
+}
+
+int main() {
+    svm_set_print_string_function(quiet);
+
+    std::vector<double> y;
+    std::vector<svm_node*> x = makeRows(600, 6, 5, y);
+    svm_problem prob = {(int)x.size(), y.data(), x.data(), nullptr};
+
+    svm_parameter param = {};
+    param.svm_type = C_SVC;
+    param.kernel_type = RBF;
+    param.gamma = 0.2;
+    param.C = 10;
+    param.eps = 1e-3;
+    param.shrinking = 1;
+    param.cache_size = 100;
+
+    svm_model* full = svm_train(&prob, &param);
+
+    //any budget is used up by the first check, 20 iterations in
+    param.checkpoint_file = checkpointFile;
+    param.checkpoint_interval = 1000;
+    param.progress_interval = 20;
+    param.max_train_time = 1e-9;
+    svm_model* stopped = svm_train(&prob, &param);
+    bool interrupted = !stopped->converged;
+    printf("interrupted run: converged %d: %s\n", stopped->converged, interrupted ? "ok" : "FAILED");
+    svm_free_and_destroy_model(&stopped);
+
+    param.max_train_time = 0;
+    svm_parameter otherC = param;
+    otherC.C = 1;
+    svm_parameter otherGamma = param;
+    otherGamma.gamma = 0.5;
+    bool ok = refused(prob, otherC, "another C");
+    ok = refused(prob, otherGamma, "another gamma") && ok;
+
+    y[7] = 0;
+    ok = refused(prob, param, "another label") && ok;
+    y[7] = 1;
+    double value = x[11][2].value;
+    x[11][2].value = value + 1;
+    ok = refused(prob, param, "another row") && ok;
+    x[11][2].value = value;
+
+    svm_model* resumed = svm_train_resume(&prob, &param);
+    bool same = resumed != nullptr && resumed->converged && sameModel(full, resumed);
+    printf("resumed run: %s\n", same ? "same model, ok" : "FAILED");
+    ok = ok && interrupted && same;
+
+    if (resumed != nullptr) {
+        svm_free_and_destroy_model(&resumed);
+    }
+    svm_free_and_destroy_model(&full);
+    remove(checkpointFile);
+    for (svm_node* row : x) {
+        delete[] row;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+/*
+ * Regression test: CSR kernel rows give the results of the svm_node rows
+ *
+ * The same problems are trained with sparse_csr off and on. The column
+ * fills gather the products of dot() in its order, so the decision values
+ * must be identical. One problem has hashed feature indices near INT_MAX,
+ * too wide to scatter, which must fall back to the svm_node rows.
+ */
+
+#include "../svm2.h"
+#include <climits>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static void quiet(const char*) {}
+
+//two gaussian classes with d features each, row i has label i % 2;
+//feature j gets index indexBase + j * indexStep
+static std::vector<svm_node*> makeRows(int n, int d, int indexBase, int indexStep,
+                                       unsigned seed, std::vector<double>& y) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<svm_node*> x;
+    for (int i = 0; i < n; i++) {
+        svm_node* row = new svm_node[d + 1];
+        for (int j = 0; j < d; j++) {
+            row[j].index = indexBase + j * indexStep;
+            row[j].value = normal(rng) + (j % 2 == i % 2 ? 1.5 : 0.0);
+        }
+        row[d].index = -1;
+        x.push_back(row);
+        y.push_back(i % 2);
+    }
+    return x;
+}
+
+static bool check(int kernelType, int indexBase, int indexStep, const char* name) {
+    std::vector<double> y, yTest;
+    std::vector<svm_node*> x = makeRows(300, 6, indexBase, indexStep, 7, y);
+    std::vector<svm_node*> xTest = makeRows(200, 6, indexBase, indexStep, 9, yTest);
+
+    svm_parameter param = {};
+    param.svm_type = C_SVC;
+    param.kernel_type = kernelType;
+    param.degree = 3;
+    param.gamma = 0.1;
+    param.coef0 = 1;
+    param.C = 1;
+    param.eps = 1e-3;
+    param.shrinking = 1;
+    param.cache_size = 100;
+
+    svm_problem prob = {(int)x.size(), y.data(), x.data(), nullptr};
+
+    svm_model* nodeModel = svm_train(&prob, &param);
+    param.sparse_csr = 1;
+    svm_model* csrModel = svm_train(&prob, &param);
+
+    int nrDiff = nodeModel->l != csrModel->l || nodeModel->rho[0] != csrModel->rho[0];
+    for (svm_node* row : xTest) {
+        double a, b;
+        svm_predict_values(nodeModel, row, &a);
+        svm_predict_values(csrModel, row, &b);
+        nrDiff += a != b;
+    }
+
+    bool ok = nrDiff == 0;
+    printf("%s: %d SVs, %d differences: %s\n", name, csrModel->l, nrDiff, ok ? "ok" : "FAILED");
+
+    svm_free_and_destroy_model(&nodeModel);
+    svm_free_and_destroy_model(&csrModel);
+    for (svm_node* row : x) {
+        delete[] row;
+    }
+    for (svm_node* row : xTest) {
+        delete[] row;
+    }
+    return ok;
+}
+
+int main() {
+    svm_set_print_string_function(quiet);
+
+    bool ok = check(RBF, 1, 1, "rbf");
+    ok = check(LINEAR, 1, 1, "linear") && ok;
+    ok = check(POLY, 1, 1, "poly") && ok;
+    ok = check(SIGMOID, 1, 1, "sigmoid") && ok;
+    ok = check(RBF, 1000, 9973, "rbf, spread indices") && ok;
+    ok = check(RBF, INT_MAX - 5, 1, "rbf, hashed indices") && ok;
+
+    return ok ? 0 : 1;
+}
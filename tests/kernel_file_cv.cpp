@@ -0,0 +1,144 @@
+/*
+ * Regression test: cross validation and probability training over a kernel file
+ *
+ * The rows of a kernel_file problem are 0:serial alone. Cross validation
+ * predicts them, and so do the folds of the probability estimates; they
+ * must give the results of the same kernel matrix passed as ordinary
+ * precomputed rows, instead of reading past the serial node.
+ */
+
+#include "../svm2.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static void quiet(const char*) {}
+
+static const char* kernelFile = "kernel_file_cv.kmat";
+
+//two gaussian classes, row i has label i % 2
+static std::vector<svm_node*> makeRows(int n, int d, unsigned seed, std::vector<double>& y) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<svm_node*> x;
+    for (int i = 0; i < n; i++) {
+        svm_node* row = new svm_node[d + 1];
+        for (int j = 0; j < d; j++) {
+            row[j].index = j + 1;
+            row[j].value = normal(rng) + (j % 2 == i % 2 ? 1.0 : 0.0);
+        }
+        row[d].index = -1;
+        x.push_back(row);
+        y.push_back(i % 2);
+    }
+    return x;
+}
+
+//exp(-gamma |a - b|^2) summed in index order, as svm_precompute_kernel does
+static double rbf(const svm_node* a, const svm_node* b, double gamma) {
+    double sum = 0;
+    for (; a->index != -1; a++, b++) {
+        double d = a->value - b->value;
+        sum += d * d;
+    }
+    return std::exp(-gamma * sum);
+}
+
+static bool check(int svmType, int probability, const char* name,
+                  const svm_problem& fileProb, const svm_problem& rowProb) {
+    svm_parameter param = {};
+    param.svm_type = svmType;
+    param.kernel_type = PRECOMPUTED;
+    param.C = 1;
+    param.nu = 0.5;
+    param.p = 0.1;
+    param.eps = 1e-3;
+    param.shrinking = 1;
+    param.cache_size = 100;
+    param.probability = probability;
+
+    int l = fileProb.l;
+    std::vector<double> fileTarget(l), rowTarget(l);
+
+    //the same seed gives the same folds
+    srand(1);
+    svm_cross_validation(&rowProb, &param, 5, rowTarget.data());
+    param.kernel_file = kernelFile;
+    srand(1);
+    svm_cross_validation(&fileProb, &param, 5, fileTarget.data());
+
+    int nrDiff = 0;
+    for (int i = 0; i < l; i++) {
+        nrDiff += !(std::fabs(fileTarget[i] - rowTarget[i]) <= 1e-6 * (1 + std::fabs(rowTarget[i])));
+    }
+
+    //the probability model of the whole problem predicts the training rows too
+    svm_model* model = svm_train(&fileProb, &param);
+    bool trained = model != nullptr;
+    if (trained) {
+        svm_free_and_destroy_model(&model);
+    }
+
+    bool ok = nrDiff == 0 && trained;
+    printf("%s: %d of %d targets differ, trained %d: %s\n", name, nrDiff, l, trained, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main() {
+    svm_set_print_string_function(quiet);
+
+    int l = 150;
+    std::vector<double> y, yReal;
+    std::vector<svm_node*> x = makeRows(l, 4, 3, y);
+    for (int i = 0; i < l; i++) {
+        yReal.push_back(y[i] + 0.3 * x[i][0].value);
+    }
+
+    svm_parameter rbfParam = {};
+    rbfParam.kernel_type = RBF;
+    rbfParam.gamma = 0.25;
+    svm_problem prob = {l, y.data(), x.data(), nullptr};
+    if (svm_precompute_kernel(kernelFile, &prob, &rbfParam) != 0) {
+        printf("cannot write %s: FAILED\n", kernelFile);
+        return 1;
+    }
+
+    //the file holds floats, the precomputed rows get the same values
+    std::vector<svm_node*> serialRows, kernelRows;
+    for (int i = 0; i < l; i++) {
+        svm_node* serial = new svm_node[2];
+        serial[0] = {0, (double)(i + 1)};
+        serial[1] = {-1, 0};
+        serialRows.push_back(serial);
+
+        svm_node* row = new svm_node[l + 2];
+        row[0] = {0, (double)(i + 1)};
+        for (int j = 0; j < l; j++) {
+            row[j + 1] = {j + 1, (double)(float)rbf(x[i], x[j], rbfParam.gamma)};
+        }
+        row[l + 1] = {-1, 0};
+        kernelRows.push_back(row);
+    }
+
+    svm_problem fileProb = {l, y.data(), serialRows.data(), nullptr};
+    svm_problem rowProb = {l, y.data(), kernelRows.data(), nullptr};
+    svm_problem fileReal = {l, yReal.data(), serialRows.data(), nullptr};
+    svm_problem rowReal = {l, yReal.data(), kernelRows.data(), nullptr};
+
+    bool ok = check(C_SVC, 0, "c-svc", fileProb, rowProb);
+    ok = check(NU_SVC, 0, "nu-svc", fileProb, rowProb) && ok;
+    ok = check(C_SVC, 1, "c-svc probability", fileProb, rowProb) && ok;
+    ok = check(ONE_CLASS, 1, "one-class probability", fileProb, rowProb) && ok;
+    ok = check(EPSILON_SVR, 1, "epsilon-svr probability", fileReal, rowReal) && ok;
+
+    remove(kernelFile);
+    for (int i = 0; i < l; i++) {
+        delete[] x[i];
+        delete[] serialRows[i];
+        delete[] kernelRows[i];
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+/*
+ * Regression test: rows of instance weight 0 are left out of training
+ *
+ * Every 5th row of a two-class problem gets W = 0. Training must converge
+ * and give the decision values of a model trained without those rows,
+ * with the SMO solver (RBF) and with dual coordinate descent (LINEAR).
+ */
+
+#include "../svm2.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static void quiet(const char*) {}
+
+//two gaussian classes, row i has label i % 2
+static std::vector<svm_node*> makeRows(int n, int d, unsigned seed, std::vector<double>& y) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<svm_node*> x;
+    for (int i = 0; i < n; i++) {
+        svm_node* row = new svm_node[d + 1];
+        for (int j = 0; j < d; j++) {
+            row[j].index = j + 1;
+            row[j].value = normal(rng) + (j % 2 == i % 2 ? 1.5 : 0.0);
+        }
+        row[d].index = -1;
+        x.push_back(row);
+        y.push_back(i % 2);
+    }
+    return x;
+}
+
+static bool check(int kernelType, const char* name) {
+    std::vector<double> y, yTest;
+    std::vector<svm_node*> x = makeRows(200, 5, 7, y);
+    std::vector<svm_node*> xTest = makeRows(300, 5, 9, yTest);
+
+    std::vector<double> W(x.size(), 1.0);
+    std::vector<svm_node*> xKept;
+    std::vector<double> yKept;
+    for (size_t i = 0; i < x.size(); i++) {
+        if (i % 5 == 0) {
+            W[i] = 0;
+        } else {
+            xKept.push_back(x[i]);
+            yKept.push_back(y[i]);
+        }
+    }
+
+    svm_parameter param = {};
+    param.svm_type = C_SVC;
+    param.kernel_type = kernelType;
+    param.gamma = 0.1;
+    param.C = 1;
+    param.eps = 1e-3;
+    param.shrinking = 1;
+    param.cache_size = 100;
+    param.max_iter = 1000000;   //fail fast instead of spinning to the default limit
+
+    svm_problem weighted = {(int)x.size(), y.data(), x.data(), W.data()};
+    svm_problem kept = {(int)xKept.size(), yKept.data(), xKept.data(), nullptr};
+
+    svm_model* weightedModel = svm_train(&weighted, &param);
+    svm_model* keptModel = svm_train(&kept, &param);
+
+    //the first label of each model decides the sign of its decision values
+    double sign = weightedModel->label[0] == keptModel->label[0] ? 1 : -1;
+    double maxDiff = 0;
+    for (svm_node* row : xTest) {
+        double a, b;
+        svm_predict_values(weightedModel, row, &a);
+        svm_predict_values(keptModel, row, &b);
+        maxDiff = std::max(maxDiff, std::fabs(a - sign * b));
+    }
+
+    bool ok = weightedModel->converged && maxDiff < 0.05;
+    printf("%s: converged %d, max decision value difference %g: %s\n",
+           name, weightedModel->converged, maxDiff, ok ? "ok" : "FAILED");
+
+    svm_free_and_destroy_model(&weightedModel);
+    svm_free_and_destroy_model(&keptModel);
+    for (svm_node* row : x) {
+        delete[] row;
+    }
+    for (svm_node* row : xTest) {
+        delete[] row;
+    }
+    return ok;
+}
+
+int main() {
+    svm_set_print_string_function(quiet);
+
+    bool ok = check(RBF, "rbf");
+    ok = check(LINEAR, "linear") && ok;
+
+    return ok ? 0 : 1;
+}
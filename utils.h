@@ -5,8 +5,19 @@
 #include <QList>
 #include <QFile>
 #include <QTextStream>
-#include <svm.h>
+#include "svm2.h"
 #include <variant>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 void printNode(svm_node* node);
 
@@ -22,6 +33,15 @@ std::variant<std::vector<svm_node*>, std::vector<double>> getData(std::variant<Q
 //function to return a prediction over the entire dataset
 std::vector<double> predict(const svm_model* model, const std::vector<svm_node*>& X);
 
+//function to score a feature csv chunk by chunk into an output csv, returns the number of rows or -1
+qint64 predictCSV(const svm_model* model, const QString& inFilename, const QString& outFilename, int chunkSize = 4096, int numWorkers = 0);
+
+//confusion matrix and per-class metrics, built chunk by chunk
+class ConfusionMatrix;
+
+//function to evaluate a predictions csv against a labels csv chunk by chunk, returns the number of rows or -1
+qint64 evaluateCSV(const QString& yTrueFilename, const QString& yPredFilename, ConfusionMatrix& matrix, int chunkSize = 1 << 20);
+
 void classificationReport(const std::vector<double>& yTrue, const std::vector<double>& yPred, QTextStream& stream);
 
 /*
@@ -260,47 +280,548 @@ std::vector<double> predict(const svm_model* model, const std::vector<svm_node*>
     return predictions;
 }
 
-//function to compute the performance metrics
-void classificationReport(const std::vector<double>& yTrue, const std::vector<double>& yPred, QTextStream& stream) {
+/*
+ * Queue between two stages of a pipeline
+ * push blocks while the queue is full and pop while it is empty,
+ * pop returns false once the queue is closed and drained
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
 
-    //initialize variables to compute
-    double TP = 0.0;
-    double FP = 0.0;
-    double TN = 0.0;
-    double FN = 0.0;
-
-    for (int i = 0; i < yTrue.size(); i++) {
-        // if predicted true
-        if (yPred[i] == 1 && yTrue[i] == 1) {
-            TP += 1.0; //True positive
-        } else if (yPred[i] == 1 && yTrue[i] == 0) {
-            FP += 1.0; //False positive
-        } else if (yPred[i] == 0 && yTrue[i] == 1) {
-            FN += 1.0; //False negative
-        } else if (yPred[i] == 0 && yTrue[i] == 0) {
-            TN += 1.0; //True negative
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
         }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    //no more items will be pushed
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+//a chunk of csv lines and, once scored, their predictions
+struct ScoringChunk {
+    qint64 seq = 0;
+    QStringList lines;
+    std::vector<double> predictions;
+};
+
+/*
+ * Function to score a feature csv without loading it
+ * A reader thread reads chunks of lines, worker threads parse and predict them
+ * Each worker scores its chunk with one svm_predict_batch call on a single thread,
+ * the workers already use all cores
+ * and the calling thread writes the predictions in input order, one per line
+ * At most 2 * numWorkers chunks are in flight, so memory does not grow with the file
+ * Rows are parsed like getData, the first line is the header
+ */
+qint64 predictCSV(const svm_model* model, const QString& inFilename, const QString& outFilename, int chunkSize, int numWorkers) {
+
+    //open the input and output files
+    QFile inFile(inFilename);
+    QFile outFile(outFilename);
+
+    if (!inFile.open(QIODevice::ReadOnly)) {
+        qInfo() << "Unable to open the file!";
+        return -1;
     }
 
-    double N = (double)yTrue.size();
+    if (!outFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qInfo() << "Unable to open the output file!";
+        return -1;
+    }
 
-    //compute accuracy
-    double accuracy = (TP + TN) / N;
+    if (numWorkers <= 0) {
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-    //compute recall
-    double precision = TP / (TP + FP);
+    int maxInFlight = 2 * numWorkers;
 
-    //compute recall
-    double recall = TP / (TP + FN);
+    //queues between the reader, the workers and the writer
+    BoundedQueue<ScoringChunk> rawChunks(maxInFlight);
+    BoundedQueue<ScoringChunk> scoredChunks(maxInFlight);
 
-    stream.setRealNumberPrecision(2);
+    //chunks read but not yet written, the reader waits for the writer
+    std::mutex flightMutex;
+    std::condition_variable flightDone;
+    int inFlight = 0;
 
-    stream << "Accuracy: " << accuracy << Qt::endl;
-    stream << "Precision: " << precision << Qt::endl;
-    stream << "Recall: " << recall << Qt::endl;
+    std::thread reader([&] {
 
-    stream.flush();
+        QTextStream stream(&inFile);
+
+        //skip the header
+        stream.readLine();
+
+        qint64 seq = 0;
+
+        while (!stream.atEnd()) {
+
+            ScoringChunk chunk;
+            chunk.seq = seq++;
+            chunk.lines.reserve(chunkSize);
+
+            //read the next chunk of lines
+            QString line;
+            while (chunk.lines.size() < chunkSize && stream.readLineInto(&line)) {
+                if (!line.isEmpty()) {
+                    chunk.lines.append(line);
+                }
+            }
+
+            //wait for a free slot
+            {
+                std::unique_lock<std::mutex> lock(flightMutex);
+                flightDone.wait(lock, [&] { return inFlight < maxInFlight; });
+                inFlight++;
+            }
+
+            rawChunks.push(std::move(chunk));
+        }
+
+        rawChunks.close();
+    });
+
+    std::vector<std::thread> workers;
+    std::mutex workersMutex;
+    int workersLeft = numWorkers;
+
+    for (int w = 0; w < numWorkers; w++) {
+        workers.emplace_back([&] {
+
+#ifdef _OPENMP
+            //no OpenMP team per worker, numWorkers x cores threads would fight for the cores
+            omp_set_num_threads(1);
+#endif
+
+            ScoringChunk chunk;
+
+            //storage of the nodes, reused across chunks
+            std::vector<svm_node> nodes;
+            std::vector<size_t> rowStart;
+            std::vector<const svm_node*> rows;
+
+            while (rawChunks.pop(chunk)) {
+
+                nodes.clear();
+                rowStart.clear();
+
+                //parse the rows with the bias term first
+                for (const QString& line : chunk.lines) {
+
+                    rowStart.push_back(nodes.size());
+                    nodes.push_back({1, 1.0});
+
+                    int index = 2;
+                    for (const QString& xPrime : line.split(",")) {
+                        nodes.push_back({index++, xPrime.toDouble()});
+                    }
+
+                    //add the terminal node
+                    nodes.push_back({-1, 0});
+                }
+
+                //make the predictions, the rows point into nodes once it is filled
+                rows.clear();
+                for (size_t start : rowStart) {
+                    rows.push_back(&nodes[start]);
+                }
+                chunk.predictions.resize(rows.size());
+                svm_predict_batch(model, rows.data(), (int)rows.size(), chunk.predictions.data());
+
+                //the lines are no longer needed
+                chunk.lines = QStringList();
+
+                scoredChunks.push(std::move(chunk));
+            }
+
+            //the last worker ends the output
+            std::lock_guard<std::mutex> lock(workersMutex);
+            if (--workersLeft == 0) {
+                scoredChunks.close();
+            }
+        });
+    }
+
+    //write the chunks in order, holding those that arrive early
+    QTextStream out(&outFile);
+    out.setRealNumberPrecision(17);
+    out << "prediction" << Qt::endl;
+
+    std::map<qint64, ScoringChunk> pending;
+    qint64 nextSeq = 0;
+    qint64 rows = 0;
+
+    ScoringChunk chunk;
+    while (scoredChunks.pop(chunk)) {
+
+        pending.emplace(chunk.seq, std::move(chunk));
+
+        for (auto it = pending.find(nextSeq); it != pending.end(); it = pending.find(nextSeq)) {
+
+            for (double pred : it->second.predictions) {
+                out << pred << '\n';
+            }
+            rows += it->second.predictions.size();
+
+            pending.erase(it);
+            nextSeq++;
+
+            //free the slot for the reader
+            std::lock_guard<std::mutex> lock(flightMutex);
+            inFlight--;
+            flightDone.notify_one();
+        }
+    }
+
+    reader.join();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    out.flush();
+    outFile.close();
+    inFile.close();
+
+    return rows;
+}
+
+/*
+ * Confusion matrix over an arbitrary set of labels
+ * Chunks of labels and predictions are added as they come, so the
+ * predictions of a whole file never have to be in memory at once
+ * Large chunks are counted on several threads, each into its own matrix,
+ * and the partial matrices are merged
+ * Pairs with a NaN label or prediction are skipped
+ */
+class ConfusionMatrix {
+public:
+    //numThreads <= 0 uses all cores
+    explicit ConfusionMatrix(int numThreads = 0) : numThreads(numThreads) {
+        if (this->numThreads <= 0) {
+            this->numThreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    //add a chunk of labels and their predictions
+    void add(const double* yTrue, const double* yPred, size_t n) {
+
+        //leave enough rows to each thread to pay for starting it
+        size_t threads = std::min((size_t)numThreads, n / minRowsPerThread);
+
+        if (threads <= 1) {
+            count(yTrue, yPred, n);
+            return;
+        }
+
+        std::vector<ConfusionMatrix> partial(threads, ConfusionMatrix(1));
+        std::vector<std::thread> workers;
+
+        for (size_t t = 0; t < threads; t++) {
+            size_t begin = n * t / threads;
+            size_t end = n * (t + 1) / threads;
+            workers.emplace_back([&partial, yTrue, yPred, t, begin, end] {
+                partial[t].count(yTrue + begin, yPred + begin, end - begin);
+            });
+        }
+
+        for (size_t t = 0; t < threads; t++) {
+            workers[t].join();
+            merge(partial[t]);
+        }
+    }
+
+    void add(const std::vector<double>& yTrue, const std::vector<double>& yPred) {
+        if (yTrue.size() != yPred.size()) {
+            qInfo() << "Labels and predictions differ in length, only the common rows are counted!";
+        }
+        add(yTrue.data(), yPred.data(), std::min(yTrue.size(), yPred.size()));
+    }
+
+    //add the counts of another matrix, e.g. of another chunk of the data
+    void merge(const ConfusionMatrix& other) {
+
+        //classes of this matrix for the labels of the other one
+        std::vector<int> classes;
+        for (double label : other.labels) {
+            classes.push_back(classOf(label));
+        }
+
+        for (size_t a = 0; a < classes.size(); a++) {
+            for (size_t b = 0; b < classes.size(); b++) {
+                counts[classes[a]][classes[b]] += other.counts[a][b];
+            }
+        }
+
+        total += other.total;
+        skipped += other.skipped;
+    }
+
+    //labels seen so far, in increasing order
+    std::vector<double> sortedLabels() const {
+        std::vector<double> sorted = labels;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted;
+    }
+
+    //number of rows with label trueLabel predicted as predLabel
+    qint64 at(double trueLabel, double predLabel) const {
+        auto a = index.find(trueLabel);
+        auto b = index.find(predLabel);
+        if (a == index.end() || b == index.end()) {
+            return 0;
+        }
+        return counts[a->second][b->second];
+    }
+
+    //number of rows counted
+    qint64 size() const {
+        return total;
+    }
+
+    //print the matrix, the per-class metrics and their averages
+    void report(QTextStream& stream) const {
+
+        if (total == 0) {
+            stream << "No predictions to evaluate." << Qt::endl;
+            return;
+        }
+
+        //order of the classes by label
+        std::vector<int> order(labels.size());
+        for (size_t c = 0; c < order.size(); c++) {
+            order[c] = c;
+        }
+        std::sort(order.begin(), order.end(), [this](int a, int b) { return labels[a] < labels[b]; });
+
+        auto cell = [](const QString& text) { return text.rightJustified(12); };
+        auto number = [](double value) { return QString::number(value, 'f', 4).rightJustified(12); };
+
+        //the confusion matrix, rows are labels and columns predictions
+        stream << "Confusion matrix (rows: label, columns: prediction)" << Qt::endl;
+        stream << cell("");
+        for (int b : order) {
+            stream << cell(QString::number(labels[b]));
+        }
+        stream << Qt::endl;
+        for (int a : order) {
+            stream << cell(QString::number(labels[a]));
+            for (int b : order) {
+                stream << cell(QString::number(counts[a][b]));
+            }
+            stream << Qt::endl;
+        }
+        stream << Qt::endl;
+
+        stream << cell("") << cell("precision") << cell("recall") << cell("f1") << cell("support") << Qt::endl;
+
+        double macroPrecision = 0.0;
+        double macroRecall = 0.0;
+        double macroF1 = 0.0;
+        qint64 correct = 0;
+
+        for (int c : order) {
+
+            //true positives, rows predicted as c and rows labelled c
+            qint64 tp = counts[c][c];
+            qint64 predicted = 0;
+            qint64 support = 0;
+            for (size_t k = 0; k < labels.size(); k++) {
+                predicted += counts[k][c];
+                support += counts[c][k];
+            }
+
+            //a class never predicted or never present scores 0 instead of dividing by zero
+            double precision = predicted > 0 ? (double)tp / predicted : 0.0;
+            double recall = support > 0 ? (double)tp / support : 0.0;
+            double f1 = precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0.0;
+
+            stream << cell(QString::number(labels[c])) << number(precision) << number(recall) << number(f1)
+                   << cell(QString::number(support)) << Qt::endl;
+
+            macroPrecision += precision;
+            macroRecall += recall;
+            macroF1 += f1;
+            correct += tp;
+        }
+
+        double numClasses = (double)labels.size();
+
+        //with one prediction per row, micro precision, recall and f1 all equal the accuracy
+        double micro = (double)correct / total;
+
+        stream << Qt::endl;
+        stream << cell("macro avg") << number(macroPrecision / numClasses) << number(macroRecall / numClasses)
+               << number(macroF1 / numClasses) << cell(QString::number(total)) << Qt::endl;
+        stream << cell("micro avg") << number(micro) << number(micro) << number(micro)
+               << cell(QString::number(total)) << Qt::endl;
+        stream << Qt::endl;
+        stream << "Accuracy: " << QString::number(micro, 'f', 4) << Qt::endl;
+
+        if (skipped > 0) {
+            stream << "Skipped (NaN): " << skipped << Qt::endl;
+        }
+
+        stream.flush();
+    }
+
+private:
+    //count a range on the calling thread
+    void count(const double* yTrue, const double* yPred, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (std::isnan(yTrue[i]) || std::isnan(yPred[i])) {
+                skipped++;
+                continue;
+            }
+            //both classes first, a new one grows the matrix
+            int a = classOf(yTrue[i]);
+            int b = classOf(yPred[i]);
+            counts[a][b]++;
+            total++;
+        }
+    }
+
+    //class of a label, a new class is added for an unseen label
+    int classOf(double label) {
+
+        //svm labels are small integers, looked up in a table instead of the map
+        bool small = label >= -1 && label < smallLabels - 1 && (int)label == label;
+
+        if (small) {
+            if (smallIndex.empty()) {
+                smallIndex.assign(smallLabels, -1);
+            }
+            if (smallIndex[(int)label + 1] >= 0) {
+                return smallIndex[(int)label + 1];
+            }
+        } else {
+            auto it = index.find(label);
+            if (it != index.end()) {
+                return it->second;
+            }
+        }
+
+        int c = labels.size();
+        labels.push_back(label);
+        index[label] = c;
+        if (small) {
+            smallIndex[(int)label + 1] = c;
+        }
+
+        //grow the matrix by one row and one column
+        for (std::vector<qint64>& row : counts) {
+            row.push_back(0);
+        }
+        counts.emplace_back(c + 1, 0);
+
+        return c;
+    }
+
+    static const size_t minRowsPerThread = 1 << 16;
+    static const int smallLabels = 4096;   //labels -1 to 4094
+
+    int numThreads;
+    std::vector<double> labels;     //in the order first seen
+    std::map<double, int> index;
+    std::vector<int> smallIndex;    //class of label - 1, -1 if unseen
+    std::vector<std::vector<qint64>> counts;    //counts[label class][prediction class]
+    qint64 total = 0;
+    qint64 skipped = 0;
+};
+
+/*
+ * Function to evaluate a predictions csv against a labels csv without loading them
+ * Both files are read chunkSize rows at a time into matrix, the first line is the header
+ * Returns the number of rows compared or -1
+ */
+qint64 evaluateCSV(const QString& yTrueFilename, const QString& yPredFilename, ConfusionMatrix& matrix, int chunkSize) {
+
+    QFile trueFile(yTrueFilename);
+    QFile predFile(yPredFilename);
+
+    if (!trueFile.open(QIODevice::ReadOnly) || !predFile.open(QIODevice::ReadOnly)) {
+        qInfo() << "Unable to open the file!";
+        return -1;
+    }
+
+    QTextStream trueStream(&trueFile);
+    QTextStream predStream(&predFile);
+
+    //skip the headers
+    trueStream.readLine();
+    predStream.readLine();
+
+    std::vector<double> yTrue;
+    std::vector<double> yPred;
+    yTrue.reserve(chunkSize);
+    yPred.reserve(chunkSize);
+
+    qint64 rows = 0;
+    QString trueLine;
+    QString predLine;
+
+    while (true) {
+
+        yTrue.clear();
+        yPred.clear();
+
+        //read the next chunk of rows from both files
+        while ((int)yTrue.size() < chunkSize && trueStream.readLineInto(&trueLine) && predStream.readLineInto(&predLine)) {
+            //labels are cast to int like getData does
+            yTrue.push_back((int)trueLine.toDouble());
+            yPred.push_back(predLine.toDouble());
+        }
+
+        if (yTrue.empty()) {
+            break;
+        }
+
+        matrix.add(yTrue, yPred);
+        rows += yTrue.size();
+    }
+
+    if (!trueStream.atEnd() || !predStream.atEnd()) {
+        qInfo() << "Labels and predictions differ in length, only the common rows are counted!";
+    }
+
+    trueFile.close();
+    predFile.close();
+
+    return rows;
 }
 
+//function to compute the performance metrics
+void classificationReport(const std::vector<double>& yTrue, const std::vector<double>& yPred, QTextStream& stream) {
+
+    ConfusionMatrix matrix;
+    matrix.add(yTrue, yPred);
+    matrix.report(stream);
+}
 
 #endif // UTILS_H